@@ -0,0 +1,281 @@
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dlfcn.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include "aot.h"
+#include "cache.h"
+#include "memory.h"
+
+//Where the generated C finds vm.h, set by the Makefile
+#ifndef AOT_INCLUDE_DIR
+#define AOT_INCLUDE_DIR "."
+#endif
+
+//Functions are numbered in the same preorder as the bytecode cache:
+//the script first, then each nested function as its constant is reached
+typedef struct {
+    ObjFunction** functions;
+    int count;
+    int capacity;
+} FunctionList;
+
+static void collectFunctions(FunctionList* list, ObjFunction* function){
+    if(list->capacity < list->count + 1){
+        int oldCapacity = list->capacity;
+        list->capacity = GROW_CAPACITY(oldCapacity);
+        list->functions = GROW_ARRAY(ObjFunction*, list->functions, oldCapacity, list->capacity);
+    }
+    list->functions[list->count++] = function;
+    for(int i = 0; i < function->chunk.constants.count; i++){
+        Value constant = function->chunk.constants.values[i];
+        if(IS_FUNCTION(constant)) collectFunctions(list, AS_FUNCTION(constant));
+    }
+}
+
+static void freeFunctionList(FunctionList* list){
+    FREE_ARRAY(ObjFunction*, list->functions, list->capacity);
+}
+
+//Ops the emitter knows how to translate
+static bool canEmit(uint8_t instruction){
+    switch(instruction){
+        case OP_CONSTANT_LONG:
+        case OP_GET_UPVALUE:
+        case OP_SET_UPVALUE:
+        case OP_YIELD:
+        case OP_RESUME:
+        case OP_CLOSE_UPVALUE:
+        case OP_CAPTURE:
+            return false;
+        default:
+            return instructionLength(instruction) > 0;
+    }
+}
+
+static void emitNumberCheck(FILE* out, int a, int b, int line, const char* message){
+    fprintf(out, "    if(!IS_NUMERIC(s[%d]) || !IS_NUMERIC(s[%d])) { compiledError(vm, function, %d, \"%s\"); return false; }\n",
+            a, b, line, message);
+}
+
+//function is one of value.h's, the same the interpreter uses
+static void emitBinary(FILE* out, int top, int line, const char* function){
+    emitNumberCheck(out, top - 1, top, line, "Operands must be numbers");
+    fprintf(out, "    s[%d] = %s(s[%d], s[%d]);\n", top - 1, function, top - 1, top);
+}
+
+static void emitInstruction(FILE* out, ObjFunction* function, int offset, int depth){
+    Chunk* chunk = &function->chunk;
+    uint8_t* code = &chunk->code[offset];
+    int line = getLine(chunk, offset);
+    int top = depth - 1;
+
+    switch(genericOpcode(code[0])){
+        case OP_CONSTANT: {
+            Value constant = chunk->constants.values[code[1]];
+            if(IS_NUMBER(constant)) {
+                fprintf(out, "    s[%d] = NUMBER_VAL(%a);\n", depth, AS_NUM(constant));
+            } else if(IS_INT(constant)) {
+                fprintf(out, "    s[%d] = INT_VAL(%" PRId64 "ll);\n", depth, AS_INT(constant));
+            } else {
+                fprintf(out, "    s[%d] = k[%d];\n", depth, code[1]);
+            }
+            break;
+        }
+        case OP_RETURN:
+            fprintf(out, "    *result = s[%d];\n    return true;\n", top);
+            break;
+        case OP_NEGATE:
+            fprintf(out, "    if(!IS_NUMERIC(s[%d])) { compiledError(vm, function, %d, \"Operand must be a number\"); return false; }\n", top, line);
+            fprintf(out, "    s[%d] = negateValue(s[%d]);\n", top, top);
+            break;
+        case OP_ADD:
+            fprintf(out, "    if(IS_STRING(s[%d]) && IS_STRING(s[%d])) {\n", top - 1, top);
+            fprintf(out, "        ObjString* joined = concatenateStrings(vm, AS_STRING(s[%d]), AS_STRING(s[%d]));\n", top - 1, top);
+            fprintf(out, "        if(joined == NULL) { memoryError(vm, function, %d); return false; }\n", line);
+            fprintf(out, "        s[%d] = OBJ_VAL(joined);\n", top - 1);
+            fprintf(out, "    } else {\n");
+            emitBinary(out, top, line, "addValues");
+            fprintf(out, "    }\n");
+            break;
+        case OP_INCREMENT:
+            fprintf(out, "    if(!IS_NUMERIC(s[%d])) { compiledError(vm, function, %d, \"Value must be number\"); return false; }\n", top, line);
+            fprintf(out, "    s[%d] = addValues(s[%d], INT_VAL(1));\n", depth, top);
+            break;
+        case OP_SUBTRACT: emitBinary(out, top, line, "subtractValues"); break;
+        case OP_MULTIPLY: emitBinary(out, top, line, "multiplyValues"); break;
+        case OP_DIVIDE: emitBinary(out, top, line, "divideValues"); break;
+        case OP_GREATER: emitBinary(out, top, line, "greaterValues"); break;
+        case OP_LESS: emitBinary(out, top, line, "lessValues"); break;
+        case OP_TRUE: fprintf(out, "    s[%d] = BOOL_VAL(true);\n", depth); break;
+        case OP_FALSE: fprintf(out, "    s[%d] = BOOL_VAL(false);\n", depth); break;
+        case OP_NIL: fprintf(out, "    s[%d] = NIL_VAL;\n", depth); break;
+        case OP_NOT: fprintf(out, "    s[%d] = BOOL_VAL(isFalsey(s[%d]));\n", top, top); break;
+        case OP_EQUAL:
+            fprintf(out, "    s[%d] = BOOL_VAL(valuesEqual(s[%d], s[%d]));\n", top - 1, top - 1, top);
+            break;
+        case OP_PRINT:
+            fprintf(out, "    printValue(s[%d]);\n    printf(\"\\n\");\n", top);
+            break;
+        case OP_POP:
+            break;
+        case OP_DEFINE_GLOBAL:
+            fprintf(out, "    tableSet(&vm->globals, AS_STRING(k[%d]), s[%d]);\n", code[1], top);
+            break;
+        case OP_GET_GLOBAL:
+            fprintf(out, "    if(!tableGet(&vm->globals, AS_STRING(k[%d]), &s[%d])) {\n", code[1], depth);
+            fprintf(out, "        compiledError(vm, function, %d, \"Undefined variable '%%s' .\", AS_CSTRING(k[%d]));\n", line, code[1]);
+            fprintf(out, "        return false;\n    }\n");
+            break;
+        case OP_SET_GLOBAL:
+            fprintf(out, "    if(tableSet(&vm->globals, AS_STRING(k[%d]), s[%d])) {\n", code[1], top);
+            fprintf(out, "        tableDelete(&vm->globals, AS_STRING(k[%d]));\n", code[1]);
+            fprintf(out, "        compiledError(vm, function, %d, \"Undefined variable '%%s'.\", AS_CSTRING(k[%d]));\n", line, code[1]);
+            fprintf(out, "        return false;\n    }\n");
+            break;
+        case OP_GET_LOCAL: fprintf(out, "    s[%d] = s[%d];\n", depth, code[1]); break;
+        case OP_SET_LOCAL: fprintf(out, "    s[%d] = s[%d];\n", code[1], top); break;
+        case OP_JUMP_IF_FALSE:
+            fprintf(out, "    if(isFalsey(s[%d])) goto L%d;\n", top, jumpTarget(chunk->code, offset));
+            break;
+        case OP_JUMP:
+        case OP_LOOP:
+            fprintf(out, "    goto L%d;\n", jumpTarget(chunk->code, offset));
+            break;
+        case OP_CALL: {
+            int callee = top - code[1];
+            fprintf(out, "    if(!callCompiled(vm, &s[%d], %d, &s[%d])) return false;\n", callee, code[1], callee);
+            break;
+        }
+        case OP_CLOSURE:
+            fprintf(out, "    {\n        ObjClosure* closure = newClosure(vm, AS_FUNCTION(k[%d]));\n", code[1]);
+            fprintf(out, "        if(closure == NULL) { memoryError(vm, function, %d); return false; }\n", line);
+            fprintf(out, "        s[%d] = OBJ_VAL(closure);\n    }\n", depth);
+            break;
+    }
+}
+
+static bool emitFunction(FILE* out, ObjFunction* function, int index){
+    Chunk* chunk = &function->chunk;
+    int* depths = ALLOCATE(int, chunk->count);
+    bool* targets = ALLOCATE(bool, chunk->count);
+    //The stack depth at every instruction is fixed by the compiler, so
+    //each value gets its own C slot and no stack pointer is needed
+    int maxDepth = analyzeStack(chunk, function->arity + 1, depths, targets);
+    for(int offset = 0; maxDepth >= 0 && offset < chunk->count; offset += instructionLength(chunk->code[offset])){
+        if(depths[offset] != -1 && !canEmit(genericOpcode(chunk->code[offset]))) maxDepth = -1;
+    }
+
+    if(maxDepth >= 0) {
+        fprintf(out, "//%s\n", function->name == NULL ? "<script>" : function->name->chars);
+        fprintf(out, "static bool lox_fn_%d(VM* vm, Value* args, Value* result) {\n", index);
+        fprintf(out, "    Value s[%d];\n", maxDepth);
+        fprintf(out, "    memcpy(s, args, sizeof(Value) * %d);\n", function->arity + 1);
+        fprintf(out, "    ObjFunction* function = AS_CLOSURE(s[0])->function;\n");
+        fprintf(out, "    Value* k = function->chunk.constants.values;\n");
+        fprintf(out, "    (void)k;\n");
+        for(int offset = 0; offset < chunk->count; offset += instructionLength(chunk->code[offset])){
+            if(depths[offset] == -1) continue;
+            if(targets[offset]) fprintf(out, "L%d:\n", offset);
+            emitInstruction(out, function, offset, depths[offset]);
+        }
+        fprintf(out, "}\n\n");
+    }
+
+    FREE_ARRAY(int, depths, chunk->count);
+    FREE_ARRAY(bool, targets, chunk->count);
+    return maxDepth >= 0;
+}
+
+//Functions using anything the emitter can't translate (upvalues for
+//now) get a NULL entry and keep running in the interpreter
+bool emitC(const char* path, const char* source, ObjFunction* script){
+    FILE* out = fopen(path, "w");
+    if(out == NULL) return false;
+
+    FunctionList list = {NULL, 0, 0};
+    collectFunctions(&list, script);
+    bool* emitted = ALLOCATE(bool, list.count);
+
+    fprintf(out, "//Generated by --emit-c, rebuilt whenever the script changes\n");
+    fprintf(out, "#include <stdio.h>\n#include <string.h>\n#include \"vm.h\"\n\n");
+    fprintf(out, "const uint64_t lox_source_hash = %#llxull;\n", (unsigned long long)hashSource(source));
+    fprintf(out, "const uint32_t lox_version = %d;\n", CACHE_VERSION);
+    fprintf(out, "const uint32_t lox_value_size = %d;\n", (int)sizeof(Value));
+    fprintf(out, "const int lox_function_count = %d;\n\n", list.count);
+    for(int i = 0; i < list.count; i++){
+        emitted[i] = emitFunction(out, list.functions[i], i);
+    }
+    fprintf(out, "const CompiledFn lox_functions[] = {\n");
+    for(int i = 0; i < list.count; i++){
+        if(emitted[i]) {
+            fprintf(out, "    lox_fn_%d,\n", i);
+        } else {
+            fprintf(out, "    NULL,\n");
+        }
+    }
+    fprintf(out, "};\n");
+
+    FREE_ARRAY(bool, emitted, list.count);
+    freeFunctionList(&list);
+    return fclose(out) == 0;
+}
+
+//Hands the generated C to the system compiler. The result calls back
+//into the executable, which is linked with -rdynamic for that
+bool buildNative(const char* cPath, const char* nativePath){
+    pid_t pid = fork();
+    if(pid < 0) return false;
+    if(pid == 0) {
+        execlp("cc", "cc", "-O2", "-shared", "-fPIC", "-w", "-I", AOT_INCLUDE_DIR,
+               "-o", nativePath, cPath, (char*)NULL);
+        _exit(127);
+    }
+    int status;
+    if(waitpid(pid, &status, 0) < 0) return false;
+    return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+//Attaches the native build to the freshly compiled script. Anything stale
+//or missing just leaves the script to the interpreter. The library is
+//never closed since the functions live as long as the VM
+bool loadNative(const char* path, const char* source, ObjFunction* script){
+    if(access(path, R_OK) != 0) return false;
+    //Without a slash dlopen would search the library path instead
+    void* library;
+    if(strchr(path, '/') == NULL) {
+        size_t length = strlen(path) + 3;
+        char* relative = ALLOCATE(char, length);
+        snprintf(relative, length, "./%s", path);
+        library = dlopen(relative, RTLD_NOW | RTLD_LOCAL);
+        FREE_ARRAY(char, relative, length);
+    } else {
+        library = dlopen(path, RTLD_NOW | RTLD_LOCAL);
+    }
+    if(library == NULL) return false;
+
+    const uint64_t* sourceHash = dlsym(library, "lox_source_hash");
+    const uint32_t* version = dlsym(library, "lox_version");
+    const uint32_t* valueSize = dlsym(library, "lox_value_size");
+    const int* count = dlsym(library, "lox_function_count");
+    const CompiledFn* compiled = dlsym(library, "lox_functions");
+    //A build from before NAN_BOXING was toggled has the wrong Value layout
+    if(sourceHash == NULL || version == NULL || valueSize == NULL || count == NULL || compiled == NULL ||
+       *sourceHash != hashSource(source) || *version != CACHE_VERSION || *valueSize != sizeof(Value)) {
+        dlclose(library);
+        return false;
+    }
+
+    FunctionList list = {NULL, 0, 0};
+    collectFunctions(&list, script);
+    bool matches = list.count == *count;
+    if(matches) {
+        for(int i = 0; i < list.count; i++) list.functions[i]->compiled = compiled[i];
+    } else {
+        dlclose(library);
+    }
+    freeFunctionList(&list);
+    return matches;
+}
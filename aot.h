@@ -0,0 +1,13 @@
+#ifndef cInterp_aot_h
+#define cInterp_aot_h
+
+#include "common.h"
+#include "object.h"
+
+//--emit-c: every function in a script becomes a C function, built
+//into a shared object the VM loads and calls instead of interpreting
+bool emitC(const char* path, const char* source, ObjFunction* script);
+bool buildNative(const char* cPath, const char* nativePath);
+bool loadNative(const char* path, const char* source, ObjFunction* script);
+
+#endif
@@ -0,0 +1,68 @@
+#include <string.h>
+#include "arena.h"
+#include "memory.h"
+
+#define ARENA_BLOCK_SIZE (16 * 1024)
+#define ARENA_ALIGN(size) (((size) + 7) & ~(size_t)7)
+
+void initArena(Arena* arena){
+    arena->blocks = NULL;
+}
+
+static char* blockData(ArenaBlock* block){
+    return (char*)block + ARENA_ALIGN(sizeof(ArenaBlock));
+}
+
+static ArenaBlock* newBlock(Arena* arena, size_t minSize){
+    size_t capacity = minSize > ARENA_BLOCK_SIZE ? minSize : ARENA_BLOCK_SIZE;
+    ArenaBlock* block = (ArenaBlock*)reallocate(NULL, 0, ARENA_ALIGN(sizeof(ArenaBlock)) + capacity);
+    block->capacity = capacity;
+    block->used = 0;
+    block->last = NULL;
+    block->next = arena->blocks;
+    arena->blocks = block;
+    return block;
+}
+
+void* arenaAllocate(Arena* arena, size_t size){
+    size = ARENA_ALIGN(size);
+    ArenaBlock* block = arena->blocks;
+    if(block == NULL || block->capacity - block->used < size){
+        block = newBlock(arena, size);
+    }
+    char* result = blockData(block) + block->used;
+    block->used += size;
+    block->last = result;
+    return result;
+}
+
+//Falls back to the heap when there is no arena, so callers like
+//writeChunk do not care where their buffer lives
+void* arenaReallocate(Arena* arena, void* pointer, size_t oldSize, size_t newSize){
+    if(arena == NULL) return reallocate(pointer, oldSize, newSize);
+    if(newSize == 0) return NULL;
+
+    //Growing the most recent allocation just bumps the block further
+    ArenaBlock* block = arena->blocks;
+    if(pointer != NULL && block != NULL && pointer == block->last){
+        size_t start = (size_t)((char*)pointer - blockData(block));
+        if(start + ARENA_ALIGN(newSize) <= block->capacity){
+            block->used = start + ARENA_ALIGN(newSize);
+            return pointer;
+        }
+    }
+
+    void* result = arenaAllocate(arena, newSize);
+    if(pointer != NULL) memcpy(result, pointer, oldSize < newSize ? oldSize : newSize);
+    return result;
+}
+
+void freeArena(Arena* arena){
+    ArenaBlock* block = arena->blocks;
+    while(block != NULL){
+        ArenaBlock* next = block->next;
+        reallocate(block, ARENA_ALIGN(sizeof(ArenaBlock)) + block->capacity, 0);
+        block = next;
+    }
+    arena->blocks = NULL;
+}
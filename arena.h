@@ -0,0 +1,29 @@
+#ifndef cInterp_arena_h
+#define cInterp_arena_h
+
+#include "common.h"
+
+//Bump allocator for data that only lives as long as one compile.
+//Nothing is freed individually, the whole arena goes at once
+typedef struct ArenaBlock {
+    struct ArenaBlock* next;
+    size_t capacity;
+    size_t used;
+    char* last; // most recent allocation, the only one that can grow in place
+} ArenaBlock;
+
+typedef struct {
+    ArenaBlock* blocks; // newest first
+} Arena;
+
+// Same as GROW_ARRAY, but serviced by the arena when there is one
+#define GROW_ARRAY_IN(arena, type, pointer, oldCount, newCount) \
+    (type*)arenaReallocate(arena, pointer, sizeof(type) * (oldCount), \
+        sizeof(type) * (newCount))
+
+void initArena(Arena* arena);
+void* arenaAllocate(Arena* arena, size_t size);
+void* arenaReallocate(Arena* arena, void* pointer, size_t oldSize, size_t newSize);
+void freeArena(Arena* arena);
+
+#endif
@@ -0,0 +1,449 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "cache.h"
+#include "memory.h"
+#include "vm.h"
+
+//A .loxc file is a header followed by fixed size sections:
+//constants, functions, strings, line tables, bytecode and string chars.
+//Function 0 is the script, the rest follow in preorder
+#define CACHE_MAGIC "LOXC"
+#define CACHE_NONE UINT32_MAX
+
+typedef struct {
+    char magic[4];
+    uint32_t version;
+    uint64_t sourceHash;
+    uint32_t size; // whole file, guards against truncated writes
+    uint32_t functionCount;
+    uint32_t stringCount;
+    uint32_t constantCount;
+    uint32_t lineCount;
+    uint32_t codeCount;
+    uint32_t charCount;
+    uint32_t padding;
+} CacheHeader;
+
+typedef struct {
+    uint32_t name; // string index or CACHE_NONE for the script
+    uint32_t arity;
+    uint32_t upvalueCount; // maxStack and callSites are worked out again from the code
+    uint32_t constantStart;
+    uint32_t constantCount;
+    uint32_t lineStart;
+    uint32_t lineCount;
+    uint32_t codeStart;
+    uint32_t codeCount;
+} CacheFunction;
+
+typedef struct {
+    uint32_t start; // into the chars section
+    uint32_t length;
+} CacheString;
+
+typedef enum {
+    CONSTANT_NIL,
+    CONSTANT_BOOL,
+    CONSTANT_NUMBER,
+    CONSTANT_INT,
+    CONSTANT_STRING,
+    CONSTANT_FUNCTION,
+} CacheConstantType;
+
+typedef struct {
+    uint32_t type;
+    uint32_t index; // string or function index, or the bool
+    union {
+        double number;
+        int64_t integer;
+    };
+} CacheConstant;
+
+//Section starts, worked out from the counts in the header
+typedef struct {
+    size_t functions;
+    size_t strings;
+    size_t constants;
+    size_t lines;
+    size_t code;
+    size_t chars;
+    size_t end;
+} CacheLayout;
+
+uint64_t hashSource(const char* source){
+    //64 bit FNV-1a, same scheme as hashString
+    uint64_t hash = 14695981039346656037u;
+    for(const char* c = source; *c != '\0'; c++){
+        hash ^= (uint8_t)*c;
+        hash *= 1099511628211u;
+    }
+    return hash;
+}
+
+static CacheLayout layoutFor(CacheHeader* header){
+    CacheLayout layout;
+    //Constants hold a double so they go first, where they stay 8 byte aligned
+    layout.constants = sizeof(CacheHeader);
+    layout.functions = layout.constants + sizeof(CacheConstant) * (size_t)header->constantCount;
+    layout.strings = layout.functions + sizeof(CacheFunction) * (size_t)header->functionCount;
+    layout.lines = layout.strings + sizeof(CacheString) * (size_t)header->stringCount;
+    layout.code = layout.lines + sizeof(LineStart) * (size_t)header->lineCount;
+    layout.chars = layout.code + header->codeCount;
+    layout.end = layout.chars + header->charCount;
+    return layout;
+}
+
+//Everything reachable from the script, gathered before writing
+typedef struct {
+    ObjFunction** functions;
+    int functionCount;
+    int functionCapacity;
+    ObjString** strings;
+    int stringCount;
+    int stringCapacity;
+    Table stringIndex; // string -> NUMBER_VAL(index)
+} CacheWriter;
+
+static uint32_t addString(CacheWriter* writer, ObjString* string){
+    Value index;
+    if(tableGet(&writer->stringIndex, string, &index)) return (uint32_t)AS_NUM(index);
+
+    if(writer->stringCapacity < writer->stringCount + 1){
+        int oldCapacity = writer->stringCapacity;
+        writer->stringCapacity = GROW_CAPACITY(oldCapacity);
+        writer->strings = GROW_ARRAY(ObjString*, writer->strings, oldCapacity, writer->stringCapacity);
+    }
+    writer->strings[writer->stringCount] = string;
+    tableSet(&writer->stringIndex, string, NUMBER_VAL(writer->stringCount));
+    return writer->stringCount++;
+}
+
+static void collectFunction(CacheWriter* writer, ObjFunction* function){
+    if(writer->functionCapacity < writer->functionCount + 1){
+        int oldCapacity = writer->functionCapacity;
+        writer->functionCapacity = GROW_CAPACITY(oldCapacity);
+        writer->functions = GROW_ARRAY(ObjFunction*, writer->functions, oldCapacity, writer->functionCapacity);
+    }
+    writer->functions[writer->functionCount++] = function;
+    if(function->name != NULL) addString(writer, function->name);
+
+    Chunk* chunk = &function->chunk;
+    for(int i = 0; i < chunk->constants.count; i++){
+        Value constant = chunk->constants.values[i];
+        if(IS_STRING(constant)) addString(writer, AS_STRING(constant));
+        else if(IS_FUNCTION(constant)) collectFunction(writer, AS_FUNCTION(constant));
+    }
+}
+
+static uint32_t functionIndex(CacheWriter* writer, ObjFunction* function){
+    for(int i = 0; i < writer->functionCount; i++){
+        if(writer->functions[i] == function) return i;
+    }
+    return CACHE_NONE;
+}
+
+static bool writeCacheConstant(CacheWriter* writer, Value value, CacheConstant* constant){
+    constant->index = 0;
+    constant->number = 0;
+    if(IS_NIL(value)) {
+        constant->type = CONSTANT_NIL;
+    } else if(IS_BOOL(value)) {
+        constant->type = CONSTANT_BOOL;
+        constant->index = AS_BOOL(value);
+    } else if(IS_NUMBER(value)) {
+        constant->type = CONSTANT_NUMBER;
+        constant->number = AS_NUM(value);
+    } else if(IS_INT(value)) {
+        constant->type = CONSTANT_INT;
+        constant->integer = AS_INT(value);
+    } else if(IS_STRING(value)) {
+        constant->type = CONSTANT_STRING;
+        constant->index = addString(writer, AS_STRING(value));
+    } else if(IS_FUNCTION(value)) {
+        constant->type = CONSTANT_FUNCTION;
+        constant->index = functionIndex(writer, AS_FUNCTION(value));
+    } else {
+        //Only the compiler's own constants can be cached
+        return false;
+    }
+    return true;
+}
+
+//Serializes the function tree into one buffer, then swaps it in
+//with a rename so a half written cache is never read
+bool writeCache(const char* path, const char* source, ObjFunction* function){
+    CacheWriter writer = {NULL, 0, 0, NULL, 0, 0};
+    initTable(&writer.stringIndex);
+    collectFunction(&writer, function);
+
+    CacheHeader header;
+    memcpy(header.magic, CACHE_MAGIC, 4);
+    header.version = CACHE_VERSION;
+    header.sourceHash = hashSource(source);
+    header.functionCount = writer.functionCount;
+    header.stringCount = writer.stringCount;
+    header.constantCount = 0;
+    header.lineCount = 0;
+    header.codeCount = 0;
+    header.charCount = 0;
+    header.padding = 0;
+    for(int i = 0; i < writer.functionCount; i++){
+        Chunk* chunk = &writer.functions[i]->chunk;
+        header.constantCount += chunk->constants.count;
+        header.lineCount += chunk->lineCount;
+        header.codeCount += chunk->count;
+    }
+    for(int i = 0; i < writer.stringCount; i++){
+        header.charCount += writer.strings[i]->length + 1;
+    }
+    CacheLayout layout = layoutFor(&header);
+    header.size = (uint32_t)layout.end;
+
+    uint8_t* buffer = ALLOCATE(uint8_t, layout.end);
+    memcpy(buffer, &header, sizeof(CacheHeader));
+
+    bool success = true;
+    uint32_t constantStart = 0, lineStart = 0, codeStart = 0;
+    for(int i = 0; i < writer.functionCount; i++){
+        ObjFunction* current = writer.functions[i];
+        Chunk* chunk = &current->chunk;
+        CacheFunction* record = (CacheFunction*)(buffer + layout.functions) + i;
+        record->name = current->name == NULL ? CACHE_NONE : addString(&writer, current->name);
+        record->arity = current->arity;
+        record->upvalueCount = current->upvalueCount;
+        record->constantStart = constantStart;
+        record->constantCount = chunk->constants.count;
+        record->lineStart = lineStart;
+        record->lineCount = chunk->lineCount;
+        record->codeStart = codeStart;
+        record->codeCount = chunk->count;
+
+        CacheConstant* constants = (CacheConstant*)(buffer + layout.constants) + constantStart;
+        for(int j = 0; j < chunk->constants.count; j++){
+            if(!writeCacheConstant(&writer, chunk->constants.values[j], &constants[j])) success = false;
+        }
+        if(chunk->lineCount > 0){
+            memcpy((LineStart*)(buffer + layout.lines) + lineStart, chunk->lines, sizeof(LineStart) * chunk->lineCount);
+        }
+        copyGenericCode(chunk, buffer + layout.code + codeStart);
+        constantStart += chunk->constants.count;
+        lineStart += chunk->lineCount;
+        codeStart += chunk->count;
+    }
+
+    uint32_t charStart = 0;
+    for(int i = 0; i < writer.stringCount; i++){
+        ObjString* string = writer.strings[i];
+        CacheString* record = (CacheString*)(buffer + layout.strings) + i;
+        record->start = charStart;
+        record->length = string->length;
+        memcpy(buffer + layout.chars + charStart, string->chars, string->length + 1);
+        charStart += string->length + 1;
+    }
+
+    if(success){
+        size_t tempLength = strlen(path) + 5;
+        char* tempPath = ALLOCATE(char, tempLength);
+        snprintf(tempPath, tempLength, "%s.tmp", path);
+        FILE* file = fopen(tempPath, "wb");
+        success = file != NULL;
+        if(file != NULL){
+            success = fwrite(buffer, 1, layout.end, file) == layout.end;
+            success = fclose(file) == 0 && success;
+        }
+        if(success) success = rename(tempPath, path) == 0;
+        if(!success) remove(tempPath);
+        FREE_ARRAY(char, tempPath, tempLength);
+    }
+
+    FREE_ARRAY(uint8_t, buffer, layout.end);
+    FREE_ARRAY(ObjFunction*, writer.functions, writer.functionCapacity);
+    FREE_ARRAY(ObjString*, writer.strings, writer.stringCapacity);
+    freeTable(&writer.stringIndex);
+    return success;
+}
+
+//Checks every index and range in the file before anything is built,
+//a stale or corrupt cache just counts as a miss. The bytecode itself is
+//checked by verifyChunk once the constants it refers to exist
+static bool validateCache(uint8_t* base, size_t size, const char* source){
+    if(size < sizeof(CacheHeader)) return false;
+    CacheHeader* header = (CacheHeader*)base;
+    if(memcmp(header->magic, CACHE_MAGIC, 4) != 0) return false;
+    if(header->version != CACHE_VERSION) return false;
+    if(header->sourceHash != hashSource(source)) return false;
+    if(header->size != size || header->functionCount == 0) return false;
+
+    CacheLayout layout = layoutFor(header);
+    if(layout.end != size) return false;
+
+    CacheFunction* functions = (CacheFunction*)(base + layout.functions);
+    CacheConstant* constants = (CacheConstant*)(base + layout.constants);
+    for(uint32_t i = 0; i < header->functionCount; i++){
+        CacheFunction* function = &functions[i];
+        if(function->name != CACHE_NONE && function->name >= header->stringCount) return false;
+        if((uint64_t)function->constantStart + function->constantCount > header->constantCount) return false;
+        if((uint64_t)function->lineStart + function->lineCount > header->lineCount) return false;
+        if((uint64_t)function->codeStart + function->codeCount > header->codeCount) return false;
+        if(function->codeCount == 0 || function->lineCount == 0) return false;
+        if(function->arity > 255 || function->upvalueCount > UINT8_COUNT) return false;
+
+        //Preorder means a nested function always comes after its parent,
+        //which also rules out cycles in the tree
+        for(uint32_t j = 0; j < function->constantCount; j++){
+            CacheConstant* constant = &constants[function->constantStart + j];
+            if(constant->type == CONSTANT_FUNCTION &&
+               (constant->index <= i || constant->index >= header->functionCount)) return false;
+        }
+    }
+
+    CacheString* strings = (CacheString*)(base + layout.strings);
+    for(uint32_t i = 0; i < header->stringCount; i++){
+        if((uint64_t)strings[i].start + strings[i].length >= header->charCount) return false;
+    }
+
+    for(uint32_t i = 0; i < header->constantCount; i++){
+        switch(constants[i].type){
+            case CONSTANT_NIL:
+            case CONSTANT_BOOL:
+            case CONSTANT_NUMBER:
+                break;
+            case CONSTANT_INT:
+                if(constants[i].integer < INT_VAL_MIN || constants[i].integer > INT_VAL_MAX) return false;
+                break;
+            case CONSTANT_STRING:
+                if(constants[i].index >= header->stringCount) return false;
+                break;
+            case CONSTANT_FUNCTION:
+                if(constants[i].index >= header->functionCount) return false;
+                break;
+            default:
+                return false;
+        }
+    }
+    return true;
+}
+
+//Drops the objects a rejected cache made, newest first back to mark,
+//along with the strings it interned
+static void discardObjects(VM* vm, Obj* mark){
+    while(vm->objects != mark){
+        Obj* object = vm->objects;
+        vm->objects = object->next;
+        if(object->type == OBJ_STRING) tableDelete(&vm->strings, (ObjString*)object);
+        freeObject(object);
+    }
+}
+
+//Maps the cache and builds the function tree on top of it. Bytecode and
+//line tables are used straight from the mapping rather than copied.
+//Constant tables are the only data with pointers in them, those are
+//resolved here into a sealed code arena
+ObjFunction* loadCache(VM* vm, const char* path, const char* source){
+    int fd = open(path, O_RDONLY);
+    if(fd < 0) return NULL;
+    struct stat info;
+    if(fstat(fd, &info) != 0 || info.st_size == 0) {
+        close(fd);
+        return NULL;
+    }
+    size_t size = (size_t)info.st_size;
+    //Writable but private, quickening dirties pages in memory and never the file
+    uint8_t* base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(base == MAP_FAILED) return NULL;
+
+    if(!validateCache(base, size, source)) {
+        munmap(base, size);
+        return NULL;
+    }
+    CacheHeader* header = (CacheHeader*)base;
+    CacheLayout layout = layoutFor(header);
+    CacheFunction* records = (CacheFunction*)(base + layout.functions);
+    CacheString* stringRecords = (CacheString*)(base + layout.strings);
+    CacheConstant* constantRecords = (CacheConstant*)(base + layout.constants);
+
+    //Everything made from here on goes again if the bytecode is rejected.
+    //Interning may reuse strings the VM already has
+    Obj* mark = vm->objects;
+    ObjString** strings = ALLOCATE(ObjString*, header->stringCount);
+    for(uint32_t i = 0; i < header->stringCount; i++){
+        strings[i] = internString(&vm->objects, &vm->strings, (char*)base + layout.chars + stringRecords[i].start, stringRecords[i].length);
+    }
+
+    ObjFunction** functions = ALLOCATE(ObjFunction*, header->functionCount);
+    for(uint32_t i = 0; i < header->functionCount; i++){
+        CacheFunction* record = &records[i];
+        ObjFunction* function = newFunction(&vm->objects);
+        function->arity = record->arity;
+        function->upvalueCount = record->upvalueCount;
+        function->name = record->name == CACHE_NONE ? NULL : strings[record->name];
+
+        Chunk* chunk = &function->chunk;
+        chunk->code = base + layout.code + record->codeStart;
+        chunk->count = chunk->capacity = record->codeCount;
+        chunk->lines = (LineStart*)(base + layout.lines) + record->lineStart;
+        chunk->lineCount = chunk->lineCapacity = record->lineCount;
+        chunk->packed = true;
+        functions[i] = function;
+    }
+
+    CodeArena* arena = allocateCodeArena(sizeof(CodeArena) + sizeof(Value) * header->constantCount);
+    if(arena == NULL) {
+        FREE_ARRAY(ObjString*, strings, header->stringCount);
+        FREE_ARRAY(ObjFunction*, functions, header->functionCount);
+        discardObjects(vm, mark);
+        munmap(base, size);
+        return NULL;
+    }
+    arena->mapping = base;
+    arena->mappingSize = size;
+    Value* values = (Value*)((char*)arena + sizeof(CodeArena));
+    for(uint32_t i = 0; i < header->functionCount; i++){
+        CacheFunction* record = &records[i];
+        Chunk* chunk = &functions[i]->chunk;
+        chunk->constants.values = values + record->constantStart;
+        chunk->constants.count = chunk->constants.capacity = record->constantCount;
+
+        for(uint32_t j = 0; j < record->constantCount; j++){
+            CacheConstant* constant = &constantRecords[record->constantStart + j];
+            Value value = NIL_VAL;
+            switch(constant->type){
+                case CONSTANT_NIL: value = NIL_VAL; break;
+                case CONSTANT_BOOL: value = BOOL_VAL(constant->index != 0); break;
+                case CONSTANT_NUMBER: value = NUMBER_VAL(constant->number); break;
+                case CONSTANT_INT: value = INT_VAL(constant->integer); break;
+                case CONSTANT_STRING: value = OBJ_VAL(strings[constant->index]); break;
+                case CONSTANT_FUNCTION: value = OBJ_VAL(functions[constant->index]); break;
+            }
+            chunk->constants.values[j] = value;
+        }
+    }
+
+    //Also sets maxStack and callSites, which the file isn't trusted with
+    ObjFunction* script = functions[0];
+    for(uint32_t i = 0; i < header->functionCount; i++){
+        ObjFunction* function = functions[i];
+        function->maxStack = verifyChunk(&function->chunk, function->arity, function->upvalueCount);
+        if(function->maxStack < 0) {
+            script = NULL;
+            break;
+        }
+    }
+    FREE_ARRAY(ObjString*, strings, header->stringCount);
+    FREE_ARRAY(ObjFunction*, functions, header->functionCount);
+    if(script == NULL) {
+        discardObjects(vm, mark);
+        munmap(arena, arena->size);
+        munmap(base, size);
+        return NULL;
+    }
+    adoptCodeArena(vm, arena);
+    sealCodeArena(arena);
+    return script;
+}
@@ -0,0 +1,15 @@
+#ifndef cInterp_cache_h
+#define cInterp_cache_h
+
+#include "common.h"
+#include "object.h"
+
+//Bump whenever the bytecode or the file layout changes,
+//old caches are then ignored and rewritten
+#define CACHE_VERSION 9
+
+uint64_t hashSource(const char* source);
+ObjFunction* loadCache(VM* vm, const char* path, const char* source);
+bool writeCache(const char* path, const char* source, ObjFunction* function);
+
+#endif
@@ -1,6 +1,8 @@
 #include "chunk.h"
 #include <stdlib.h>
+#include <string.h>
 #include "memory.h"
+#include "arena.h"
 
 // Intialize empty new chunk
 void initChunk(Chunk* chunk){
@@ -10,6 +12,14 @@ void initChunk(Chunk* chunk){
     chunk->lineCount = 0;
     chunk->lineCapacity = 0;
     chunk->lines = NULL;
+    chunk->packed = false;
+    chunk->arena = NULL;
+    chunk->globalSlots = NULL;
+    chunk->callSites = 0;
+    chunk->callCache = NULL;
+    chunk->loopCount = 0;
+    chunk->loopCapacity = 0;
+    chunk->loops = NULL;
     initValueArray(&chunk->constants);
 }   
 
@@ -18,7 +28,7 @@ void writeChunk(Chunk* chunk, uint8_t byte, int line){
     if(chunk->capacity < chunk->count +1) {
         int oldCapacity = chunk->capacity;
         chunk->capacity = GROW_CAPACITY(oldCapacity);
-        chunk->code = GROW_ARRAY(uint8_t, chunk->code, oldCapacity, chunk->capacity);
+        chunk->code = GROW_ARRAY_IN(chunk->arena, uint8_t, chunk->code, oldCapacity, chunk->capacity);
     }
  
     chunk->code[chunk->count] = byte;
@@ -33,7 +43,7 @@ void writeChunk(Chunk* chunk, uint8_t byte, int line){
     if(chunk->lineCapacity < chunk->lineCount + 1){
         int oldCapacity = chunk->lineCapacity;
         chunk->lineCapacity = GROW_CAPACITY(oldCapacity);
-        chunk->lines = GROW_ARRAY(LineStart,chunk->lines , oldCapacity, chunk->lineCapacity);
+        chunk->lines = GROW_ARRAY_IN(chunk->arena, LineStart,chunk->lines , oldCapacity, chunk->lineCapacity);
     }
     //Update lines struct for chunk
     //Offset marks the first byte in that line, 
@@ -45,8 +55,16 @@ void writeChunk(Chunk* chunk, uint8_t byte, int line){
 }
 
 void freeChunk(Chunk* chunk) {
+    FREE_ARRAY(int, chunk->globalSlots, chunk->constants.count);
+    FREE_ARRAY(Obj*, chunk->callCache, chunk->callSites);
+    FREE_ARRAY(LoopCounter, chunk->loops, chunk->loopCapacity);
+    //Packed or compiling arrays are owned by an arena and released with it
+    if(chunk->packed || chunk->arena != NULL) {
+        initChunk(chunk);
+        return;
+    }
     FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
-    FREE_ARRAY(int, chunk->lines, chunk->lineCapacity);
+    FREE_ARRAY(LineStart, chunk->lines, chunk->lineCapacity);
     freeValueArray(&chunk->constants);
     initChunk(chunk);
 }
@@ -86,4 +104,340 @@ int getLine(Chunk* chunk, int instruction){
         }
      
     }
-}
\ No newline at end of file
+}
+
+//Bytes taken by the instruction, operands included, or -1 if unknown
+int instructionLength(uint8_t instruction){
+    switch(instruction){
+        case OP_CONSTANT:
+        case OP_DEFINE_GLOBAL:
+        case OP_GET_GLOBAL:
+        case OP_GET_GLOBAL_CACHED:
+        case OP_SET_GLOBAL:
+        case OP_GET_LOCAL:
+        case OP_SET_LOCAL:
+        case OP_GET_UPVALUE:
+        case OP_SET_UPVALUE:
+        case OP_CLOSURE:
+            return 2;
+        case OP_JUMP_IF_FALSE:
+        case OP_JUMP:
+        case OP_LOOP:
+        case OP_CALL:
+        case OP_CAPTURE:
+            return 3;
+        case OP_CONSTANT_LONG:
+            return 4;
+        case OP_RETURN:
+        case OP_NEGATE:
+        case OP_ADD:
+        case OP_ADD_NUM:
+        case OP_INCREMENT:
+        case OP_SUBTRACT:
+        case OP_MULTIPLY:
+        case OP_DIVIDE:
+        case OP_TRUE:
+        case OP_FALSE:
+        case OP_NIL:
+        case OP_NOT:
+        case OP_EQUAL:
+        case OP_GREATER:
+        case OP_LESS:
+        case OP_PRINT:
+        case OP_POP:
+        case OP_YIELD:
+        case OP_RESUME:
+        case OP_CLOSE_UPVALUE:
+            return 1;
+        default:
+            return -1;
+    }
+}
+
+//The op a quickened instruction was rewritten from
+uint8_t genericOpcode(uint8_t instruction){
+    switch(instruction){
+        case OP_ADD_NUM: return OP_ADD;
+        case OP_GET_GLOBAL_CACHED: return OP_GET_GLOBAL;
+        default: return instruction;
+    }
+}
+
+//Copies the bytecode as the compiler wrote it, undoing any quickening
+void copyGenericCode(Chunk* chunk, uint8_t* code){
+    memcpy(code, chunk->code, chunk->count);
+    for(int offset = 0; offset < chunk->count; ){
+        code[offset] = genericOpcode(code[offset]);
+        int length = instructionLength(code[offset]);
+        offset += length > 0 ? length : 1;
+    }
+}
+
+//Made on first use, most chunks never read a global
+int* chunkGlobalSlots(Chunk* chunk){
+    if(chunk->globalSlots == NULL) {
+        chunk->globalSlots = ALLOCATE(int, chunk->constants.count);
+    }
+    return chunk->globalSlots;
+}
+
+Obj** chunkCallCache(Chunk* chunk){
+    if(chunk->callCache == NULL) {
+        chunk->callCache = ALLOCATE(Obj*, chunk->callSites);
+        for(int i = 0; i < chunk->callSites; i++) chunk->callCache[i] = NULL;
+    }
+    return chunk->callCache;
+}
+
+//Functions rarely have more than a few loops, so they are just searched
+LoopCounter* chunkLoop(Chunk* chunk, int header){
+    for(int i = 0; i < chunk->loopCount; i++){
+        if(chunk->loops[i].header == header) return &chunk->loops[i];
+    }
+    if(chunk->loopCapacity < chunk->loopCount + 1) {
+        int oldCapacity = chunk->loopCapacity;
+        chunk->loopCapacity = GROW_CAPACITY(oldCapacity);
+        chunk->loops = GROW_ARRAY(LoopCounter, chunk->loops, oldCapacity, chunk->loopCapacity);
+    }
+    LoopCounter* loop = &chunk->loops[chunk->loopCount++];
+    loop->header = header;
+    loop->hotness = 0;
+    loop->trace = NULL;
+    return loop;
+}
+
+//How many values the instruction pops and pushes
+void stackEffect(uint8_t* code, int* pops, int* pushes){
+    *pops = 0;
+    *pushes = 0;
+    switch(genericOpcode(code[0])){
+        case OP_CONSTANT:
+        case OP_CONSTANT_LONG:
+        case OP_TRUE:
+        case OP_FALSE:
+        case OP_NIL:
+        case OP_GET_GLOBAL:
+        case OP_GET_LOCAL:
+        case OP_GET_UPVALUE:
+        case OP_CLOSURE:
+            *pushes = 1;
+            break;
+        case OP_INCREMENT:
+            *pops = 1;
+            *pushes = 2;
+            break;
+        case OP_NEGATE:
+        case OP_NOT:
+        case OP_SET_GLOBAL:
+        case OP_SET_LOCAL:
+        case OP_SET_UPVALUE:
+        case OP_JUMP_IF_FALSE:
+        case OP_RETURN:
+        case OP_YIELD:
+            *pops = 1;
+            *pushes = 1;
+            break;
+        case OP_ADD:
+        case OP_SUBTRACT:
+        case OP_MULTIPLY:
+        case OP_DIVIDE:
+        case OP_EQUAL:
+        case OP_GREATER:
+        case OP_LESS:
+        case OP_RESUME:
+            *pops = 2;
+            *pushes = 1;
+            break;
+        case OP_PRINT:
+        case OP_POP:
+        case OP_CLOSE_UPVALUE:
+        case OP_DEFINE_GLOBAL:
+            *pops = 1;
+            break;
+        case OP_CALL:
+            *pops = code[1] + 1;
+            *pushes = 1;
+            break;
+        default:
+            break;
+    }
+}
+
+//Where the jump at offset lands
+int jumpTarget(uint8_t* code, int offset){
+    uint16_t jump = (uint16_t)((code[offset + 1] << 8) | code[offset + 2]);
+    return code[offset] == OP_LOOP ? offset + 3 - jump : offset + 3 + jump;
+}
+
+//The compiler leaves the same stack depth at every instruction whichever
+//way it is reached, so one pass over the control flow finds the deepest
+//point. baseDepth counts the callee slot and the arguments. Fills depths
+//(-1 for unreachable code) and marks jump targets, returns -1 if the
+//depths don't add up
+int analyzeStack(Chunk* chunk, int baseDepth, int* depths, bool* targets){
+    for(int i = 0; i < chunk->count; i++){
+        depths[i] = -1;
+        targets[i] = false;
+    }
+    if(chunk->count == 0) return -1;
+
+    int* worklist = ALLOCATE(int, chunk->count);
+    int pending = 0;
+    int maxDepth = baseDepth;
+    depths[0] = baseDepth;
+    worklist[pending++] = 0;
+
+    bool valid = true;
+    while(valid && pending > 0){
+        int offset = worklist[--pending];
+        int depth = depths[offset];
+        while(true){
+            uint8_t instruction = chunk->code[offset];
+            int length = instructionLength(instruction);
+            if(length < 0 || offset + length > chunk->count) {
+                valid = false;
+                break;
+            }
+            int pops, pushes;
+            stackEffect(&chunk->code[offset], &pops, &pushes);
+            if(pops > depth ||
+               ((instruction == OP_GET_LOCAL || instruction == OP_SET_LOCAL) && chunk->code[offset + 1] >= depth) ||
+               (instruction == OP_CAPTURE && chunk->code[offset + 1] && chunk->code[offset + 2] >= depth)) {
+                valid = false;
+                break;
+            }
+            depth += pushes - pops;
+            if(depth > maxDepth) maxDepth = depth;
+            if(instruction == OP_RETURN) break;
+
+            int next = offset + length;
+            if(instruction == OP_JUMP || instruction == OP_LOOP || instruction == OP_JUMP_IF_FALSE) {
+                int target = jumpTarget(chunk->code, offset);
+                if(target < 0 || target >= chunk->count) {
+                    valid = false;
+                    break;
+                }
+                targets[target] = true;
+                if(depths[target] == -1) {
+                    depths[target] = depth;
+                    worklist[pending++] = target;
+                } else if(depths[target] != depth) {
+                    valid = false;
+                    break;
+                }
+                if(instruction != OP_JUMP_IF_FALSE) break;
+            }
+
+            //Every chunk ends in a return, falling off it is a bug
+            if(next >= chunk->count) {
+                valid = false;
+                break;
+            }
+            if(depths[next] != -1) {
+                if(depths[next] != depth) valid = false;
+                break;
+            }
+            depths[next] = depth;
+            offset = next;
+        }
+    }
+
+    FREE_ARRAY(int, worklist, chunk->count);
+    return valid ? maxDepth : -1;
+}
+
+//Whether the constant at index exists and, for the ops that name a
+//variable, is the string the VM reads it as
+static bool validConstant(Chunk* chunk, int index, bool string){
+    if(index >= chunk->constants.count) return false;
+    return !string || IS_STRING(chunk->constants.values[index]);
+}
+
+//Checks bytecode read from a file before anything runs it: every
+//operand in range, every jump landing on an instruction, captures only
+//where a closure expects them and a line table getLine can search. Sets
+//callSites from the calls actually in the code. Returns the stack depth
+//analyzeStack works out, or -1 if the chunk can't be trusted
+int verifyChunk(Chunk* chunk, int arity, int upvalueCount){
+    if(chunk->count == 0 || chunk->lineCount == 0 || chunk->lines[0].offset != 0) return -1;
+    for(int i = 1; i < chunk->lineCount; i++){
+        if(chunk->lines[i].offset <= chunk->lines[i - 1].offset || chunk->lines[i].offset >= chunk->count) return -1;
+    }
+
+    bool* starts = ALLOCATE(bool, chunk->count);
+    for(int i = 0; i < chunk->count; i++) starts[i] = false;
+    int calls = 0;
+    int lastSite = -1;
+    bool sites[CALL_SITE_NONE] = {false}; // a slot shared by two calls would skip an arity check
+    int captures = 0; // OP_CAPTUREs the closure before still expects
+    bool valid = true;
+    int offset = 0;
+    while(valid && offset < chunk->count){
+        uint8_t* code = &chunk->code[offset];
+        int length = instructionLength(code[0]);
+        //Quickened ops are never written out
+        if(length < 0 || offset + length > chunk->count || genericOpcode(code[0]) != code[0] ||
+           (captures > 0) != (code[0] == OP_CAPTURE)) {
+            valid = false;
+            break;
+        }
+        if(code[0] != OP_CAPTURE) starts[offset] = true;
+        switch(code[0]){
+            case OP_CONSTANT:
+                valid = validConstant(chunk, code[1], false);
+                break;
+            case OP_CONSTANT_LONG:
+                valid = validConstant(chunk, code[1] | (code[2] << 8) | (code[3] << 16), false);
+                break;
+            case OP_DEFINE_GLOBAL:
+            case OP_GET_GLOBAL:
+            case OP_SET_GLOBAL:
+                valid = validConstant(chunk, code[1], true);
+                break;
+            case OP_GET_UPVALUE:
+            case OP_SET_UPVALUE:
+                valid = code[1] < upvalueCount;
+                break;
+            case OP_CALL:
+                if(code[2] == CALL_SITE_NONE) break;
+                valid = !sites[code[2]];
+                sites[code[2]] = true;
+                calls++;
+                if(code[2] > lastSite) lastSite = code[2];
+                break;
+            case OP_CLOSURE:
+                valid = validConstant(chunk, code[1], false) && IS_FUNCTION(chunk->constants.values[code[1]]);
+                if(valid) captures = AS_FUNCTION(chunk->constants.values[code[1]])->upvalueCount;
+                break;
+            case OP_CAPTURE:
+                //Locals are checked against the stack depth by analyzeStack
+                valid = code[1] <= 1 && (code[1] || code[2] < upvalueCount);
+                captures--;
+                break;
+            default:
+                break;
+        }
+        offset += length;
+    }
+    if(captures > 0) valid = false;
+
+    //The compiler hands out a site per call until they run out
+    chunk->callSites = calls;
+    if(calls > CALL_SITE_NONE || lastSite >= calls) valid = false;
+
+    for(offset = 0; valid && offset < chunk->count; offset += instructionLength(chunk->code[offset])){
+        uint8_t instruction = chunk->code[offset];
+        if(instruction != OP_JUMP && instruction != OP_LOOP && instruction != OP_JUMP_IF_FALSE) continue;
+        int target = jumpTarget(chunk->code, offset);
+        if(target < 0 || target >= chunk->count || !starts[target]) valid = false;
+    }
+    FREE_ARRAY(bool, starts, chunk->count);
+    if(!valid) return -1;
+
+    int* depths = ALLOCATE(int, chunk->count);
+    bool* targets = ALLOCATE(bool, chunk->count);
+    int maxStack = analyzeStack(chunk, arity + 1, depths, targets);
+    FREE_ARRAY(int, depths, chunk->count);
+    FREE_ARRAY(bool, targets, chunk->count);
+    return maxStack;
+}
@@ -35,14 +35,36 @@ typedef enum{
     OP_LOOP,
     OP_CALL,
     OP_CLOSURE,
+    OP_YIELD,
+    OP_RESUME,
+    OP_CLOSE_UPVALUE,
+    //Operand of OP_CLOSURE, one per upvalue the closure captures: whether
+    //it is a local of the enclosing function, and its slot or upvalue index
+    OP_CAPTURE,
+    //Quickened forms run() rewrites the generic ops into. The compiler
+    //never emits these and they never reach a .loxc file or snapshot
+    OP_ADD_NUM,
+    OP_GET_GLOBAL_CACHED,
 } OpCode; 
 
+//OP_CALL site for calls past the last inline cache slot, never cached.
+//A slot is only ever used by one call, whose argument count matches
+//the callee cached there
+#define CALL_SITE_NONE UINT8_MAX
+
 typedef struct{
     int offset;
     int line;
 
 } LineStart;
 
+//A backward branch --jit counts, keyed by the offset it jumps back to
+typedef struct{
+    int header;
+    int hotness; // -1 once recording a trace for it failed
+    struct Trace* trace; // compiled loop body, NULL until recorded
+} LoopCounter;
+
 typedef struct{
     int count;
     int capacity;
@@ -51,6 +73,14 @@ typedef struct{
     int lineCount;
     int lineCapacity;
     LineStart* lines;
+    bool packed; // arrays live in a code arena or a file mapping, not the heap
+    Arena* arena; // set while compiling, growth is served by the compile arena
+    int* globalSlots; // vm.globals entry per constant, for OP_GET_GLOBAL_CACHED
+    int callSites; // OP_CALL inline cache slots used, at most CALL_SITE_NONE
+    Obj** callCache; // last callee seen at each call site
+    int loopCount;
+    int loopCapacity;
+    LoopCounter* loops;
 } Chunk;
 
 
@@ -60,5 +90,15 @@ void writeChunk(Chunk* chunk, uint8_t byte, int line);
 int addConstant(Chunk* chunk, Value value);
 void writeConstant(Chunk* chunk, Value value, int line);
 int getLine(Chunk* chunk, int instruction);
+int instructionLength(uint8_t instruction);
+void stackEffect(uint8_t* code, int* pops, int* pushes);
+int jumpTarget(uint8_t* code, int offset);
+uint8_t genericOpcode(uint8_t instruction);
+void copyGenericCode(Chunk* chunk, uint8_t* code);
+int* chunkGlobalSlots(Chunk* chunk);
+Obj** chunkCallCache(Chunk* chunk);
+LoopCounter* chunkLoop(Chunk* chunk, int header);
+int analyzeStack(Chunk* chunk, int baseDepth, int* depths, bool* targets);
+int verifyChunk(Chunk* chunk, int arity, int upvalueCount);
 #endif
 
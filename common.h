@@ -5,6 +5,8 @@
 #include <stddef.h>
 #include <stdint.h>
 
+//Packs every Value into one 64 bit word, comment out for the tagged union
+#define NAN_BOXING
 // #define DEBUG_TRACE_EXECUTION
 #define DEBUG_PRINT_CODE
 #define UINT8_COUNT (UINT8_MAX + 1)
@@ -1,6 +1,9 @@
+#include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <pthread.h>
+#include <unistd.h>
 #include "common.h"
 #include "scanner.h"
 #include "compiler.h"
@@ -8,6 +11,8 @@
 #include "debug.h"
 #include "value.h"
 #include "object.h"
+#include "memory.h"
+#include "arena.h"
 
 typedef struct {
     Token current;
@@ -16,8 +21,7 @@ typedef struct {
     bool panicMode;
 } Parser;
 
-Parser parser;
-
+typedef struct CompileContext CompileContext;
 
 //C gives increasing number for enums
 //Therefore, these are ordered from lowest prec to highest
@@ -39,7 +43,7 @@ typedef enum {
     PREC_PRIMARY,
 } Precedence;
 
-typedef void (*ParseFn)(bool canAssign);
+typedef void (*ParseFn)(CompileContext* ctx, bool canAssign);
 
 typedef struct {
     ParseFn prefix;
@@ -50,6 +54,7 @@ typedef struct {
 typedef struct {
     Token name;
     int depth;
+    bool isCaptured; // a closure refers to it, so leaving scope closes it
 } Local;
 
 typedef enum {
@@ -62,45 +67,75 @@ typedef struct {
     bool isLocal;
 } Upvalue;
 
-typedef struct{
+typedef struct Compiler {
     struct Compiler* enclosing;
     ObjFunction* function;
     FunctionType type;
-    Upvalue upvalues[UINT8_COUNT];
-    Local locals[UINT8_COUNT];
+    Upvalue* upvalues;
+    int upvalueCapacity;
+    Local* locals;
     int localCount;
+    int localCapacity;
     int scopeDepth; // 0 = global, 1 = first top level, 2 = second, etc...
 }  Compiler;
 
-Compiler* current = NULL;
-Chunk* compilingChunk;
+//Everything one compile touches. Nothing here is shared, so any
+//number of sources can be compiled at once on different threads
+struct CompileContext {
+    Scanner scanner;
+    Parser parser;
+    Compiler* current;
+    Arena arena; // locals, upvalues and chunk buffers until the compile ends
+    //Objects made while compiling stay out of the VM until publishCompile
+    //hands them over on the calling thread
+    Obj* objects;
+    Table strings;
+    CodeArena* code;
+};
+
+static Chunk* currentChunk(CompileContext* ctx){
+    return &ctx->current->function->chunk;
+}
 
-static Chunk* currentChunk(){
-    return &current->function->chunk;
+static void growLocals(CompileContext* ctx, Compiler* compiler){
+    if(compiler->localCapacity < compiler->localCount + 1) {
+        int oldCapacity = compiler->localCapacity;
+        compiler->localCapacity = GROW_CAPACITY(oldCapacity);
+        compiler->locals = GROW_ARRAY_IN(&ctx->arena, Local, compiler->locals, oldCapacity, compiler->localCapacity);
+    }
 }
 
-static void initCompiler(Compiler* compiler, FunctionType type) {
-    compiler->enclosing = current;
+static void initCompiler(CompileContext* ctx, Compiler* compiler, FunctionType type) {
+    compiler->enclosing = ctx->current;
     compiler->function = NULL; //garbage collection
     compiler->type = type;
     compiler->localCount = 0;
+    compiler->localCapacity = 0;
+    compiler->locals = NULL;
+    compiler->upvalueCapacity = 0;
+    compiler->upvalues = NULL;
     compiler->scopeDepth = 0;
-    compiler->function = newFunction();
-    current = compiler;
+    compiler->function = newFunction(&ctx->objects);
+    compiler->function->chunk.arena = &ctx->arena;
+    compiler->function->chunk.constants.arena = &ctx->arena;
+    ctx->current = compiler;
 
     if(type != TYPE_SCRIPT) {
-        current->function->name = copyString(parser.previous.start, parser.previous.length);
+        ctx->current->function->name = internString(&ctx->objects, &ctx->strings, ctx->parser.previous.start, ctx->parser.previous.length);
     }
     //claims stack slot zero for VM's own internal use
-    Local* local = &current->locals[current->localCount++];
+    growLocals(ctx, ctx->current);
+    Local* local = &ctx->current->locals[ctx->current->localCount++];
     local->depth = 0;
+    local->isCaptured = false;
     local->name.start = "";
     local->name.length = 0;
 }
 
-static void errorAt(Token* token, const char* message){
+static void errorAt(CompileContext* ctx, Token* token, const char* message){
     //panic mode allows us to continue parsing after the error
-    parser.panicMode  = true;
+    ctx->parser.panicMode  = true;
+    flockfile(stderr);
     fprintf(stderr, "[line %d] Error", token->line);
     if(token->type ==  TOKEN_EOF){
         fprintf(stderr, " at end");
@@ -110,189 +145,207 @@ static void errorAt(Token* token, const char* message){
         fprintf(stderr, " at '%.*s'", token->length, token->start);
     }
     fprintf(stderr, ": %s\n", message);
-    parser.hadError = true;
+    funlockfile(stderr);
+    ctx->parser.hadError = true;
 }
-static void errorAtCurrent(const char* message){
-    errorAt(&parser.current, message);
+static void errorAtCurrent(CompileContext* ctx, const char* message){
+    errorAt(ctx, &ctx->parser.current, message);
 }
 
-static void error(const char* message){
-    errorAt(&parser.previous, message);
+static void error(CompileContext* ctx, const char* message){
+    errorAt(ctx, &ctx->parser.previous, message);
 }
 
 //OP_CONSTANT uses a single byte, can only store and
 //load up to 256 bytes in a chunk
-static uint8_t makeConstant(Value value){
-    int constant = addConstant(currentChunk(), value);
+static uint8_t makeConstant(CompileContext* ctx, Value value){
+    int constant = addConstant(currentChunk(ctx), value);
     if(constant > UINT8_MAX){
-        error("Too many constants in one chunk");
+        error(ctx, "Too many constants in one chunk");
         return 0;
     }
     return (uint8_t)constant;
 }
 
-static void advance(){
+static void advance(CompileContext* ctx){
     //Store current token
-    parser.previous = parser.current;
+    ctx->parser.previous = ctx->parser.current;
     //Loop through token until non error token is found or reach the end
     while(true) {
-        parser.current = scanToken();
-        if(parser.current.type != TOKEN_ERROR) break;
+        ctx->parser.current = scanToken(&ctx->scanner);
+        if(ctx->parser.current.type != TOKEN_ERROR) break;
 
-        errorAtCurrent(parser.current.start);
+        errorAtCurrent(ctx, ctx->parser.current.start);
     }
 }
 
-static void consume(TokenType type, const char* message){
-    if(parser.current.type == type){
-        advance();
+static void consume(CompileContext* ctx, TokenType type, const char* message){
+    if(ctx->parser.current.type == type){
+        advance(ctx);
         return;
     }
 
-    errorAtCurrent(message);
+    errorAtCurrent(ctx, message);
 }
 
-static bool check(TokenType type) {
-    return parser.current.type == type;
+static bool check(CompileContext* ctx, TokenType type) {
+    return ctx->parser.current.type == type;
 }
 
-static bool match(TokenType type){
-    if(!check(type)) return false;
-    advance();
+static bool match(CompileContext* ctx, TokenType type){
+    if(!check(ctx, type)) return false;
+    advance(ctx);
     return true;
 }
 
 
-static void emitByte(uint8_t byte){
-    writeChunk(currentChunk(), byte, parser.previous.line);
+static void emitByte(CompileContext* ctx, uint8_t byte){
+    writeChunk(currentChunk(ctx), byte, ctx->parser.previous.line);
 }
 
-static void emitBytes(uint8_t byte1, uint8_t byte2){
-    emitByte(byte1);
-    emitByte(byte2);
+static void emitBytes(CompileContext* ctx, uint8_t byte1, uint8_t byte2){
+    emitByte(ctx, byte1);
+    emitByte(ctx, byte2);
 }
 
 
-static void emitLoop(int loopStart){
-    emitByte(OP_LOOP); //emit new loop insturction 
+static void emitLoop(CompileContext* ctx, int loopStart){
+    emitByte(ctx, OP_LOOP); //emit new loop insturction 
 
     
-    int offset = currentChunk()->count-loopStart + 2;
-    if(offset > UINT16_MAX) error("Loop body too large");
+    int offset = currentChunk(ctx)->count-loopStart + 2;
+    if(offset > UINT16_MAX) error(ctx, "Loop body too large");
 
-    emitByte((offset >> 8) & 0xff);
-    emitByte(offset & 0xff);
+    emitByte(ctx, (offset >> 8) & 0xff);
+    emitByte(ctx, offset & 0xff);
 }
 
-static void emitReturn(){
-    emitByte(OP_NIL);
-    emitByte(OP_RETURN);
+static void emitReturn(CompileContext* ctx){
+    emitByte(ctx, OP_NIL);
+    emitByte(ctx, OP_RETURN);
 }
 
 
-static void emitConstant(Value value){
-    emitBytes(OP_CONSTANT, makeConstant(value));
+static void emitConstant(CompileContext* ctx, Value value){
+    emitBytes(ctx, OP_CONSTANT, makeConstant(ctx, value));
 }
 
 //Goes back into the bytecode and replaces operand at the given location
 //with the calculated offset.
-static void patchJump(int offset){
+static void patchJump(CompileContext* ctx, int offset){
     // -2 to adjust for bytecode for offset jump itself
-    int jump = currentChunk()->count-offset-2;
+    int jump = currentChunk(ctx)->count-offset-2;
     if(jump > UINT16_MAX) {
-        error("Too much code to jump over");
+        error(ctx, "Too much code to jump over");
     }
     //replace the two bytes with then statement
-    currentChunk()->code[offset] = (jump >> 8) & 0xff;
-    currentChunk()->code[offset+1] = jump & 0xff;
+    currentChunk(ctx)->code[offset] = (jump >> 8) & 0xff;
+    currentChunk(ctx)->code[offset+1] = jump & 0xff;
 }
 
-static int emitJump(uint8_t instruction) {
-    emitByte(instruction); //placeholder operand
+static int emitJump(CompileContext* ctx, uint8_t instruction) {
+    emitByte(ctx, instruction); //placeholder operand
     //Two bytes for jump offset
-    emitByte(0xff); 
-    emitByte(0xff);
-    return currentChunk()->count - 2;
+    emitByte(ctx, 0xff); 
+    emitByte(ctx, 0xff);
+    return currentChunk(ctx)->count - 2;
 }
 
-static ObjFunction* endCompiler(){
-    emitReturn();
-    ObjFunction* function = current->function;
+static ObjFunction* endCompiler(CompileContext* ctx){
+    emitReturn(ctx);
+    ObjFunction* function = ctx->current->function;
+    if(!ctx->parser.hadError) {
+        //call() checks this once so push never has to
+        Chunk* chunk = currentChunk(ctx);
+        int* depths = arenaAllocate(&ctx->arena, sizeof(int) * chunk->count);
+        bool* targets = arenaAllocate(&ctx->arena, sizeof(bool) * chunk->count);
+        function->maxStack = analyzeStack(chunk, function->arity + 1, depths, targets);
+        if(function->maxStack < 0) error(ctx, "Could not work out the stack depth.");
+    }
     #ifdef DEBUG_PRINT_CODE
-        if(!parser.hadError){
-            disassembleChunk(currentChunk(), 
+        if(!ctx->parser.hadError){
+            //Keep listings whole when several compiles run at once
+            flockfile(stdout);
+            disassembleChunk(currentChunk(ctx), 
             function->name != NULL ? function->name->chars : "<script>" );
+            funlockfile(stdout);
         }
     #endif
 
-    current = current->enclosing;
+    ctx->current = ctx->current->enclosing;
     return function;
 }
 
-static void beginScope(){
-    current->scopeDepth++;
+static void beginScope(CompileContext* ctx){
+    ctx->current->scopeDepth++;
 }
 
-static void endScope(){
-    current->scopeDepth--;
+static void endScope(CompileContext* ctx){
+    ctx->current->scopeDepth--;
 
     //Pop out the variable when out of block
-    while(current->localCount > 0 && 
-    current->locals[current->localCount - 1].depth > 
-    current->scopeDepth) {
-        emitByte(OP_POP);
-        current->localCount--;
+    while(ctx->current->localCount > 0 && 
+    ctx->current->locals[ctx->current->localCount - 1].depth > 
+    ctx->current->scopeDepth) {
+        if(ctx->current->locals[ctx->current->localCount - 1].isCaptured) {
+            emitByte(ctx, OP_CLOSE_UPVALUE);
+        } else {
+            emitByte(ctx, OP_POP);
+        }
+        ctx->current->localCount--;
     }
 }
 
 
-static void expression();
+static void expression(CompileContext* ctx);
 static ParseRule* getRule(TokenType type);
-static void parsePrecedence(Precedence precedence);
-static void statement();
-static void declaration();
+static void parsePrecedence(CompileContext* ctx, Precedence precedence);
+static void statement(CompileContext* ctx);
+static void declaration(CompileContext* ctx);
 
 //Starts at the current token and parses any expression 
 //at the given precendence level or higher
-static void parsePrecedence(Precedence precedence){
+static void parsePrecedence(CompileContext* ctx, Precedence precedence){
     //Read next token and looks up corresponding parserule
     //First token should ALWAYS be a prefix expression
-    advance();
-    ParseFn prefixRule = getRule(parser.previous.type)->prefix;
+    advance(ctx);
+    ParseFn prefixRule = getRule(ctx->parser.previous.type)->prefix;
     if(prefixRule == NULL){
-        error("Expect expression");
+        error(ctx, "Expect expression");
         return;
     }
 
     bool canAssign = precedence <=  PREC_ASSIGNMENT;
-    prefixRule(canAssign);
+    prefixRule(ctx, canAssign);
 
     //If next token is too low precedence, 
     //or isn't an infix operator, we are done
 
-    while(precedence <= getRule(parser.current.type)->precedence) {
-        advance();
-        ParseFn infixRule = getRule(parser.previous.type)->infix;
-        infixRule(canAssign);
+    while(precedence <= getRule(ctx->parser.current.type)->precedence) {
+        advance(ctx);
+        ParseFn infixRule = getRule(ctx->parser.previous.type)->infix;
+        infixRule(ctx, canAssign);
     }
 
-    if(canAssign && match(TOKEN_EQUAL)){
-        error("Invalid assignment target.");
+    if(canAssign && match(ctx, TOKEN_EQUAL)){
+        error(ctx, "Invalid assignment target.");
     }
 }
 
-static uint8_t identifierConstant(Token* name){
-    return makeConstant(OBJ_VAL(copyString(name->start, name->length)));
+static uint8_t identifierConstant(CompileContext* ctx, Token* name){
+    return makeConstant(ctx, OBJ_VAL(internString(&ctx->objects, &ctx->strings, name->start, name->length)));
 }
 
-static void addLocal(Token name){
-    if(current->localCount ==  UINT8_COUNT) {
-        error("Too many local variables in function");
+static void addLocal(CompileContext* ctx, Token name){
+    if(ctx->current->localCount ==  UINT8_COUNT) {
+        error(ctx, "Too many local variables in function");
         return;
     }
-    Local* local  = &current->locals[current->localCount++];
+    growLocals(ctx, ctx->current);
+    Local* local  = &ctx->current->locals[ctx->current->localCount++];
     local->name = name;
     local->depth = -1;
+    local->isCaptured = false;
 }
 
 static bool identifiersEqual(Token* a, Token* b) {
@@ -300,12 +353,12 @@ static bool identifiersEqual(Token* a, Token* b) {
     return memcmp(a->start, b->start, a->length) == 0;
 }
 
-static int resolveLocal(Compiler* compiler, Token* name) {
+static int resolveLocal(CompileContext* ctx, Compiler* compiler, Token* name) {
     for(int i = compiler->localCount-1; i >= 0; i--){
         Local* local = &compiler->locals[i];
         if(identifiersEqual(&local->name, name)){
             if(local->depth == -1) {
-                error("Cannot read local variable in its own initializer");
+                error(ctx, "Cannot read local variable in its own initializer");
             }
             return i;
         }
@@ -313,10 +366,10 @@ static int resolveLocal(Compiler* compiler, Token* name) {
     return -1;
 }
 
-static int addUpValue(Compiler* compiler, uint8_t index, bool isLocal){
+static int addUpValue(CompileContext* ctx, Compiler* compiler, uint8_t index, bool isLocal){
     int upvalueCount = compiler->function->upvalueCount;
     if(upvalueCount == UINT8_COUNT) {
-        error("Too many closure variables in the function");
+        error(ctx, "Too many closure variables in the function");
         return 0;
     }
     //Check if function already has an upvalue
@@ -326,219 +379,275 @@ static int addUpValue(Compiler* compiler, uint8_t index, bool isLocal){
             return i;
         }
     }
+    if(compiler->upvalueCapacity < upvalueCount + 1) {
+        int oldCapacity = compiler->upvalueCapacity;
+        compiler->upvalueCapacity = GROW_CAPACITY(oldCapacity);
+        compiler->upvalues = GROW_ARRAY_IN(&ctx->arena, Upvalue, compiler->upvalues, oldCapacity, compiler->upvalueCapacity);
+    }
     compiler->upvalues[upvalueCount].isLocal = isLocal;
     compiler->upvalues[upvalueCount].index = index;
     return compiler->function->upvalueCount++;
 }
 
 //Looks for variable in surrounding functions
-static int resolveUpvalue(Compiler* compiler, Token* name){
+static int resolveUpvalue(CompileContext* ctx, Compiler* compiler, Token* name){
     if(compiler->enclosing == NULL) return -1;
     //Look right outside the current function
-    int local = resolveLocal(compiler->enclosing, name);
-    if(local != 1) {
-        return addUpValue(compiler, (uint8_t)local, true);
+    int local = resolveLocal(ctx, compiler->enclosing, name);
+    if(local != -1) {
+        compiler->enclosing->locals[local].isCaptured = true;
+        return addUpValue(ctx, compiler, (uint8_t)local, true);
+    }
+    //Further out, each function in between passes it along as an upvalue
+    int upvalue = resolveUpvalue(ctx, compiler->enclosing, name);
+    if(upvalue != -1) {
+        return addUpValue(ctx, compiler, (uint8_t)upvalue, false);
     }
     return -1;
 }
 
 //Records existence of variable, only for locals
-static void declareVariable(){
+static void declareVariable(CompileContext* ctx){
     //Global variables are implicitly declared
-    if(current->scopeDepth == 0) return;
+    if(ctx->current->scopeDepth == 0) return;
 
-    Token* name = &parser.previous;
+    Token* name = &ctx->parser.previous;
 
     //Loop through array of local to see if a var declared alrdy in the local scope
-    for(int i = current->localCount - 1; i >= 0; i--) {
-        Local* local = &current->locals[i];
-        if(local->depth != -1 && local->depth < current->scopeDepth) {
+    for(int i = ctx->current->localCount - 1; i >= 0; i--) {
+        Local* local = &ctx->current->locals[i];
+        if(local->depth != -1 && local->depth < ctx->current->scopeDepth) {
             break;
         }
         if(identifiersEqual(name, &local->name)) {
-            error("Variable withthis name already declared in this scope");
+            error(ctx, "Variable withthis name already declared in this scope");
         }
     }
-    addLocal(*name);
+    addLocal(ctx, *name);
 }
 
 //Consumes token identifier for the variable name,
 //and adds its lexeme to the chunk's constant table as a string,
 //Then returns the index of the constant
-static uint8_t parseVariable(const char* errorMessage){
-    consume(TOKEN_IDENTIFIER, errorMessage);
+static uint8_t parseVariable(CompileContext* ctx, const char* errorMessage){
+    consume(ctx, TOKEN_IDENTIFIER, errorMessage);
 
-    declareVariable();
+    declareVariable(ctx);
 
     //exit function if in a local scope
-    if(current->scopeDepth > 0) return 0; 
+    if(ctx->current->scopeDepth > 0) return 0; 
 
-    return identifierConstant(&parser.previous);
+    return identifierConstant(ctx, &ctx->parser.previous);
 }
 
-static void markInitialized(){
-    if(current->scopeDepth == 0) return;
-    current->locals[current->localCount-1].depth = current->scopeDepth;
+static void markInitialized(CompileContext* ctx){
+    if(ctx->current->scopeDepth == 0) return;
+    ctx->current->locals[ctx->current->localCount-1].depth = ctx->current->scopeDepth;
 }
 
 //Emits the bytecode
-static void defineVariable(uint8_t global){
+static void defineVariable(CompileContext* ctx, uint8_t global){
     //Do not store if in local scope
-    if(current->scopeDepth > 0) {
-        markInitialized();
+    if(ctx->current->scopeDepth > 0) {
+        markInitialized(ctx);
         return;
     }
-    emitBytes(OP_DEFINE_GLOBAL, global);
+    emitBytes(ctx, OP_DEFINE_GLOBAL, global);
 }
 
-static void number(bool canAssign){
+//Literals without a fraction are integers, unless they are too big to
+//be exact
+static void number(CompileContext* ctx, bool canAssign){
     // printf("number");
-    double value = strtod(parser.previous.start, NULL);
-    emitConstant(NUMBER_VAL(value));
+    const char* start = ctx->parser.previous.start;
+    if(memchr(start, '.', ctx->parser.previous.length) == NULL) {
+        errno = 0;
+        long long integer = strtoll(start, NULL, 10);
+        if(errno == 0 && integer <= INT_VAL_MAX) {
+            emitConstant(ctx, INT_VAL(integer));
+            return;
+        }
+    }
+    double value = strtod(start, NULL);
+    emitConstant(ctx, NUMBER_VAL(value));
 }
-static void grouping(bool canAssign){
-    expression();
-    consume(TOKEN_RIGHT_PAREN, "Expect ')' after expression");
+static void grouping(CompileContext* ctx, bool canAssign){
+    expression(ctx);
+    consume(ctx, TOKEN_RIGHT_PAREN, "Expect ')' after expression");
 }
 
-static void unary(bool canAssign){
-    TokenType operatorType = parser.previous.type;
+static void unary(CompileContext* ctx, bool canAssign){
+    TokenType operatorType = ctx->parser.previous.type;
 
-    parsePrecedence(PREC_UNARY);
+    parsePrecedence(ctx, PREC_UNARY);
 
     switch(operatorType){
-        case TOKEN_MINUS: emitByte(OP_NEGATE); break;
-        case TOKEN_BANG: emitByte(OP_NOT); break;
+        case TOKEN_MINUS: emitByte(ctx, OP_NEGATE); break;
+        case TOKEN_BANG: emitByte(ctx, OP_NOT); break;
         default:
             return;
     }
 } 
 
 
-static void increment(bool canAssign){
-   emitByte(OP_INCREMENT);
+static void increment(CompileContext* ctx, bool canAssign){
+   emitByte(ctx, OP_INCREMENT);
 }
 
-static void binary(bool canAssign){
+static void binary(CompileContext* ctx, bool canAssign){
     //   printf("binary");
     //Rmr operator
-    TokenType operatorType = parser.previous.type;
+    TokenType operatorType = ctx->parser.previous.type;
 
     //Compile the right operand
     //i.e for 2*3+4, only need 2*3 not 2*(3+4)
     ParseRule* rule = getRule(operatorType);
-    parsePrecedence((Precedence)(rule->precedence+1));
+    parsePrecedence(ctx, (Precedence)(rule->precedence+1));
 
     //Emit the operation instruction
     switch(operatorType){
-        case TOKEN_PLUS: emitByte(OP_ADD); break;
-        case TOKEN_MINUS: emitByte(OP_SUBTRACT); break;
-        case TOKEN_STAR: emitByte(OP_MULTIPLY); break;
-        case TOKEN_SLASH: emitByte(OP_DIVIDE);break;
-        case TOKEN_BANG_EQUAL: emitBytes(OP_EQUAL, OP_NOT); break;
-        case TOKEN_EQUAL_EQUAL: emitByte(OP_EQUAL); break;
-        case TOKEN_GREATER: emitByte(OP_GREATER); break;
+        case TOKEN_PLUS: emitByte(ctx, OP_ADD); break;
+        case TOKEN_MINUS: emitByte(ctx, OP_SUBTRACT); break;
+        case TOKEN_STAR: emitByte(ctx, OP_MULTIPLY); break;
+        case TOKEN_SLASH: emitByte(ctx, OP_DIVIDE);break;
+        case TOKEN_BANG_EQUAL: emitBytes(ctx, OP_EQUAL, OP_NOT); break;
+        case TOKEN_EQUAL_EQUAL: emitByte(ctx, OP_EQUAL); break;
+        case TOKEN_GREATER: emitByte(ctx, OP_GREATER); break;
         // >= is the same as NOT <
-        case TOKEN_GREATER_EQUAL: emitBytes(OP_LESS, OP_NOT); break;
-        case TOKEN_LESS: emitByte(OP_LESS); break;
-        case TOKEN_LESS_EQUAL: emitBytes(OP_GREATER,  OP_NOT); break;
+        case TOKEN_GREATER_EQUAL: emitBytes(ctx, OP_LESS, OP_NOT); break;
+        case TOKEN_LESS: emitByte(ctx, OP_LESS); break;
+        case TOKEN_LESS_EQUAL: emitBytes(ctx, OP_GREATER,  OP_NOT); break;
         default:
             return;
     }
 }
 
-static void literal(bool canAssign){
-    switch(parser.previous.type){
-        case TOKEN_FALSE: emitByte(OP_FALSE); break;
-        case TOKEN_TRUE: emitByte(OP_TRUE);break;
-        case TOKEN_NIL: emitByte(OP_NIL); break;
+static void literal(CompileContext* ctx, bool canAssign){
+    switch(ctx->parser.previous.type){
+        case TOKEN_FALSE: emitByte(ctx, OP_FALSE); break;
+        case TOKEN_TRUE: emitByte(ctx, OP_TRUE);break;
+        case TOKEN_NIL: emitByte(ctx, OP_NIL); break;
         default:
             return;
     }
 }
 
-static void string(bool canAssign){
-    emitConstant(OBJ_VAL(copyString(parser.previous.start +1 , parser.previous.length -2)));
+static void string(CompileContext* ctx, bool canAssign){
+    emitConstant(ctx, OBJ_VAL(internString(&ctx->objects, &ctx->strings, ctx->parser.previous.start +1 , ctx->parser.previous.length -2)));
 }
 
-static void namedVariable(Token name, bool canAssign){
+static void namedVariable(CompileContext* ctx, Token name, bool canAssign){
     uint8_t getOp, setOp;
-    int arg = resolveLocal(current, &name);
+    int arg = resolveLocal(ctx, ctx->current, &name);
     if(arg != -1) {
         getOp = OP_GET_LOCAL;
         setOp = OP_SET_LOCAL;
-    } else if((arg = resolveUpvalue(current, &name)) != -1){
+    } else if((arg = resolveUpvalue(ctx, ctx->current, &name)) != -1){
         getOp = OP_GET_UPVALUE;
         setOp = OP_SET_UPVALUE;
     } else {
-        arg = identifierConstant(&name);
+        arg = identifierConstant(ctx, &name);
         getOp = OP_GET_GLOBAL;
         setOp = OP_SET_GLOBAL;
     }
-    if(canAssign && match(TOKEN_PLUS_PLUS)){
+    if(canAssign && match(ctx, TOKEN_PLUS_PLUS)){
         // expression();
-        emitBytes(getOp, (uint8_t)arg);
-        emitByte(OP_INCREMENT);
-        emitBytes(setOp, (uint8_t)arg);
+        emitBytes(ctx, getOp, (uint8_t)arg);
+        emitByte(ctx, OP_INCREMENT);
+        emitBytes(ctx, setOp, (uint8_t)arg);
         return;
     }
     
-    if(canAssign && match(TOKEN_EQUAL)) {
+    if(canAssign && match(ctx, TOKEN_EQUAL)) {
         //If something like a.b().c = d,
         // 'c' should be a setter, not a getter so 
         // need to compile and then set as a variable
-        expression();
-        emitBytes(setOp, (uint8_t)arg);
+        expression(ctx);
+        emitBytes(ctx, setOp, (uint8_t)arg);
     } else {
-        emitBytes(getOp, (uint8_t)arg);
+        emitBytes(ctx, getOp, (uint8_t)arg);
     }
 }
 
-static void variable(bool canAssign){
-    namedVariable(parser.previous, canAssign);
+static void variable(CompileContext* ctx, bool canAssign){
+    namedVariable(ctx, ctx->parser.previous, canAssign);
 }
 
-static void and_(bool canAssign){
+static void and_(CompileContext* ctx, bool canAssign){
     //If false, jump
-    int endJump = emitJump(OP_JUMP_IF_FALSE);
+    int endJump = emitJump(ctx, OP_JUMP_IF_FALSE);
 
     //Else discard left expression and evaluate right side
-    emitByte(OP_POP);
-    parsePrecedence(PREC_AND);
+    emitByte(ctx, OP_POP);
+    parsePrecedence(ctx, PREC_AND);
 
-    patchJump(endJump);
+    patchJump(ctx, endJump);
 }
 
-static void or_(bool canAssign) {
+static void or_(CompileContext* ctx, bool canAssign) {
     //if left truthy, skip right hand operand
-    int elseJump = emitJump(OP_JUMP_IF_FALSE);
+    int elseJump = emitJump(ctx, OP_JUMP_IF_FALSE);
     //if left is false, continue
-    int endJump = emitJump(OP_JUMP);
+    int endJump = emitJump(ctx, OP_JUMP);
 
-    patchJump(elseJump);
-    emitByte(OP_POP);
-    parsePrecedence(PREC_OR);
-    patchJump(endJump);
+    patchJump(ctx, elseJump);
+    emitByte(ctx, OP_POP);
+    parsePrecedence(ctx, PREC_OR);
+    patchJump(ctx, endJump);
 }
 
-static uint8_t argumentList(){
+static uint8_t argumentList(CompileContext* ctx){
     uint8_t argCount = 0;
-    if(!check(TOKEN_RIGHT_PAREN)){
+    if(!check(ctx, TOKEN_RIGHT_PAREN)){
         do{
-            expression();
+            expression(ctx);
             if(argCount == 255) {
-                error("Cannot have more than 255 arguements");
+                error(ctx, "Cannot have more than 255 arguements");
             }
             argCount++;
-        }while(match(TOKEN_COMMA));
+        }while(match(ctx, TOKEN_COMMA));
     }
-    consume(TOKEN_RIGHT_PAREN, "Expect ')' after arguments");
+    consume(ctx, TOKEN_RIGHT_PAREN, "Expect ')' after arguments");
     return argCount;
 }
 
-static void call(bool canAssign){
-    uint8_t argCount = argumentList();
-    emitBytes(OP_CALL, argCount);
+static void call(CompileContext* ctx, bool canAssign){
+    uint8_t argCount = argumentList(ctx);
+    //Each call site gets its own inline cache slot. A hit skips the
+    //arity check, so once the slots run out the remaining calls go
+    //uncached rather than share one with a different argument count
+    Chunk* chunk = currentChunk(ctx);
+    int site = chunk->callSites < CALL_SITE_NONE ? chunk->callSites++ : CALL_SITE_NONE;
+    emitBytes(ctx, OP_CALL, argCount);
+    emitByte(ctx, (uint8_t)site);
+}
+
+//yield value hands value to whoever resumed the fiber, and evaluates
+//to what the next resume passes in. A bare yield hands over nil
+static void yield(CompileContext* ctx, bool canAssign){
+    if(ctx->current->type == TYPE_SCRIPT) {
+        error(ctx, "Cannot yield from top level code");
+    }
+    if(check(ctx, TOKEN_SEMICOLON) || check(ctx, TOKEN_RIGHT_PAREN) || check(ctx, TOKEN_COMMA)) {
+        emitByte(ctx, OP_NIL);
+    } else {
+        parsePrecedence(ctx, PREC_ASSIGNMENT);
+    }
+    emitByte(ctx, OP_YIELD);
+}
+
+//resume(fiber) or resume(fiber, value), evaluates to what the fiber
+//yields or returns next
+static void resume(CompileContext* ctx, bool canAssign){
+    consume(ctx, TOKEN_LEFT_PAREN, "Expect '(' after resume");
+    expression(ctx);
+    if(match(ctx, TOKEN_COMMA)) {
+        expression(ctx);
+    } else {
+        emitByte(ctx, OP_NIL);
+    }
+    consume(ctx, TOKEN_RIGHT_PAREN, "Expect ')' after resume arguments");
+    emitByte(ctx, OP_RESUME);
 }
 
 //Prefix, infix, precedence
@@ -582,6 +691,8 @@ ParseRule rules[] = {
   [TOKEN_TRUE]          = { literal,     NULL,   PREC_NONE },
   [TOKEN_VAR]           = { NULL,     NULL,   PREC_NONE },
   [TOKEN_WHILE]         = { NULL,     NULL,   PREC_NONE },
+  [TOKEN_YIELD]         = { yield,    NULL,   PREC_NONE },
+  [TOKEN_RESUME]        = { resume,   NULL,   PREC_NONE },
   [TOKEN_ERROR]         = { NULL,     NULL,   PREC_NONE },
   [TOKEN_EOF]           = { NULL,     NULL,   PREC_NONE },
 };
@@ -591,178 +702,182 @@ static ParseRule* getRule(TokenType type){
 }
 
 
-static void expression(){
-    parsePrecedence(PREC_ASSIGNMENT);
+static void expression(CompileContext* ctx){
+    parsePrecedence(ctx, PREC_ASSIGNMENT);
 }
 
-static void block(){
-    while(!check(TOKEN_RIGHT_BRACE) && !check(TOKEN_EOF)) {
-        declaration();
+static void block(CompileContext* ctx){
+    while(!check(ctx, TOKEN_RIGHT_BRACE) && !check(ctx, TOKEN_EOF)) {
+        declaration(ctx);
     }
 
-    consume(TOKEN_RIGHT_BRACE, "Expect '}' after block.");
+    consume(ctx, TOKEN_RIGHT_BRACE, "Expect '}' after block.");
 }
 
 //Compile the function itself
-static void function(FunctionType type){
+static void function(CompileContext* ctx, FunctionType type){
     //Create a seperate compiler for each function
     Compiler compiler;
-    initCompiler(&compiler, type);
-    beginScope();
+    initCompiler(ctx, &compiler, type);
+    beginScope(ctx);
 
     //Compile parameters
-    consume(TOKEN_LEFT_PAREN, "Expect '(' after function name");
-    if(!check(TOKEN_RIGHT_PAREN)){
+    consume(ctx, TOKEN_LEFT_PAREN, "Expect '(' after function name");
+    if(!check(ctx, TOKEN_RIGHT_PAREN)){
         do{
-            current->function->arity++;
-            if(current->function->arity > 255){
-                errorAtCurrent("Cannot have more than 255 parameters");
+            ctx->current->function->arity++;
+            if(ctx->current->function->arity > 255){
+                errorAtCurrent(ctx, "Cannot have more than 255 parameters");
             }
 
-            uint8_t paramConstant = parseVariable("Expect a variable name");
-            defineVariable(paramConstant);
-        } while(match(TOKEN_COMMA));    
+            uint8_t paramConstant = parseVariable(ctx, "Expect a variable name");
+            defineVariable(ctx, paramConstant);
+        } while(match(ctx, TOKEN_COMMA));    
     } 
-    consume(TOKEN_RIGHT_PAREN, "Expect ')' after parameters");
+    consume(ctx, TOKEN_RIGHT_PAREN, "Expect ')' after parameters");
 
     //Compile body
-    consume(TOKEN_LEFT_BRACE, "Expect '{' before function body");
-    block();
+    consume(ctx, TOKEN_LEFT_BRACE, "Expect '{' before function body");
+    block(ctx);
 
     //Create the function object;
-    ObjFunction* function = endCompiler();
-    emitBytes(OP_CLOSURE, makeConstant(OBJ_VAL(function)));
+    ObjFunction* function = endCompiler(ctx);
+    emitBytes(ctx, OP_CLOSURE, makeConstant(ctx, OBJ_VAL(function)));
+    for(int i = 0; i < function->upvalueCount; i++){
+        emitByte(ctx, OP_CAPTURE);
+        emitBytes(ctx, compiler.upvalues[i].isLocal ? 1 : 0, compiler.upvalues[i].index);
+    }
     // emitBytes(OP_CONSTANT, makeConstant(OBJ_VAL(function)));
 }
-static void funDeclaration(){
-    uint8_t global = parseVariable("Expect a function name");
-    markInitialized();
-    function(TYPE_FUNCTION);
-    defineVariable(global);
+static void funDeclaration(CompileContext* ctx){
+    uint8_t global = parseVariable(ctx, "Expect a function name");
+    markInitialized(ctx);
+    function(ctx, TYPE_FUNCTION);
+    defineVariable(ctx, global);
 }
 
-static void varDeclarations(){
-    uint8_t global = parseVariable("Expect variable name");
+static void varDeclarations(CompileContext* ctx){
+    uint8_t global = parseVariable(ctx, "Expect variable name");
 
-    if(match(TOKEN_EQUAL)) {
-        expression();
+    if(match(ctx, TOKEN_EQUAL)) {
+        expression(ctx);
     } else {
-        emitByte(OP_NIL);
+        emitByte(ctx, OP_NIL);
     }
 
-    consume(TOKEN_SEMICOLON, "Expect ';' after variable declaration");
+    consume(ctx, TOKEN_SEMICOLON, "Expect ';' after variable declaration");
 
-    defineVariable(global);
+    defineVariable(ctx, global);
 }
 
 //Evaluates the expression and then discards the result
 //i.e brunch = "bagel"; eat(brunch);
-static void expressionStatement(){
-    expression();
-    consume(TOKEN_SEMICOLON, "Expect ';' after expression");
-    emitByte(OP_POP);
+static void expressionStatement(CompileContext* ctx){
+    expression(ctx);
+    consume(ctx, TOKEN_SEMICOLON, "Expect ';' after expression");
+    emitByte(ctx, OP_POP);
 }
 
-static void forStatement(){
-    beginScope();
-    consume(TOKEN_LEFT_PAREN, "Expect '(' after 'for'.");
-    if(match(TOKEN_SEMICOLON)) {
+static void forStatement(CompileContext* ctx){
+    beginScope(ctx);
+    consume(ctx, TOKEN_LEFT_PAREN, "Expect '(' after 'for'.");
+    if(match(ctx, TOKEN_SEMICOLON)) {
         //No initalizer
-    } else if(match(TOKEN_VAR)){
-        varDeclarations();
+    } else if(match(ctx, TOKEN_VAR)){
+        varDeclarations(ctx);
     } else {
-        expressionStatement();
+        expressionStatement(ctx);
     }
     
-    int loopStart = currentChunk()->count;
+    int loopStart = currentChunk(ctx)->count;
     int exitJump = -1;
     //Condition
-    if(!match(TOKEN_SEMICOLON)) {
-        expression();
-        consume(TOKEN_SEMICOLON, "Expect ';' after loop condition");
+    if(!match(ctx, TOKEN_SEMICOLON)) {
+        expression(ctx);
+        consume(ctx, TOKEN_SEMICOLON, "Expect ';' after loop condition");
         //Jump out of condition is false
-        exitJump = emitJump(OP_JUMP_IF_FALSE);
+        exitJump = emitJump(ctx, OP_JUMP_IF_FALSE);
         //Pop out condition when true;
-        emitByte(OP_POP);
+        emitByte(ctx, OP_POP);
     }
     //Increment
-    if(!match(TOKEN_RIGHT_PAREN)){
-        int bodyJump = emitJump(OP_JUMP);
+    if(!match(ctx, TOKEN_RIGHT_PAREN)){
+        int bodyJump = emitJump(ctx, OP_JUMP);
 
         //Compile increment
-        int incrementStart = currentChunk()->count;
-        expression();
-        emitByte(OP_POP);
-        consume(TOKEN_RIGHT_PAREN, "Expect ')' after for clauses");
+        int incrementStart = currentChunk(ctx)->count;
+        expression(ctx);
+        emitByte(ctx, OP_POP);
+        consume(ctx, TOKEN_RIGHT_PAREN, "Expect ')' after for clauses");
 
         //Take us back to start of for loop, before condtion
-        emitLoop(loopStart);
+        emitLoop(ctx, loopStart);
         loopStart = incrementStart;
-        patchJump(bodyJump);
+        patchJump(ctx, bodyJump);
     }
 
-    statement();
-    emitLoop(loopStart);
+    statement(ctx);
+    emitLoop(ctx, loopStart);
     if(exitJump != -1) {
-        patchJump(exitJump);
-        emitByte(OP_POP);
+        patchJump(ctx, exitJump);
+        emitByte(ctx, OP_POP);
     }
-    endScope();
+    endScope(ctx);
 }
 
-static void ifStatement(){
+static void ifStatement(CompileContext* ctx){
     //Compile condition expression
-    consume(TOKEN_LEFT_PAREN, "Expect '(' after 'if'.");
-    expression();
-    consume(TOKEN_RIGHT_PAREN, "Expect ')' after condition.");
+    consume(ctx, TOKEN_LEFT_PAREN, "Expect '(' after 'if'.");
+    expression(ctx);
+    consume(ctx, TOKEN_RIGHT_PAREN, "Expect ')' after condition.");
 
     //Offset to jump to if false
     //Set an placeholder offset with thenJump, compile then statement,
     //then come back and replace placeholder offset  with real one
-    int thenJump = emitJump(OP_JUMP_IF_FALSE);
-    emitByte(OP_POP); // pop out the condition 
-    statement();
-    int elseJump = emitJump(OP_JUMP);
-    patchJump(thenJump);
-    emitByte(OP_POP); 
-    if(match(TOKEN_ELSE)) statement();
-    patchJump(elseJump);
+    int thenJump = emitJump(ctx, OP_JUMP_IF_FALSE);
+    emitByte(ctx, OP_POP); // pop out the condition 
+    statement(ctx);
+    int elseJump = emitJump(ctx, OP_JUMP);
+    patchJump(ctx, thenJump);
+    emitByte(ctx, OP_POP); 
+    if(match(ctx, TOKEN_ELSE)) statement(ctx);
+    patchJump(ctx, elseJump);
 
 }
 
-static void printStatement(){
-    expression();
-    consume(TOKEN_SEMICOLON, "Expect ';' after value");
-    emitByte(OP_PRINT);
+static void printStatement(CompileContext* ctx){
+    expression(ctx);
+    consume(ctx, TOKEN_SEMICOLON, "Expect ';' after value");
+    emitByte(ctx, OP_PRINT);
 }
 
-static void whileStatement(){
+static void whileStatement(CompileContext* ctx){
     //Mark the start chunk
-    int loopStart = currentChunk()->count;
-    consume(TOKEN_LEFT_PAREN, "Expect '(' after while");
-    expression();
-    consume(TOKEN_RIGHT_PAREN, "Expect ')' after condition");
+    int loopStart = currentChunk(ctx)->count;
+    consume(ctx, TOKEN_LEFT_PAREN, "Expect '(' after while");
+    expression(ctx);
+    consume(ctx, TOKEN_RIGHT_PAREN, "Expect ')' after condition");
 
     //Exit if condition false
-    int exitJump = emitJump(OP_JUMP_IF_FALSE);
+    int exitJump = emitJump(ctx, OP_JUMP_IF_FALSE);
 
-    emitByte(OP_POP);
-    statement();
+    emitByte(ctx, OP_POP);
+    statement(ctx);
 
-    emitLoop(loopStart);
-    patchJump(exitJump);
-    emitByte(OP_POP);
+    emitLoop(ctx, loopStart);
+    patchJump(ctx, exitJump);
+    emitByte(ctx, OP_POP);
 }
 
 //Skips tokens until it looks like a token that ends a statement,
 //or something that begins a statement
-static void synchronize(){
-    parser.panicMode = false;
+static void synchronize(CompileContext* ctx){
+    ctx->parser.panicMode = false;
 
-    while(parser.current.type != TOKEN_EOF) {
-        if(parser.previous.type == TOKEN_SEMICOLON) return;
+    while(ctx->parser.current.type != TOKEN_EOF) {
+        if(ctx->parser.previous.type == TOKEN_SEMICOLON) return;
 
-        switch(parser.current.type) {
+        switch(ctx->parser.current.type) {
             case TOKEN_CLASS:
             case TOKEN_FUN:
             case TOKEN_VAR:
@@ -777,68 +892,315 @@ static void synchronize(){
                 ;
         }
 
-        advance();
+        advance(ctx);
     }
 }
 
 
 
-static void declaration(){
-    if(match(TOKEN_VAR)) {
-        varDeclarations();
-    } else if (match(TOKEN_FUN)) {
-        funDeclaration();
+static void declaration(CompileContext* ctx){
+    if(match(ctx, TOKEN_VAR)) {
+        varDeclarations(ctx);
+    } else if (match(ctx, TOKEN_FUN)) {
+        funDeclaration(ctx);
     }
     else {
-        statement();
+        statement(ctx);
     }
-    if(parser.panicMode) synchronize();
+    if(ctx->parser.panicMode) synchronize(ctx);
 }
 
-static void returnStatement(){
-    if(current->type == TYPE_SCRIPT) {
-        error("Cannot return from top level code");
+static void returnStatement(CompileContext* ctx){
+    if(ctx->current->type == TYPE_SCRIPT) {
+        error(ctx, "Cannot return from top level code");
     }
-    if(match(TOKEN_SEMICOLON)){
-        emitReturn();
+    if(match(ctx, TOKEN_SEMICOLON)){
+        emitReturn(ctx);
     } else {
-        expression();
-        consume(TOKEN_SEMICOLON, "Expect ';' after return value");
-        emitByte(OP_RETURN);
-    }
-}
-
-static void statement(){
-    if(match(TOKEN_PRINT)){
-        printStatement();
-    } else if (match(TOKEN_LEFT_BRACE)){
-        beginScope();
-        block();
-        endScope();
-    } else if (match(TOKEN_IF)){
-        ifStatement();
-    } else if (match(TOKEN_WHILE)) {
-        whileStatement();
-    } else if(match(TOKEN_FOR)){
-        forStatement();
-    } else if (match(TOKEN_RETURN)) {
-        returnStatement();
+        expression(ctx);
+        consume(ctx, TOKEN_SEMICOLON, "Expect ';' after return value");
+        emitByte(ctx, OP_RETURN);
+    }
+}
+
+static void statement(CompileContext* ctx){
+    if(match(ctx, TOKEN_PRINT)){
+        printStatement(ctx);
+    } else if (match(ctx, TOKEN_LEFT_BRACE)){
+        beginScope(ctx);
+        block(ctx);
+        endScope(ctx);
+    } else if (match(ctx, TOKEN_IF)){
+        ifStatement(ctx);
+    } else if (match(ctx, TOKEN_WHILE)) {
+        whileStatement(ctx);
+    } else if(match(ctx, TOKEN_FOR)){
+        forStatement(ctx);
+    } else if (match(ctx, TOKEN_RETURN)) {
+        returnStatement(ctx);
     } else {
-        expressionStatement();
+        expressionStatement(ctx);
+    }
+}
+
+//Totals for every chunk in one compiled function tree
+typedef struct {
+    size_t values;
+    size_t lines;
+    size_t code;
+} PackSize;
+
+//Where the next chunk's arrays get copied to inside the arena
+typedef struct {
+    Value* values;
+    LineStart* lines;
+    uint8_t* code;
+} PackCursor;
+
+static void measureFunction(ObjFunction* function, PackSize* size){
+    Chunk* chunk = &function->chunk;
+    size->values += chunk->constants.count;
+    size->lines += chunk->lineCount;
+    size->code += chunk->count;
+
+    //Nested functions only live in their parent's constant table
+    for(int i = 0; i < chunk->constants.count; i++){
+        Value constant = chunk->constants.values[i];
+        if(IS_FUNCTION(constant)) measureFunction(AS_FUNCTION(constant), size);
+    }
+}
+
+//Moves the chunk's arrays into the arena, trimmed to their exact
+//count. The doubled buffers they grew in go away with compileArena
+static void packFunction(ObjFunction* function, PackCursor* cursor){
+    Chunk* chunk = &function->chunk;
+
+    Value* values = cursor->values;
+    if(chunk->constants.count > 0){
+        memcpy(values, chunk->constants.values, sizeof(Value) * chunk->constants.count);
+    }
+    chunk->constants.values = values;
+    chunk->constants.capacity = chunk->constants.count;
+    cursor->values += chunk->constants.count;
+
+    LineStart* lines = cursor->lines;
+    if(chunk->lineCount > 0){
+        memcpy(lines, chunk->lines, sizeof(LineStart) * chunk->lineCount);
+    }
+    chunk->lines = lines;
+    chunk->lineCapacity = chunk->lineCount;
+    cursor->lines += chunk->lineCount;
+
+    uint8_t* code = cursor->code;
+    if(chunk->count > 0){
+        memcpy(code, chunk->code, chunk->count);
+    }
+    chunk->code = code;
+    chunk->capacity = chunk->count;
+    cursor->code += chunk->count;
+
+    chunk->packed = true;
+    chunk->arena = NULL;
+    chunk->constants.arena = NULL;
+
+    for(int i = 0; i < chunk->constants.count; i++){
+        Value constant = chunk->constants.values[i];
+        if(IS_FUNCTION(constant)) packFunction(AS_FUNCTION(constant), cursor);
+    }
+}
+
+//Packs every chunk of one compile into a single arena.
+//Constants and line tables go first and all bytecode is kept together
+//at the end so jumping between functions stays on nearby pages.
+//Sealing waits for publishCompile, which still rewrites string constants.
+//NULL with nothing packed if the arena can't be mapped
+static CodeArena* finalizeFunctions(ObjFunction* script){
+    PackSize size = {0, 0, 0};
+    measureFunction(script, &size);
+
+    size_t valuesOffset = sizeof(CodeArena);
+    size_t linesOffset = valuesOffset + sizeof(Value) * size.values;
+    size_t codeOffset = linesOffset + sizeof(LineStart) * size.lines;
+    CodeArena* arena = allocateCodeArena(codeOffset + size.code);
+    if(arena == NULL) return NULL;
+
+    PackCursor cursor;
+    cursor.values = (Value*)((char*)arena + valuesOffset);
+    cursor.lines = (LineStart*)((char*)arena + linesOffset);
+    cursor.code = (uint8_t*)((char*)arena + codeOffset);
+    packFunction(script, &cursor);
+    return arena;
+}
+
+//Drops the arena backed chunks of a tree that failed to compile
+//so nothing points into the compile arena once it is freed
+static void discardFunctions(ObjFunction* function){
+    Chunk* chunk = &function->chunk;
+    for(int i = 0; i < chunk->constants.count; i++){
+        Value constant = chunk->constants.values[i];
+        if(IS_FUNCTION(constant)) discardFunctions(AS_FUNCTION(constant));
     }
+    initChunk(chunk);
 }
 
-ObjFunction* compile(const char* source){
-    initScanner(source);
+static void initContext(CompileContext* ctx){
+    ctx->current = NULL;
+    ctx->objects = NULL;
+    ctx->code = NULL;
+    initArena(&ctx->arena);
+    initTable(&ctx->strings);
+}
+
+//Parses and packs one source. Only touches ctx, so it is
+//safe to run on any thread
+static ObjFunction* compileSource(CompileContext* ctx, const char* source){
+    initScanner(&ctx->scanner, source);
     Compiler compiler;
-    initCompiler(&compiler, TYPE_SCRIPT);
-    // compilingChunk = chunk;
-    parser.hadError = false;
-    parser.panicMode = false;
-    advance();
-    while(!match(TOKEN_EOF)) {
-        declaration();
-    }
-    ObjFunction* function = endCompiler();
-    return parser.hadError ? NULL : function;
-}
\ No newline at end of file
+    initCompiler(ctx, &compiler, TYPE_SCRIPT);
+    ctx->parser.hadError = false;
+    ctx->parser.panicMode = false;
+    advance(ctx);
+    while(!match(ctx, TOKEN_EOF)) {
+        declaration(ctx);
+    }
+    ObjFunction* function = endCompiler(ctx);
+    if(!ctx->parser.hadError) ctx->code = finalizeFunctions(function);
+    if(ctx->code == NULL) {
+        if(!ctx->parser.hadError) fprintf(stderr, "Out of memory.\n");
+        discardFunctions(function);
+        freeArena(&ctx->arena);
+        return NULL;
+    }
+    freeArena(&ctx->arena);
+    return function;
+}
+
+//The VM's copy of a string this compile interned on its own
+static ObjString* canonicalString(CompileContext* ctx, ObjString* string){
+    Value canonical;
+    tableGet(&ctx->strings, string, &canonical);
+    return AS_STRING(canonical);
+}
+
+static void canonicalizeStrings(CompileContext* ctx, ObjFunction* function){
+    if(function->name != NULL) function->name = canonicalString(ctx, function->name);
+
+    Chunk* chunk = &function->chunk;
+    for(int i = 0; i < chunk->constants.count; i++){
+        Value constant = chunk->constants.values[i];
+        if(IS_STRING(constant)) {
+            chunk->constants.values[i] = OBJ_VAL(canonicalString(ctx, AS_STRING(constant)));
+        } else if(IS_FUNCTION(constant)) {
+            canonicalizeStrings(ctx, AS_FUNCTION(constant));
+        }
+    }
+}
+
+//Deferred interning. Runs on the thread that owns the VM and moves
+//everything compileSource made into it, so two compiles of "x"
+//still end up sharing one ObjString
+static void publishCompile(VM* vm, CompileContext* ctx, ObjFunction* function){
+    if(function == NULL) {
+        Obj* object = ctx->objects;
+        while(object != NULL){
+            Obj* next = object->next;
+            freeObject(object);
+            object = next;
+        }
+        freeTable(&ctx->strings);
+        return;
+    }
+
+    //Point each entry's value at the string the VM will keep
+    for(int i = 0; i < ctx->strings.capacity; i++){
+        Entry* entry = &ctx->strings.entries[i];
+        if(entry->key == NULL) continue;
+        ObjString* string = entry->key;
+        ObjString* interned = tableFindString(&vm->strings, string->chars, string->length, string->hash);
+        if(interned == NULL){
+            tableSet(&vm->strings, string, NIL_VAL);
+            interned = string;
+        }
+        entry->value = OBJ_VAL(interned);
+    }
+    canonicalizeStrings(ctx, function);
+    //Not sealed, run() quickens instructions in place
+    adoptCodeArena(vm, ctx->code);
+
+    //Duplicates of strings the VM already had are no longer referenced
+    Obj* object = ctx->objects;
+    while(object != NULL){
+        Obj* next = object->next;
+        if(object->type == OBJ_STRING &&
+           canonicalString(ctx, (ObjString*)object) != (ObjString*)object) {
+            freeObject(object);
+        } else {
+            object->next = vm->objects;
+            vm->objects = object;
+        }
+        object = next;
+    }
+    freeTable(&ctx->strings);
+}
+
+ObjFunction* compile(VM* vm, const char* source){
+    CompileContext ctx;
+    initContext(&ctx);
+    ObjFunction* function = compileSource(&ctx, source);
+    publishCompile(vm, &ctx, function);
+    return function;
+}
+
+typedef struct {
+    CompileContext* contexts;
+    const char** sources;
+    ObjFunction** functions;
+    int count;
+    int next; // index of the next source nobody has claimed yet
+} CompileJob;
+
+static void* compileWorker(void* arg){
+    CompileJob* job = (CompileJob*)arg;
+    while(true){
+        int index = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED);
+        if(index >= job->count) break;
+        job->functions[index] = compileSource(&job->contexts[index], job->sources[index]);
+    }
+    return NULL;
+}
+
+//Compiles every source, spreading them over one thread per core.
+//functions[i] is NULL for a source with errors, and false is returned
+//if there were any
+bool compileParallel(VM* vm, const char** sources, int count, ObjFunction** functions){
+    CompileJob job;
+    job.contexts = ALLOCATE(CompileContext, count);
+    job.sources = sources;
+    job.functions = functions;
+    job.count = count;
+    job.next = 0;
+    for(int i = 0; i < count; i++) initContext(&job.contexts[i]);
+
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    int threadCount = (int)(cores < count ? cores : count) - 1;
+    if(threadCount < 0) threadCount = 0;
+    pthread_t* threads = ALLOCATE(pthread_t, threadCount);
+    int started = 0;
+    for(; started < threadCount; started++){
+        if(pthread_create(&threads[started], NULL, compileWorker, &job) != 0) break;
+    }
+    //This thread takes a share too, and picks up everything if no thread started
+    compileWorker(&job);
+    for(int i = 0; i < started; i++) pthread_join(threads[i], NULL);
+
+    //Publish in source order so interning does not depend on scheduling
+    bool success = true;
+    for(int i = 0; i < count; i++){
+        publishCompile(vm, &job.contexts[i], functions[i]);
+        if(functions[i] == NULL) success = false;
+    }
+
+    FREE_ARRAY(pthread_t, threads, threadCount);
+    FREE_ARRAY(CompileContext, job.contexts, count);
+    return success;
+}
@@ -5,6 +5,7 @@
 #include "scanner.h"
 #include "object.h"
 
-ObjFunction* compile(const char* source);
+ObjFunction* compile(VM* vm, const char* source);
+bool compileParallel(VM* vm, const char** sources, int count, ObjFunction** functions);
 
 #endif
\ No newline at end of file
@@ -76,6 +76,8 @@ int disassembleInstruction(Chunk* chunk, int offset){
             return simpleInstruction("OP_NEGATE", offset);
         case OP_ADD:
             return simpleInstruction("OP_ADD" , offset);
+        case OP_ADD_NUM:
+            return simpleInstruction("OP_ADD_NUM" , offset);
             break;
         case OP_INCREMENT:
             return simpleInstruction("OP_INCREMENT", offset);
@@ -102,24 +104,40 @@ int disassembleInstruction(Chunk* chunk, int offset){
             return simpleInstruction("OP_PRINT", offset);
         case OP_POP:
             return simpleInstruction("OP_POP", offset);
+        case OP_YIELD:
+            return simpleInstruction("OP_YIELD", offset);
+        case OP_RESUME:
+            return simpleInstruction("OP_RESUME", offset);
+        case OP_CLOSE_UPVALUE:
+            return simpleInstruction("OP_CLOSE_UPVALUE", offset);
         case OP_DEFINE_GLOBAL:
             return constantInstruction("OP_DEFINE_GLOBAL", chunk, offset);
         case OP_GET_GLOBAL:
             return constantInstruction("OP_GET_GLOBAL", chunk, offset);
+        case OP_GET_GLOBAL_CACHED:
+            return constantInstruction("OP_GET_GLOBAL_CACHED", chunk, offset);
         case OP_SET_GLOBAL:
             return constantInstruction("OP_SET_GLOBAL", chunk, offset);
         case OP_GET_LOCAL:
             return byteInstruction("OP_GET_LOCAL", chunk, offset);
         case OP_SET_LOCAL:
             return byteInstruction("OP_SET_LOCAL",chunk, offset);
+        case OP_GET_UPVALUE:
+            return byteInstruction("OP_GET_UPVALUE", chunk, offset);
+        case OP_SET_UPVALUE:
+            return byteInstruction("OP_SET_UPVALUE", chunk, offset);
         case OP_JUMP:
             return jumpInstruction("OP_JUMP", 1, chunk, offset);
         case OP_JUMP_IF_FALSE:
             return jumpInstruction("OP_JUMP_IF_FALSE", 1, chunk, offset);
         case OP_LOOP:
             return jumpInstruction("OP_LOOP", -1, chunk, offset);
-        case OP_CALL:
-            return byteInstruction("OP_CALL", chunk, offset);
+        case OP_CALL: {
+            uint8_t argCount = chunk->code[offset + 1];
+            uint8_t site = chunk->code[offset + 2];
+            printf("%-16s %4d site %d\n", "OP_CALL", argCount, site);
+            return offset + 3;
+        }
         case OP_CLOSURE: {
             offset++;
             uint8_t constant = chunk->code[offset++];
@@ -128,6 +146,12 @@ int disassembleInstruction(Chunk* chunk, int offset){
             printf("\n");
             return offset;
         }
+        case OP_CAPTURE: {
+            int isLocal = chunk->code[offset + 1];
+            int index = chunk->code[offset + 2];
+            printf("%-16s %4d %s\n", "OP_CAPTURE", index, isLocal ? "local" : "upvalue");
+            return offset + 3;
+        }
         default:
             printf("Unknown opcode %d\n", instruction);
             return offset + 1;
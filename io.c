@@ -0,0 +1,730 @@
+//accept4 and pipe2 are Linux extensions
+#define _GNU_SOURCE
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+#include "io.h"
+#include "memory.h"
+#include "vm.h"
+#include "worker.h"
+
+//Descriptors are non-blocking, and a native that would have to wait on
+//one parks its caller on the VM's epoll loop instead. A task (a fiber
+//started by async) is suspended with its OP_CALL backed up, so the call
+//runs again once the descriptor is ready. Anything else, the script's
+//own stack included, drives the loop from inside the native until it
+//can go on, running whatever tasks are ready meanwhile.
+
+//Most events taken from epoll per wait
+#define EVENTS_MAX 64
+
+//Someone parked on a descriptor or a timer: a task to queue when it is
+//ready, or the flag of a native driving the loop itself
+typedef struct {
+    ObjFiber* task;
+    bool* ready;
+    bool active;
+} Waiter;
+
+//Everyone waiting on a descriptor is woken together, and those it isn't
+//ready for after all just wait again
+typedef struct {
+    Waiter* waiters;
+    int waiterCount;
+    int waiterCapacity;
+    uint32_t events; // what the waiters want between them
+    int writer; // write end when this is the read end of a pipe(), else -1
+} Descriptor;
+
+typedef struct {
+    Waiter waiter;
+    double deadline;
+} Timer;
+
+typedef struct EventLoop {
+    int epoll;
+    Descriptor* descriptors; // indexed by descriptor number
+    int descriptorCapacity;
+    Timer* timers;
+    int timerCount;
+    int timerCapacity;
+    ObjFiber** ready; // ring of tasks to run
+    int readyHead;
+    int readyCount;
+    int readyCapacity;
+    int waiting; // active waiters on descriptors and timers
+    int preempted; // tasks the last round stopped at the end of a slice
+    ObjFiber* current; // task being run, the only one allowed to suspend
+    ObjFiber* woken; // task resumed from a wait whose call hasn't rerun yet
+} EventLoop;
+
+static double now(void){
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return time.tv_sec + time.tv_nsec / 1e9;
+}
+
+static EventLoop* eventLoop(VM* vm){
+    if(vm->loop != NULL) return vm->loop;
+    EventLoop* loop = ALLOCATE(EventLoop, 1);
+    loop->epoll = epoll_create1(EPOLL_CLOEXEC);
+    loop->descriptors = NULL;
+    loop->descriptorCapacity = 0;
+    loop->timers = NULL;
+    loop->timerCount = 0;
+    loop->timerCapacity = 0;
+    loop->ready = NULL;
+    loop->readyHead = 0;
+    loop->readyCount = 0;
+    loop->readyCapacity = 0;
+    loop->waiting = 0;
+    loop->preempted = 0;
+    loop->current = NULL;
+    loop->woken = NULL;
+    vm->loop = loop;
+    return loop;
+}
+
+void freeEventLoop(VM* vm){
+    EventLoop* loop = vm->loop;
+    if(loop == NULL) return;
+    close(loop->epoll);
+    for(int i = 0; i < loop->descriptorCapacity; i++){
+        FREE_ARRAY(Waiter, loop->descriptors[i].waiters, loop->descriptors[i].waiterCapacity);
+    }
+    FREE_ARRAY(Descriptor, loop->descriptors, loop->descriptorCapacity);
+    FREE_ARRAY(Timer, loop->timers, loop->timerCapacity);
+    FREE_ARRAY(ObjFiber*, loop->ready, loop->readyCapacity);
+    FREE(EventLoop, loop);
+    vm->loop = NULL;
+}
+
+static Descriptor* descriptor(EventLoop* loop, int fd){
+    if(fd >= loop->descriptorCapacity) {
+        int oldCapacity = loop->descriptorCapacity;
+        int capacity = oldCapacity;
+        while(capacity <= fd) capacity = GROW_CAPACITY(capacity);
+        loop->descriptors = GROW_ARRAY(Descriptor, loop->descriptors, oldCapacity, capacity);
+        for(int i = oldCapacity; i < capacity; i++){
+            loop->descriptors[i].waiters = NULL;
+            loop->descriptors[i].waiterCount = 0;
+            loop->descriptors[i].waiterCapacity = 0;
+            loop->descriptors[i].events = 0;
+            loop->descriptors[i].writer = -1;
+        }
+        loop->descriptorCapacity = capacity;
+    }
+    return &loop->descriptors[fd];
+}
+
+static void pushReady(EventLoop* loop, ObjFiber* task){
+    if(loop->readyCount == loop->readyCapacity) {
+        int oldCapacity = loop->readyCapacity;
+        int capacity = GROW_CAPACITY(oldCapacity);
+        ObjFiber** ready = ALLOCATE(ObjFiber*, capacity);
+        for(int i = 0; i < loop->readyCount; i++){
+            ready[i] = loop->ready[(loop->readyHead + i) % oldCapacity];
+        }
+        FREE_ARRAY(ObjFiber*, loop->ready, oldCapacity);
+        loop->ready = ready;
+        loop->readyHead = 0;
+        loop->readyCapacity = capacity;
+    }
+    loop->ready[(loop->readyHead + loop->readyCount) % loop->readyCapacity] = task;
+    loop->readyCount++;
+}
+
+static ObjFiber* popReady(EventLoop* loop){
+    ObjFiber* task = loop->ready[loop->readyHead];
+    loop->readyHead = (loop->readyHead + 1) % loop->readyCapacity;
+    loop->readyCount--;
+    return task;
+}
+
+static void park(EventLoop* loop, Waiter* waiter, ObjFiber* task, bool* ready){
+    waiter->task = task;
+    waiter->ready = ready;
+    waiter->active = true;
+    loop->waiting++;
+}
+
+static void wake(EventLoop* loop, Waiter* waiter){
+    if(!waiter->active) return;
+    waiter->active = false;
+    loop->waiting--;
+    if(waiter->task != NULL) {
+        pushReady(loop, waiter->task);
+    } else {
+        *waiter->ready = true;
+    }
+}
+
+static void wakeDescriptor(EventLoop* loop, Descriptor* entry){
+    for(int i = 0; i < entry->waiterCount; i++) wake(loop, &entry->waiters[i]);
+    entry->waiterCount = 0;
+    entry->events = 0;
+}
+
+//Arms a one shot epoll registration for fd, unless one covering events
+//is armed already. Descriptors stay registered once added, so only the
+//first wait on each needs EPOLL_CTL_ADD
+static bool watch(VM* vm, int fd, uint32_t events, ObjFiber* task, bool* ready){
+    EventLoop* loop = eventLoop(vm);
+    Descriptor* entry = descriptor(loop, fd);
+    if(entry->waiterCount == 0 || (entry->events | events) != entry->events) {
+        struct epoll_event event;
+        event.events = entry->events | events | EPOLLONESHOT;
+        event.data.fd = fd;
+        if(epoll_ctl(loop->epoll, EPOLL_CTL_MOD, fd, &event) != 0 &&
+           (errno != ENOENT || epoll_ctl(loop->epoll, EPOLL_CTL_ADD, fd, &event) != 0)) {
+            nativeError(vm, "Cannot wait on descriptor %d: %s.", fd, strerror(errno));
+            return false;
+        }
+        entry->events |= events;
+    }
+    if(entry->waiterCount == entry->waiterCapacity) {
+        int oldCapacity = entry->waiterCapacity;
+        entry->waiterCapacity = GROW_CAPACITY(oldCapacity);
+        entry->waiters = GROW_ARRAY(Waiter, entry->waiters, oldCapacity, entry->waiterCapacity);
+    }
+    park(loop, &entry->waiters[entry->waiterCount++], task, ready);
+    return true;
+}
+
+static Waiter* addTimer(EventLoop* loop, double deadline){
+    if(loop->timerCount == loop->timerCapacity) {
+        int oldCapacity = loop->timerCapacity;
+        loop->timerCapacity = GROW_CAPACITY(oldCapacity);
+        loop->timers = GROW_ARRAY(Timer, loop->timers, oldCapacity, loop->timerCapacity);
+    }
+    Timer* timer = &loop->timers[loop->timerCount++];
+    timer->deadline = deadline;
+    return &timer->waiter;
+}
+
+//Milliseconds epoll may block for: none with tasks ready, until the
+//next timer with any, otherwise for as long as it takes
+static int pollTimeout(EventLoop* loop){
+    if(loop->readyCount > 0) return 0;
+    if(loop->timerCount == 0) return -1;
+    double next = loop->timers[0].deadline;
+    for(int i = 1; i < loop->timerCount; i++){
+        if(loop->timers[i].deadline < next) next = loop->timers[i].deadline;
+    }
+    double wait = (next - now()) * 1000;
+    return wait <= 0 ? 0 : (int)wait + 1;
+}
+
+//Waits no longer than limit milliseconds, unless limit is -1
+static void pollEvents(EventLoop* loop, int limit){
+    int timeout = pollTimeout(loop);
+    if(limit >= 0 && (timeout < 0 || timeout > limit)) timeout = limit;
+    struct epoll_event events[EVENTS_MAX];
+    int count = epoll_wait(loop->epoll, events, EVENTS_MAX, timeout);
+    for(int i = 0; i < count; i++){
+        wakeDescriptor(loop, descriptor(loop, events[i].data.fd));
+    }
+    //Expired timers are swapped out with the last one
+    double time = now();
+    for(int i = 0; i < loop->timerCount;){
+        if(loop->timers[i].deadline > time) {
+            i++;
+            continue;
+        }
+        Waiter waiter = loop->timers[i].waiter;
+        loop->timers[i] = loop->timers[--loop->timerCount];
+        wake(loop, &waiter);
+    }
+}
+
+//Runs the tasks that were ready when called. A task that yields or is
+//preempted goes to the back of the queue, so it can't starve the others
+static bool runReady(VM* vm){
+    EventLoop* loop = vm->loop;
+    loop->preempted = 0;
+    for(int count = loop->readyCount; count > 0 && loop->readyCount > 0 && vm->budget != 0; count--){
+        ObjFiber* task = popReady(loop);
+        if(task->state == FIBER_DONE) continue;
+        ObjFiber* current = loop->current;
+        ObjFiber* woken = loop->woken;
+        loop->current = task;
+        loop->woken = task->state == FIBER_WAITING ? task : NULL;
+        Value value;
+        InterpretResult result = runTask(vm, task, &value);
+        loop->current = current;
+        loop->woken = woken;
+        if(task->state == FIBER_DONE && task->result != NULL) {
+            finishJob(task->result, result == INTERPRET_OK ? &value : NULL);
+            task->result = NULL;
+        }
+        if(result != INTERPRET_OK) return false;
+        if(task->state == FIBER_PREEMPTED) loop->preempted++;
+        if(task->state == FIBER_SUSPENDED || task->state == FIBER_PREEMPTED) pushReady(loop, task);
+    }
+    return true;
+}
+
+//Drops the waiter whose flag is ready, for a native giving up on the
+//loop before it went off
+static void forget(EventLoop* loop, bool* ready){
+    for(int i = 0; i < loop->timerCount; i++){
+        if(loop->timers[i].waiter.active && loop->timers[i].waiter.ready == ready) {
+            loop->timers[i] = loop->timers[--loop->timerCount];
+            loop->waiting--;
+            return;
+        }
+    }
+    for(int fd = 0; fd < loop->descriptorCapacity; fd++){
+        Descriptor* entry = &loop->descriptors[fd];
+        for(int i = 0; i < entry->waiterCount; i++){
+            if(entry->waiters[i].ready != ready) continue;
+            entry->waiters[i] = entry->waiters[--entry->waiterCount];
+            loop->waiting--;
+            return;
+        }
+    }
+}
+
+//Keeps the loop going until ready is set, for a native that can't
+//suspend what called it. If the budget runs out while tasks are still
+//ready to run, a native that may be waiting on them asks for its call to
+//be rerun once the VM is resumed. One that only waits on the kernel,
+//like a timer, just stops running tasks
+static WaitResult runUntil(VM* vm, bool* ready, bool onTasks){
+    EventLoop* loop = vm->loop;
+    while(true){
+        if(!runReady(vm)) {
+            forget(loop, ready);
+            return WAIT_ERROR;
+        }
+        if(*ready) return WAIT_READY;
+        if(onTasks && vm->budget == 0 && loop->readyCount > 0) {
+            forget(loop, ready);
+            vm->waiting = true;
+            return WAIT_SUSPENDED;
+        }
+        pollEvents(loop, -1);
+    }
+}
+
+//Runs tasks until none are left, either ready or waiting, or the budget
+//runs out with some still ready
+bool drainEventLoop(VM* vm){
+    EventLoop* loop = vm->loop;
+    if(loop == NULL) return true;
+    while(loop->readyCount > 0 || loop->waiting > 0){
+        if(!runReady(vm)) return false;
+        if(loop->readyCount == 0 ? loop->waiting == 0 : vm->budget == 0) break;
+        pollEvents(loop, -1);
+    }
+    return true;
+}
+
+//One round for a thread with other work to look out for: runs the ready
+//tasks, then checks descriptors and timers, blocking for at most limit
+//milliseconds. False if a task failed, the others are left as they were
+bool stepEventLoop(VM* vm, int limit){
+    EventLoop* loop = vm->loop;
+    if(loop == NULL) return true;
+    bool success = runReady(vm);
+    if(loop->waiting > 0) pollEvents(loop, loop->readyCount > 0 ? 0 : limit);
+    return success;
+}
+
+int readyTasks(VM* vm){
+    return vm->loop == NULL ? 0 : vm->loop->readyCount;
+}
+
+//Tasks that used up a whole slice in the last round of the loop
+int preemptedTasks(VM* vm){
+    return vm->loop == NULL ? 0 : vm->loop->preempted;
+}
+
+int waitingTasks(VM* vm){
+    return vm->loop == NULL ? 0 : vm->loop->waiting;
+}
+
+//Queues closure as a task, its arguments in args. NULL if its fiber
+//could not be made
+ObjFiber* queueTask(VM* vm, ObjClosure* closure, int argCount, Value* args){
+    ObjFiber* task = newFiber(vm, closure);
+    if(task == NULL) return NULL;
+    task->task = true;
+    *task->stack.stackTop++ = OBJ_VAL(closure);
+    for(int i = 0; i < argCount; i++) *task->stack.stackTop++ = args[i];
+    pushReady(eventLoop(vm), task);
+    return task;
+}
+
+ObjFiber* currentTask(VM* vm){
+    return vm->loop == NULL ? NULL : vm->loop->current;
+}
+
+//Only the task the loop is running can be suspended. A fiber it resumed
+//in turn is on top of it, and has to wait like the VM's own stack does
+bool runningTask(VM* vm){
+    return vm->fiber != NULL && vm->loop != NULL && vm->fiber == vm->loop->current;
+}
+
+//Parks the running task. The native returns straight after, and run()
+//hands control back to the loop
+static void suspend(VM* vm, int fd){
+    vm->fiber->state = FIBER_WAITING;
+    vm->fiber->waitFd = fd;
+    vm->waiting = true;
+}
+
+//True when this call is the rerun of one its task was suspended in, so
+//what it was waiting for has happened. fd gets what it waited on
+bool resumedCall(VM* vm, int* fd){
+    EventLoop* loop = vm->loop;
+    if(loop == NULL || loop->woken == NULL || loop->woken != vm->fiber) return false;
+    loop->woken = NULL;
+    if(fd != NULL) *fd = vm->fiber->waitFd;
+    return true;
+}
+
+static WaitResult waitOn(VM* vm, int fd, uint32_t events, bool onTasks){
+    if(runningTask(vm)) {
+        if(!watch(vm, fd, events, vm->fiber, NULL)) return WAIT_ERROR;
+        suspend(vm, fd);
+        return WAIT_SUSPENDED;
+    }
+    bool ready = false;
+    if(!watch(vm, fd, events, NULL, &ready)) return WAIT_ERROR;
+    return runUntil(vm, &ready, onTasks);
+}
+
+//For a native that would block on fd. Every native that can wait calls
+//resumedCall first, whether it needs to know or not
+WaitResult waitFor(VM* vm, int fd, uint32_t events){
+    return waitOn(vm, fd, events, true);
+}
+
+//Whole doubles are taken as well as integers
+static bool descriptorArgument(VM* vm, Value value, int* fd){
+    if(!IS_NUMERIC(value) || AS_DOUBLE(value) < 0 || AS_DOUBLE(value) > INT32_MAX ||
+       AS_DOUBLE(value) != (int)AS_DOUBLE(value)) {
+        nativeError(vm, "Expect a descriptor.");
+        return false;
+    }
+    *fd = (int)AS_DOUBLE(value);
+    return true;
+}
+
+static bool countArgument(VM* vm, Value value, const char* what, int max, int* count){
+    if(!IS_NUMERIC(value) || AS_DOUBLE(value) < 0 || AS_DOUBLE(value) > max ||
+       AS_DOUBLE(value) != (int)AS_DOUBLE(value)) {
+        nativeError(vm, "%s must be a whole number from 0 to %d.", what, max);
+        return false;
+    }
+    *count = (int)AS_DOUBLE(value);
+    return true;
+}
+
+static bool systemError(VM* vm, const char* what, int fd){
+    nativeError(vm, "Could not %s descriptor %d: %s.", what, fd, strerror(errno));
+    return false;
+}
+
+//async(fn, args...) runs fn(args...) as a task on the event loop and
+//returns its fiber. Tasks still pending when the script ends run to
+//completion then
+bool asyncNative(VM* vm, int argCount, Value* args, Value* result){
+    if(argCount < 1 || !IS_CLOSURE(args[0])) {
+        nativeError(vm, "Can only run functions as tasks.");
+        return false;
+    }
+    ObjFunction* function = AS_CLOSURE(args[0])->function;
+    if(argCount - 1 != function->arity) {
+        nativeError(vm, "Expect %d arguments but got %d.", function->arity, argCount - 1);
+        return false;
+    }
+    ObjFiber* task = queueTask(vm, AS_CLOSURE(args[0]), argCount - 1, args + 1);
+    if(task == NULL) {
+        memoryError(vm, NULL, 0);
+        return false;
+    }
+    *result = OBJ_VAL(task);
+    return true;
+}
+
+//sleep(ms) lets ms milliseconds pass, running other tasks meanwhile
+bool sleepNative(VM* vm, int argCount, Value* args, Value* result){
+    (void)argCount;
+    *result = NIL_VAL;
+    if(resumedCall(vm, NULL)) return true;
+    if(!IS_NUMERIC(args[0]) || AS_DOUBLE(args[0]) < 0) {
+        nativeError(vm, "Expect a number of milliseconds.");
+        return false;
+    }
+    EventLoop* loop = eventLoop(vm);
+    double deadline = now() + AS_DOUBLE(args[0]) / 1000;
+    if(runningTask(vm)) {
+        park(loop, addTimer(loop, deadline), vm->fiber, NULL);
+        suspend(vm, -1);
+        return true;
+    }
+    bool ready = false;
+    park(loop, addTimer(loop, deadline), NULL, &ready);
+    return runUntil(vm, &ready, false) != WAIT_ERROR;
+}
+
+//listen(port) opens a TCP socket on the loopback address, port 0 picking
+//any free one
+bool listenNative(VM* vm, int argCount, Value* args, Value* result){
+    (void)argCount;
+    int port;
+    if(!countArgument(vm, args[0], "Port", UINT16_MAX, &port)) return false;
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if(fd < 0) {
+        nativeError(vm, "Could not open a socket: %s.", strerror(errno));
+        return false;
+    }
+    int reuse = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+    struct sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    address.sin_port = htons((uint16_t)port);
+    if(bind(fd, (struct sockaddr*)&address, sizeof(address)) != 0 || listen(fd, SOMAXCONN) != 0) {
+        nativeError(vm, "Could not listen on port %d: %s.", port, strerror(errno));
+        close(fd);
+        return false;
+    }
+    *result = INT_VAL(fd);
+    return true;
+}
+
+//localPort(fd) is the port a socket is bound to
+bool localPortNative(VM* vm, int argCount, Value* args, Value* result){
+    (void)argCount;
+    int fd;
+    if(!descriptorArgument(vm, args[0], &fd)) return false;
+    struct sockaddr_in address;
+    socklen_t length = sizeof(address);
+    if(getsockname(fd, (struct sockaddr*)&address, &length) != 0 || address.sin_family != AF_INET) {
+        nativeError(vm, "Descriptor %d is not a bound socket.", fd);
+        return false;
+    }
+    *result = INT_VAL(ntohs(address.sin_port));
+    return true;
+}
+
+//accept(fd) waits for a connection on a listening socket
+bool acceptNative(VM* vm, int argCount, Value* args, Value* result){
+    (void)argCount;
+    *result = NIL_VAL;
+    int fd;
+    if(!descriptorArgument(vm, args[0], &fd)) return false;
+    resumedCall(vm, NULL);
+    while(true){
+        int client = accept4(fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if(client >= 0) {
+            *result = INT_VAL(client);
+            return true;
+        }
+        if(errno == EINTR) continue;
+        if(errno != EAGAIN && errno != EWOULDBLOCK) return systemError(vm, "accept on", fd);
+        WaitResult wait = waitFor(vm, fd, EPOLLIN);
+        if(wait != WAIT_READY) return wait == WAIT_SUSPENDED;
+    }
+}
+
+static bool connected(VM* vm, int fd, Value* result){
+    int error = 0;
+    socklen_t length = sizeof(error);
+    getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &length);
+    if(error != 0) {
+        nativeError(vm, "Could not connect: %s.", strerror(error));
+        close(fd);
+        return false;
+    }
+    *result = INT_VAL(fd);
+    return true;
+}
+
+//connect(host, port) opens a TCP connection. The host is a numeric IPv4
+//address, nothing here looks names up
+bool connectNative(VM* vm, int argCount, Value* args, Value* result){
+    (void)argCount;
+    *result = NIL_VAL;
+    int fd;
+    if(resumedCall(vm, &fd)) return connected(vm, fd, result);
+    int port;
+    if(!IS_STRING(args[0])) {
+        nativeError(vm, "Host must be a string.");
+        return false;
+    }
+    if(!countArgument(vm, args[1], "Port", UINT16_MAX, &port)) return false;
+    struct sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_port = htons((uint16_t)port);
+    if(inet_pton(AF_INET, AS_CSTRING(args[0]), &address.sin_addr) != 1) {
+        nativeError(vm, "Host must be an IPv4 address.");
+        return false;
+    }
+    fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if(fd < 0) {
+        nativeError(vm, "Could not open a socket: %s.", strerror(errno));
+        return false;
+    }
+    if(connect(fd, (struct sockaddr*)&address, sizeof(address)) == 0) {
+        *result = INT_VAL(fd);
+        return true;
+    }
+    if(errno != EINPROGRESS) {
+        nativeError(vm, "Could not connect: %s.", strerror(errno));
+        close(fd);
+        return false;
+    }
+    //Only ever suspended as a task, whose rerun gets fd back. Nothing a task
+    //does finishes a connect, so the budget doesn't stop it
+    WaitResult wait = waitOn(vm, fd, EPOLLOUT, false);
+    if(wait == WAIT_SUSPENDED) return true;
+    if(wait == WAIT_ERROR) {
+        close(fd);
+        return false;
+    }
+    return connected(vm, fd, result);
+}
+
+//pipe() returns the read end of a new pipe, pipeWriter(fd) its write end
+bool pipeNative(VM* vm, int argCount, Value* args, Value* result){
+    (void)argCount;
+    (void)args;
+    int fds[2];
+    if(pipe2(fds, O_NONBLOCK | O_CLOEXEC) != 0) {
+        nativeError(vm, "Could not open a pipe: %s.", strerror(errno));
+        return false;
+    }
+    descriptor(eventLoop(vm), fds[0])->writer = fds[1];
+    *result = INT_VAL(fds[0]);
+    return true;
+}
+
+bool pipeWriterNative(VM* vm, int argCount, Value* args, Value* result){
+    (void)argCount;
+    int fd;
+    if(!descriptorArgument(vm, args[0], &fd)) return false;
+    EventLoop* loop = vm->loop;
+    if(loop == NULL || fd >= loop->descriptorCapacity || loop->descriptors[fd].writer < 0) {
+        nativeError(vm, "Descriptor %d is not the read end of a pipe.", fd);
+        return false;
+    }
+    *result = INT_VAL(loop->descriptors[fd].writer);
+    return true;
+}
+
+//openFile(path) opens a file for reading. Reads from regular files never
+//wait, epoll has nothing to say about them
+bool openFileNative(VM* vm, int argCount, Value* args, Value* result){
+    (void)argCount;
+    if(!IS_STRING(args[0])) {
+        nativeError(vm, "Path must be a string.");
+        return false;
+    }
+    int fd = open(AS_CSTRING(args[0]), O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+    if(fd < 0) {
+        nativeError(vm, "Could not open \"%s\": %s.", AS_CSTRING(args[0]), strerror(errno));
+        return false;
+    }
+    *result = INT_VAL(fd);
+    return true;
+}
+
+//read(fd, max) waits for data and returns up to max bytes of it as a
+//string, or nil at the end
+bool readNative(VM* vm, int argCount, Value* args, Value* result){
+    (void)argCount;
+    *result = NIL_VAL;
+    int fd;
+    int max;
+    if(!descriptorArgument(vm, args[0], &fd) || !countArgument(vm, args[1], "Size", INT32_MAX - 1, &max)) {
+        return false;
+    }
+    resumedCall(vm, NULL);
+    char* buffer = TRY_ALLOCATE(char, max + 1);
+    if(buffer == NULL) {
+        memoryError(vm, NULL, 0);
+        return false;
+    }
+    while(true){
+        ssize_t count = read(fd, buffer, max);
+        if(count >= 0) {
+            //Nothing read is the end, unless nothing was asked for
+            bool end = count == 0 && max > 0;
+            ObjString* string = end ? NULL : copyString(vm, buffer, (int)count);
+            FREE_ARRAY(char, buffer, max + 1);
+            if(end) return true;
+            if(string == NULL) {
+                memoryError(vm, NULL, 0);
+                return false;
+            }
+            *result = OBJ_VAL(string);
+            return true;
+        }
+        if(errno == EINTR) continue;
+        WaitResult wait = WAIT_ERROR;
+        if(errno != EAGAIN && errno != EWOULDBLOCK) {
+            systemError(vm, "read", fd);
+        } else {
+            wait = waitFor(vm, fd, EPOLLIN);
+        }
+        if(wait != WAIT_READY) {
+            FREE_ARRAY(char, buffer, max + 1);
+            return wait == WAIT_SUSPENDED;
+        }
+    }
+}
+
+//write(fd, string) waits until some of string can be written and returns
+//how many bytes were. Like write(2), that can be fewer than all of them
+bool writeNative(VM* vm, int argCount, Value* args, Value* result){
+    (void)argCount;
+    *result = NIL_VAL;
+    int fd;
+    if(!descriptorArgument(vm, args[0], &fd)) return false;
+    if(!IS_STRING(args[1])) {
+        nativeError(vm, "Can only write strings.");
+        return false;
+    }
+    resumedCall(vm, NULL);
+    ObjString* string = AS_STRING(args[1]);
+    while(true){
+        ssize_t count = write(fd, string->chars, string->length);
+        if(count >= 0) {
+            *result = INT_VAL(count);
+            return true;
+        }
+        if(errno == EINTR) continue;
+        if(errno != EAGAIN && errno != EWOULDBLOCK) return systemError(vm, "write", fd);
+        WaitResult wait = waitFor(vm, fd, EPOLLOUT);
+        if(wait != WAIT_READY) return wait == WAIT_SUSPENDED;
+    }
+}
+
+//closeFd(fd) closes a descriptor. Whatever was waiting on it is woken,
+//and finds it closed when it tries again
+bool closeFdNative(VM* vm, int argCount, Value* args, Value* result){
+    (void)argCount;
+    int fd;
+    if(!descriptorArgument(vm, args[0], &fd)) return false;
+    EventLoop* loop = vm->loop;
+    if(loop != NULL && fd < loop->descriptorCapacity) {
+        epoll_ctl(loop->epoll, EPOLL_CTL_DEL, fd, NULL);
+        wakeDescriptor(loop, &loop->descriptors[fd]);
+        loop->descriptors[fd].writer = -1;
+    }
+    if(close(fd) != 0) return systemError(vm, "close", fd);
+    *result = NIL_VAL;
+    return true;
+}
@@ -0,0 +1,38 @@
+#ifndef cInterp_io_h
+#define cInterp_io_h
+
+#include "common.h"
+#include "object.h"
+
+typedef enum {
+    WAIT_ERROR,
+    WAIT_READY, // try the operation again
+    WAIT_SUSPENDED, // return now, the call reruns once fd is ready or the VM resumed
+} WaitResult;
+
+bool drainEventLoop(VM* vm);
+bool stepEventLoop(VM* vm, int limit);
+int readyTasks(VM* vm);
+int preemptedTasks(VM* vm);
+int waitingTasks(VM* vm);
+ObjFiber* queueTask(VM* vm, ObjClosure* closure, int argCount, Value* args);
+ObjFiber* currentTask(VM* vm);
+bool runningTask(VM* vm);
+bool resumedCall(VM* vm, int* fd);
+WaitResult waitFor(VM* vm, int fd, uint32_t events);
+void freeEventLoop(VM* vm);
+
+bool asyncNative(VM* vm, int argCount, Value* args, Value* result);
+bool sleepNative(VM* vm, int argCount, Value* args, Value* result);
+bool listenNative(VM* vm, int argCount, Value* args, Value* result);
+bool localPortNative(VM* vm, int argCount, Value* args, Value* result);
+bool acceptNative(VM* vm, int argCount, Value* args, Value* result);
+bool connectNative(VM* vm, int argCount, Value* args, Value* result);
+bool pipeNative(VM* vm, int argCount, Value* args, Value* result);
+bool pipeWriterNative(VM* vm, int argCount, Value* args, Value* result);
+bool openFileNative(VM* vm, int argCount, Value* args, Value* result);
+bool readNative(VM* vm, int argCount, Value* args, Value* result);
+bool writeNative(VM* vm, int argCount, Value* args, Value* result);
+bool closeFdNative(VM* vm, int argCount, Value* args, Value* result);
+
+#endif
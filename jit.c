@@ -0,0 +1,1240 @@
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include "jit.h"
+#include "memory.h"
+#include "vm.h"
+
+#ifdef JIT_SUPPORTED
+
+//A template JIT: every opcode is a fixed x86-64 byte sequence with
+//holes for slot offsets, constants and jump targets. Like --emit-c the
+//stack depth at each instruction is known up front, so every value
+//lives at a fixed [rbx + 8 * slot] in the machine frame.
+//
+//Registers while the code runs:
+//  rbx  the value slots, slot 0 is the callee
+//  r12  QNAN, for the is-it-a-number checks and boxing integers
+//  r13  where to write the result
+//  r14  the ObjFunction, passed to the runtime for errors
+//  r15  the VM, the first argument of every runtime call
+//Anything beyond integer and double arithmetic and jumps calls out to C.
+
+typedef enum {
+    RAX = 0,
+    RCX = 1,
+    RDX = 2,
+    RSI = 6,
+    RDI = 7,
+    R8 = 8,
+} Register;
+
+typedef enum {
+    TARGET_BYTECODE,
+    TARGET_ERROR, // returns false, the runtime already reported it
+    TARGET_EXIT,
+    TARGET_SIDE_EXIT, // a trace's exit stub, offset is the step
+} TargetKind;
+
+typedef struct {
+    int at; // the rel32 to patch
+    TargetKind kind;
+    int offset; // bytecode offset for TARGET_BYTECODE, step for TARGET_SIDE_EXIT
+} Fixup;
+
+typedef struct {
+    uint8_t* code;
+    int count;
+    int capacity;
+    Fixup* fixups;
+    int fixupCount;
+    int fixupCapacity;
+    ObjFunction* function;
+    VM* vm;
+} Jit;
+
+static void put8(Jit* jit, uint8_t byte){
+    if(jit->capacity < jit->count + 1){
+        int oldCapacity = jit->capacity;
+        jit->capacity = GROW_CAPACITY(oldCapacity);
+        jit->code = GROW_ARRAY(uint8_t, jit->code, oldCapacity, jit->capacity);
+    }
+    jit->code[jit->count++] = byte;
+}
+
+static void putBytes(Jit* jit, const uint8_t* bytes, int count){
+    for(int i = 0; i < count; i++) put8(jit, bytes[i]);
+}
+
+static void put32(Jit* jit, uint32_t value){
+    for(int i = 0; i < 4; i++) put8(jit, (uint8_t)(value >> (8 * i)));
+}
+
+static void put64(Jit* jit, uint64_t value){
+    for(int i = 0; i < 8; i++) put8(jit, (uint8_t)(value >> (8 * i)));
+}
+
+static void patch32(Jit* jit, int at, int32_t value){
+    memcpy(&jit->code[at], &value, sizeof(int32_t));
+}
+
+#define PUT(...) \
+    do { \
+        const uint8_t bytes[] = {__VA_ARGS__}; \
+        putBytes(jit, bytes, (int)sizeof(bytes)); \
+    } while(false)
+
+//REX.W, plus the bit that reaches r8 and up through ModRM.reg
+#define REX_REG(reg) (0x48 | (((reg) >> 3) << 2))
+
+//mov reg, [rbx + slot]
+static void loadSlot(Jit* jit, Register reg, int slot){
+    PUT(REX_REG(reg), 0x8b, 0x83 | ((reg & 7) << 3));
+    put32(jit, (uint32_t)(slot * sizeof(Value)));
+}
+
+//mov [rbx + slot], reg
+static void storeSlot(Jit* jit, Register reg, int slot){
+    PUT(REX_REG(reg), 0x89, 0x83 | ((reg & 7) << 3));
+    put32(jit, (uint32_t)(slot * sizeof(Value)));
+}
+
+//lea reg, [rbx + slot]
+static void slotAddress(Jit* jit, Register reg, int slot){
+    PUT(REX_REG(reg), 0x8d, 0x83 | ((reg & 7) << 3));
+    put32(jit, (uint32_t)(slot * sizeof(Value)));
+}
+
+//mov reg, imm64
+static void loadImmediate(Jit* jit, Register reg, uint64_t value){
+    PUT(0x48 | (reg >> 3), 0xb8 + (reg & 7));
+    put64(jit, value);
+}
+
+//mov reg32, imm32
+static void loadInt(Jit* jit, Register reg, int value){
+    if(reg >= R8) PUT(0x41);
+    PUT(0xb8 + (reg & 7));
+    put32(jit, (uint32_t)value);
+}
+
+//mov rdi, r15
+static void loadVM(Jit* jit){
+    PUT(0x4c, 0x89, 0xff);
+}
+
+//mov rsi, r14: the function in compiled code, the frame in a trace
+static void loadContext(Jit* jit){
+    PUT(0x4c, 0x89, 0xf6);
+}
+
+//mov rax, imm64; call rax
+static void callRuntime(Jit* jit, void* function){
+    loadImmediate(jit, RAX, (uint64_t)(uintptr_t)function);
+    PUT(0xff, 0xd0);
+}
+
+//Points the rel32 already emitted at at the target
+static void fixupAt(Jit* jit, int at, TargetKind kind, int offset){
+    if(jit->fixupCapacity < jit->fixupCount + 1){
+        int oldCapacity = jit->fixupCapacity;
+        jit->fixupCapacity = GROW_CAPACITY(oldCapacity);
+        jit->fixups = GROW_ARRAY(Fixup, jit->fixups, oldCapacity, jit->fixupCapacity);
+    }
+    Fixup* fixup = &jit->fixups[jit->fixupCount++];
+    fixup->at = at;
+    fixup->kind = kind;
+    fixup->offset = offset;
+}
+
+static void addFixup(Jit* jit, TargetKind kind, int offset){
+    fixupAt(jit, jit->count, kind, offset);
+    put32(jit, 0);
+}
+
+static void jumpTo(Jit* jit, TargetKind kind, int offset){
+    PUT(0xe9);
+    addFixup(jit, kind, offset);
+}
+
+static void jumpIfEqualTo(Jit* jit, TargetKind kind, int offset){
+    PUT(0x0f, 0x84);
+    addFixup(jit, kind, offset);
+}
+
+static void jumpIfNotEqualTo(Jit* jit, TargetKind kind, int offset){
+    PUT(0x0f, 0x85);
+    addFixup(jit, kind, offset);
+}
+
+//test al, al; je error
+static void errorIfFalse(Jit* jit){
+    PUT(0x84, 0xc0);
+    jumpIfEqualTo(jit, TARGET_ERROR, 0);
+}
+
+//Short jumps inside one template are patched as soon as the target is known
+static int jumpForward(Jit* jit, bool ifEqual){
+    if(ifEqual) {
+        PUT(0x0f, 0x84);
+    } else {
+        PUT(0xe9);
+    }
+    int at = jit->count;
+    put32(jit, 0);
+    return at;
+}
+
+//Same for any condition: 0x84 je, 0x85 jne, 0x80 jo
+static int jumpForwardIf(Jit* jit, uint8_t condition){
+    PUT(0x0f, condition);
+    int at = jit->count;
+    put32(jit, 0);
+    return at;
+}
+
+static void landHere(Jit* jit, int at){
+    patch32(jit, at, jit->count - (at + 4));
+}
+
+//Jumps to the returned patch point when reg isn't a number:
+//mov rdx, reg; and rdx, r12; cmp rdx, r12; je
+static int checkNumber(Jit* jit, Register reg){
+    PUT(0x48, 0x89, 0xc2 | (reg << 3));
+    PUT(0x4c, 0x21, 0xe2);
+    PUT(0x4c, 0x39, 0xe2);
+    return jumpForward(jit, true);
+}
+
+//Integers have the sign clear and every bit from QNAN down to INT_BIT set,
+//so the top 15 bits alone tell them apart:
+//mov rdx, reg; sar rdx, 49; cmp rdx, tag
+#define INT_TAG ((QNAN | INT_BIT) >> 49)
+static void compareIntTag(Jit* jit, Register reg){
+    PUT(0x48, 0x89, 0xc2 | (reg << 3));
+    PUT(0x48, 0xc1, 0xfa, 49);
+    PUT(0x48, 0x81, 0xfa);
+    put32(jit, (uint32_t)INT_TAG);
+}
+
+//Jumps to the returned patch point when reg isn't an integer
+static int checkInt(Jit* jit, Register reg){
+    compareIntTag(jit, reg);
+    return jumpForwardIf(jit, 0x85);
+}
+
+//Integers are worked on shifted up to the top of the register, where
+//the overflow flag of 64 bit arithmetic says exactly whether a result
+//still fits the payload, and comparisons need no sign extension:
+//shl reg, 15
+static void unboxInt(Jit* jit, Register reg){
+    PUT(0x48, 0xc1, 0xe0 | reg, 15);
+}
+
+//sar reg, 15: the plain integer, for converting to a double
+static void shiftedToInt(Jit* jit, Register reg){
+    PUT(0x48, 0xc1, 0xf8 | reg, 15);
+}
+
+//Boxes the shifted integer in rax back up:
+//shr rax, 15; or rax, r12; bts rax, 49
+static void boxInt(Jit* jit){
+    PUT(0x48, 0xc1, 0xe8, 15);
+    PUT(0x4c, 0x09, 0xe0);
+    PUT(0x48, 0x0f, 0xba, 0xe8, 49);
+}
+
+//add, sub or imul rax, rcx. The returned patch point is taken when the
+//result doesn't fit, where the interpreter would have gone to a double
+static int intArithmetic(Jit* jit, uint8_t instruction){
+    switch(instruction){
+        case OP_ADD: PUT(0x48, 0x01, 0xc8); break;
+        case OP_SUBTRACT: PUT(0x48, 0x29, 0xc8); break;
+        default:
+            shiftedToInt(jit, RCX);
+            PUT(0x48, 0x0f, 0xaf, 0xc1);
+            break;
+    }
+    return jumpForwardIf(jit, 0x80);
+}
+
+//neg rax, or add rax, 1 shifted up, then jo like intArithmetic
+static int intUnary(Jit* jit, bool negate){
+    if(negate) {
+        PUT(0x48, 0xf7, 0xd8);
+    } else {
+        PUT(0x48, 0x05);
+        put32(jit, 1 << 15);
+    }
+    return jumpForwardIf(jit, 0x80);
+}
+
+//cmp rax, rcx; setg or setl al, the flag setBool turns into a Value
+static void intComparison(Jit* jit, bool less){
+    PUT(0x48, 0x39, 0xc8);
+    PUT(0x0f, less ? 0x9c : 0x9f, 0xc0);
+}
+
+//movzx eax, al; or rax, FALSE_VAL
+static void setBool(Jit* jit){
+    PUT(0x0f, 0xb6, 0xc0);
+    loadImmediate(jit, RCX, FALSE_VAL);
+    PUT(0x48, 0x09, 0xc8);
+}
+
+//The runtime side of the templates, for whatever the inline paths
+//don't cover: strings, integers mixed with doubles, integers that overflow
+static bool jitArithmetic(VM* vm, ObjFunction* function, Value* operands, int line, int instruction){
+    Value a = operands[0];
+    Value b = operands[1];
+    if(IS_NUMERIC(a) && IS_NUMERIC(b)) {
+        switch(instruction){
+            case OP_ADD: operands[0] = addValues(a, b); break;
+            case OP_SUBTRACT: operands[0] = subtractValues(a, b); break;
+            case OP_MULTIPLY: operands[0] = multiplyValues(a, b); break;
+            case OP_DIVIDE: operands[0] = divideValues(a, b); break;
+            case OP_GREATER: operands[0] = greaterValues(a, b); break;
+            case OP_LESS: operands[0] = lessValues(a, b); break;
+        }
+        return true;
+    }
+    if(instruction == OP_ADD && IS_STRING(a) && IS_STRING(b)) {
+        ObjString* joined = concatenateStrings(vm, AS_STRING(a), AS_STRING(b));
+        if(joined == NULL) {
+            memoryError(vm, function, line);
+            return false;
+        }
+        operands[0] = OBJ_VAL(joined);
+        return true;
+    }
+    compiledError(vm, function, line, "Operands must be numbers");
+    return false;
+}
+
+//Increment leaves its operand and writes the slot above it
+static bool jitUnary(VM* vm, ObjFunction* function, Value* operands, int line, int instruction){
+    if(!IS_NUMERIC(operands[0])) {
+        compiledError(vm, function, line, instruction == OP_NEGATE ? "Operand must be a number" : "Value must be number");
+        return false;
+    }
+    if(instruction == OP_NEGATE) {
+        operands[0] = negateValue(operands[0]);
+    } else {
+        operands[1] = addValues(operands[0], INT_VAL(1));
+    }
+    return true;
+}
+
+static Value jitEqual(Value a, Value b){
+    return BOOL_VAL(valuesEqual(a, b));
+}
+
+static Value jitNot(Value value){
+    return BOOL_VAL(isFalsey(value));
+}
+
+static void jitPrint(Value value){
+    printValue(value);
+    printf("\n");
+}
+
+static void jitDefineGlobal(VM* vm, ObjString* name, Value value){
+    tableSet(&vm->globals, name, value);
+}
+
+static bool jitGetGlobal(VM* vm, ObjFunction* function, ObjString* name, Value* value, int line){
+    if(!tableGet(&vm->globals, name, value)) {
+        compiledError(vm, function, line, "Undefined variable '%s' .", name->chars);
+        return false;
+    }
+    return true;
+}
+
+static bool jitSetGlobal(VM* vm, ObjFunction* function, ObjString* name, Value* value, int line){
+    if(tableSet(&vm->globals, name, *value)) {
+        tableDelete(&vm->globals, name);
+        compiledError(vm, function, line, "Undefined variable '%s'.", name->chars);
+        return false;
+    }
+    return true;
+}
+
+//Goes through callSlowPath, with the constant index for the instruction
+static bool jitClosure(VM* vm, ObjFunction* function, Value* slot, int line, int constant){
+    ObjClosure* closure = newClosure(vm, AS_FUNCTION(function->chunk.constants.values[constant]));
+    if(closure == NULL) {
+        memoryError(vm, function, line);
+        return false;
+    }
+    *slot = OBJ_VAL(closure);
+    return true;
+}
+
+//mov rdi, r15; mov rsi, r14; lea rdx, operands; mov ecx, line; mov r8d, instruction;
+//call runtime; test al, al; je error
+static void callSlowPath(Jit* jit, void* runtime, int slot, int line, uint8_t instruction){
+    loadVM(jit);
+    loadContext(jit);
+    slotAddress(jit, RDX, slot);
+    loadInt(jit, RCX, line);
+    loadInt(jit, R8, instruction);
+    callRuntime(jit, runtime);
+    errorIfFalse(jit);
+}
+
+//Two integers, then two doubles, are handled inline with the operands
+//in rax and rcx. The result goes to s[top - 1], anything else calls
+//jitArithmetic. Division has no integer path since it gives a double
+static void emitArithmetic(Jit* jit, int top, int line, uint8_t instruction, uint8_t op){
+    int slow[4];
+    int slowCount = 0;
+    int done[2];
+    loadSlot(jit, RAX, top - 1);
+    loadSlot(jit, RCX, top);
+
+    int notInts[2] = {-1, -1};
+    bool comparison = instruction == OP_GREATER || instruction == OP_LESS;
+    if(instruction != OP_DIVIDE) {
+        notInts[0] = checkInt(jit, RAX);
+        notInts[1] = checkInt(jit, RCX);
+        unboxInt(jit, RAX);
+        unboxInt(jit, RCX);
+        if(comparison) {
+            intComparison(jit, instruction == OP_LESS);
+            setBool(jit);
+        } else {
+            slow[slowCount++] = intArithmetic(jit, instruction);
+            boxInt(jit);
+        }
+        storeSlot(jit, RAX, top - 1);
+        done[0] = jumpForward(jit, false);
+        landHere(jit, notInts[0]);
+        landHere(jit, notInts[1]);
+        //Unboxing clobbered them
+        loadSlot(jit, RAX, top - 1);
+        loadSlot(jit, RCX, top);
+    }
+
+    slow[slowCount++] = checkNumber(jit, RAX);
+    slow[slowCount++] = checkNumber(jit, RCX);
+    PUT(0x66, 0x48, 0x0f, 0x6e, 0xc0); // movq xmm0, rax
+    PUT(0x66, 0x48, 0x0f, 0x6e, 0xc9); // movq xmm1, rcx
+    if(comparison) {
+        //ucomisd then seta, with the operands swapped for less
+        if(instruction == OP_LESS) {
+            PUT(0x66, 0x0f, 0x2e, 0xc8); // ucomisd xmm1, xmm0
+        } else {
+            PUT(0x66, 0x0f, 0x2e, 0xc1); // ucomisd xmm0, xmm1
+        }
+        PUT(0x0f, 0x97, 0xc0); // seta al
+        setBool(jit);
+    } else {
+        PUT(0xf2, 0x0f, op, 0xc1);         // addsd, subsd, mulsd or divsd xmm0, xmm1
+        PUT(0x66, 0x48, 0x0f, 0x7e, 0xc0); // movq rax, xmm0
+    }
+    storeSlot(jit, RAX, top - 1);
+    done[1] = jumpForward(jit, false);
+
+    for(int i = 0; i < slowCount; i++) landHere(jit, slow[i]);
+    callSlowPath(jit, jitArithmetic, top - 1, line, instruction);
+    if(instruction != OP_DIVIDE) landHere(jit, done[0]);
+    landHere(jit, done[1]);
+}
+
+static void emitInstruction(Jit* jit, int offset, int depth){
+    Chunk* chunk = &jit->function->chunk;
+    uint8_t* code = &chunk->code[offset];
+    Value* constants = chunk->constants.values;
+    int line = getLine(chunk, offset);
+    int top = depth - 1;
+
+    switch(genericOpcode(code[0])){
+        case OP_CONSTANT:
+            loadImmediate(jit, RAX, constants[code[1]]);
+            storeSlot(jit, RAX, depth);
+            break;
+        case OP_NIL:
+            loadImmediate(jit, RAX, NIL_VAL);
+            storeSlot(jit, RAX, depth);
+            break;
+        case OP_TRUE:
+            loadImmediate(jit, RAX, TRUE_VAL);
+            storeSlot(jit, RAX, depth);
+            break;
+        case OP_FALSE:
+            loadImmediate(jit, RAX, FALSE_VAL);
+            storeSlot(jit, RAX, depth);
+            break;
+        case OP_RETURN:
+            loadSlot(jit, RAX, top);
+            PUT(0x49, 0x89, 0x45, 0x00); // mov [r13], rax
+            loadInt(jit, RAX, 1);
+            jumpTo(jit, TARGET_EXIT, 0);
+            break;
+        case OP_NEGATE:
+        case OP_INCREMENT: {
+            //Integers inline, doubles inline, the rest through jitUnary
+            bool negate = genericOpcode(code[0]) == OP_NEGATE;
+            int result = negate ? top : depth;
+            loadSlot(jit, RAX, top);
+            int notInt = checkInt(jit, RAX);
+            unboxInt(jit, RAX);
+            int overflow = intUnary(jit, negate);
+            boxInt(jit);
+            storeSlot(jit, RAX, result);
+            int intDone = jumpForward(jit, false);
+
+            landHere(jit, notInt);
+            loadSlot(jit, RAX, top);
+            int notNumber = checkNumber(jit, RAX);
+            if(negate) {
+                PUT(0x48, 0x0f, 0xba, 0xf8, 0x3f); // btc rax, 63
+            } else {
+                PUT(0x66, 0x48, 0x0f, 0x6e, 0xc0); // movq xmm0, rax
+                loadImmediate(jit, RCX, NUMBER_VAL(1));
+                PUT(0x66, 0x48, 0x0f, 0x6e, 0xc9); // movq xmm1, rcx
+                PUT(0xf2, 0x0f, 0x58, 0xc1);       // addsd xmm0, xmm1
+                PUT(0x66, 0x48, 0x0f, 0x7e, 0xc0); // movq rax, xmm0
+            }
+            storeSlot(jit, RAX, result);
+            int done = jumpForward(jit, false);
+
+            landHere(jit, overflow);
+            landHere(jit, notNumber);
+            callSlowPath(jit, jitUnary, top, line, genericOpcode(code[0]));
+            landHere(jit, intDone);
+            landHere(jit, done);
+            break;
+        }
+        case OP_ADD: emitArithmetic(jit, top, line, OP_ADD, 0x58); break;
+        case OP_SUBTRACT: emitArithmetic(jit, top, line, OP_SUBTRACT, 0x5c); break;
+        case OP_MULTIPLY: emitArithmetic(jit, top, line, OP_MULTIPLY, 0x59); break;
+        case OP_DIVIDE: emitArithmetic(jit, top, line, OP_DIVIDE, 0x5e); break;
+        case OP_GREATER: emitArithmetic(jit, top, line, OP_GREATER, 0); break;
+        case OP_LESS: emitArithmetic(jit, top, line, OP_LESS, 0); break;
+        case OP_NOT:
+            loadSlot(jit, RDI, top);
+            callRuntime(jit, jitNot);
+            storeSlot(jit, RAX, top);
+            break;
+        case OP_EQUAL:
+            loadSlot(jit, RDI, top - 1);
+            loadSlot(jit, RSI, top);
+            callRuntime(jit, jitEqual);
+            storeSlot(jit, RAX, top - 1);
+            break;
+        case OP_PRINT:
+            loadSlot(jit, RDI, top);
+            callRuntime(jit, jitPrint);
+            break;
+        case OP_POP:
+            break;
+        case OP_DEFINE_GLOBAL:
+            loadVM(jit);
+            loadImmediate(jit, RSI, (uint64_t)(uintptr_t)AS_STRING(constants[code[1]]));
+            loadSlot(jit, RDX, top);
+            callRuntime(jit, jitDefineGlobal);
+            break;
+        case OP_GET_GLOBAL:
+        case OP_SET_GLOBAL:
+            loadVM(jit);
+            loadContext(jit);
+            loadImmediate(jit, RDX, (uint64_t)(uintptr_t)AS_STRING(constants[code[1]]));
+            slotAddress(jit, RCX, code[0] == OP_SET_GLOBAL ? top : depth);
+            loadInt(jit, R8, line);
+            callRuntime(jit, code[0] == OP_SET_GLOBAL ? (void*)jitSetGlobal : (void*)jitGetGlobal);
+            errorIfFalse(jit);
+            break;
+        case OP_GET_LOCAL:
+            loadSlot(jit, RAX, code[1]);
+            storeSlot(jit, RAX, depth);
+            break;
+        case OP_SET_LOCAL:
+            loadSlot(jit, RAX, top);
+            storeSlot(jit, RAX, code[1]);
+            break;
+        case OP_JUMP_IF_FALSE: {
+            int target = jumpTarget(chunk->code, offset);
+            loadSlot(jit, RAX, top);
+            loadImmediate(jit, RCX, FALSE_VAL);
+            PUT(0x48, 0x39, 0xc8); // cmp rax, rcx
+            jumpIfEqualTo(jit, TARGET_BYTECODE, target);
+            loadImmediate(jit, RCX, NIL_VAL);
+            PUT(0x48, 0x39, 0xc8);
+            jumpIfEqualTo(jit, TARGET_BYTECODE, target);
+            break;
+        }
+        case OP_JUMP:
+        case OP_LOOP:
+            jumpTo(jit, TARGET_BYTECODE, jumpTarget(chunk->code, offset));
+            break;
+        case OP_CALL: {
+            int callee = top - code[1];
+            loadVM(jit);
+            slotAddress(jit, RSI, callee);
+            loadInt(jit, RDX, code[1]);
+            slotAddress(jit, RCX, callee);
+            callRuntime(jit, callCompiled);
+            errorIfFalse(jit);
+            break;
+        }
+        case OP_CLOSURE:
+            callSlowPath(jit, jitClosure, depth, line, code[1]);
+            break;
+    }
+}
+
+//Saves the callee-saved registers, reserves the slots and copies the
+//callee and arguments in
+static void emitSaveRegisters(Jit* jit){
+    PUT(0x55);                   // push rbp
+    PUT(0x48, 0x89, 0xe5);       // mov rbp, rsp
+    PUT(0x53);                   // push rbx
+    PUT(0x41, 0x54, 0x41, 0x55); // push r12; push r13
+    PUT(0x41, 0x56, 0x41, 0x57); // push r14; push r15
+}
+
+static void emitPrologue(Jit* jit, int maxDepth){
+    ObjFunction* function = jit->function;
+    //Six pushes leave rsp 8 off, the slot area puts it back on 16
+    int frameSize = (maxDepth * (int)sizeof(Value) + 15) / 16 * 16 + 8;
+    emitSaveRegisters(jit);
+    PUT(0x48, 0x81, 0xec);       // sub rsp, frameSize
+    put32(jit, (uint32_t)frameSize);
+    PUT(0x48, 0x89, 0xe3);       // mov rbx, rsp
+    PUT(0x49, 0x89, 0xff);       // mov r15, rdi
+    PUT(0x49, 0x89, 0xd5);       // mov r13, rdx
+    PUT(0x49, 0xbe);             // mov r14, function
+    put64(jit, (uint64_t)(uintptr_t)function);
+    PUT(0x49, 0xbc);             // mov r12, QNAN
+    put64(jit, QNAN);
+    for(int i = 0; i <= function->arity; i++){
+        PUT(0x48, 0x8b, 0x86);   // mov rax, [rsi + i]
+        put32(jit, (uint32_t)(i * sizeof(Value)));
+        storeSlot(jit, RAX, i);
+    }
+}
+
+//Restores what the prologue saved and returns eax
+static void emitReturn(Jit* jit){
+    PUT(0x48, 0x8d, 0x65, 0xd8); // lea rsp, [rbp - 40]
+    PUT(0x41, 0x5f, 0x41, 0x5e); // pop r15; pop r14
+    PUT(0x41, 0x5d, 0x41, 0x5c); // pop r13; pop r12
+    PUT(0x5b, 0x5d, 0xc3);       // pop rbx; pop rbp; ret
+}
+
+//Error falls into the exit with false in eax, returns jump to the exit
+//with true already there
+static void emitEpilogue(Jit* jit, int* error, int* finish){
+    *error = jit->count;
+    PUT(0x31, 0xc0);             // xor eax, eax
+    *finish = jit->count;
+    emitReturn(jit);
+}
+
+//Same set as --emit-c, plus the operands the templates can't encode
+static bool canCompile(uint8_t instruction){
+    switch(instruction){
+        case OP_CONSTANT_LONG:
+        case OP_GET_UPVALUE:
+        case OP_SET_UPVALUE:
+        case OP_YIELD:
+        case OP_RESUME:
+        case OP_CLOSE_UPVALUE:
+        case OP_CAPTURE:
+            return false;
+        default:
+            return instructionLength(instruction) > 0;
+    }
+}
+
+//Points every fixup at its target now the code is laid out
+static void resolveFixups(Jit* jit, int* labels, int* sideExits, int error, int finish){
+    for(int i = 0; i < jit->fixupCount; i++){
+        Fixup* fixup = &jit->fixups[i];
+        int target;
+        switch(fixup->kind){
+            case TARGET_ERROR: target = error; break;
+            case TARGET_EXIT: target = finish; break;
+            case TARGET_SIDE_EXIT: target = sideExits[fixup->offset]; break;
+            default: target = labels[fixup->offset]; break;
+        }
+        patch32(jit, fixup->at, target - (fixup->at + 4));
+    }
+}
+
+//Copies the code into a fresh arena, after the header and dataSize
+//bytes for the caller to fill in before makeExecutable. The arena stays
+//with the VM, so the code lives as long as anything can call it. NULL
+//if there is no room for it
+static CodeArena* installCode(Jit* jit, size_t dataSize, void** data, uint8_t** code){
+    size_t codeStart = (sizeof(CodeArena) + dataSize + 15) / 16 * 16;
+    CodeArena* arena = allocateCodeArena(codeStart + jit->count);
+    if(arena == NULL) return NULL;
+    uint8_t* base = (uint8_t*)arena;
+    memcpy(base + codeStart, jit->code, jit->count);
+    adoptCodeArena(jit->vm, arena);
+    if(data != NULL) *data = base + sizeof(CodeArena);
+    *code = base + codeStart;
+    return arena;
+}
+
+static void makeExecutable(CodeArena* arena){
+    mprotect(arena, arena->size, PROT_READ | PROT_EXEC);
+}
+
+static void freeJit(Jit* jit){
+    FREE_ARRAY(uint8_t, jit->code, jit->capacity);
+    FREE_ARRAY(Fixup, jit->fixups, jit->fixupCapacity);
+}
+
+//Translates the function into a fresh executable arena and points
+//function->compiled at it. False leaves the function to the interpreter
+bool jitCompile(VM* vm, ObjFunction* function){
+    Chunk* chunk = &function->chunk;
+    int* depths = ALLOCATE(int, chunk->count);
+    bool* targets = ALLOCATE(bool, chunk->count);
+    int* labels = ALLOCATE(int, chunk->count);
+    int maxDepth = analyzeStack(chunk, function->arity + 1, depths, targets);
+    for(int offset = 0; maxDepth >= 0 && offset < chunk->count; offset += instructionLength(chunk->code[offset])){
+        if(depths[offset] != -1 && !canCompile(genericOpcode(chunk->code[offset]))) maxDepth = -1;
+    }
+    if(maxDepth < 0) {
+        FREE_ARRAY(int, depths, chunk->count);
+        FREE_ARRAY(bool, targets, chunk->count);
+        FREE_ARRAY(int, labels, chunk->count);
+        return false;
+    }
+
+    Jit jit = {NULL, 0, 0, NULL, 0, 0, function, vm};
+    emitPrologue(&jit, maxDepth);
+    for(int offset = 0; offset < chunk->count; offset += instructionLength(chunk->code[offset])){
+        labels[offset] = jit.count;
+        if(depths[offset] != -1) emitInstruction(&jit, offset, depths[offset]);
+    }
+    int error, finish;
+    emitEpilogue(&jit, &error, &finish);
+    resolveFixups(&jit, labels, NULL, error, finish);
+
+    uint8_t* code;
+    CodeArena* arena = installCode(&jit, 0, NULL, &code);
+    if(arena != NULL) {
+        makeExecutable(arena);
+        function->compiled = (CompiledFn)(void*)code;
+    }
+
+    freeJit(&jit);
+    FREE_ARRAY(int, depths, chunk->count);
+    FREE_ARRAY(bool, targets, chunk->count);
+    FREE_ARRAY(int, labels, chunk->count);
+    return arena != NULL;
+}
+
+//Tracing: a loop that keeps branching back in the interpreter gets one
+//iteration recorded, instruction by instruction with the types it saw,
+//and that straight line is compiled with guards instead of slow paths.
+//Anything the trace didn't see (a string where a number was, the other
+//side of an if, an undefined global) leaves through a side exit and the
+//interpreter redoes that instruction.
+
+#define TRACE_STRINGS 1 // OP_ADD saw two strings
+#define TRACE_TAKEN 2 // OP_JUMP_IF_FALSE jumped
+#define TRACE_LEFT_INT 4 // the operand below the top was an integer
+#define TRACE_RIGHT_INT 8 // the top was an integer
+
+//What a slot is known to hold at some point of the iteration
+typedef enum {
+    KIND_UNKNOWN,
+    KIND_NUMBER,
+    KIND_INT,
+} SlotKind;
+
+typedef struct {
+    int offset;
+    int depth; // values on the frame before the instruction runs
+    uint8_t flags;
+} TraceStep;
+
+typedef struct TraceRecorder {
+    LoopCounter* loop;
+    ObjFunction* function;
+    int frame; // index into vm->frames of the frame being recorded
+    int count;
+    TraceStep steps[TRACE_MAX];
+} TraceRecorder;
+
+//A string the heap has no room for exits too, the interpreter raises it
+static bool traceConcat(VM* vm, Value* operands){
+    if(!IS_STRING(operands[0]) || !IS_STRING(operands[1])) return false;
+    ObjString* joined = concatenateStrings(vm, AS_STRING(operands[0]), AS_STRING(operands[1]));
+    if(joined == NULL) return false;
+    operands[0] = OBJ_VAL(joined);
+    return true;
+}
+
+static bool traceClosure(VM* vm, ObjFunction* function, Value* slot){
+    ObjClosure* closure = newClosure(vm, function);
+    if(closure == NULL) return false;
+    *slot = OBJ_VAL(closure);
+    return true;
+}
+
+//Undefined globals exit so the interpreter reports them
+static bool traceGetGlobal(VM* vm, ObjString* name, Value* value){
+    return tableGet(&vm->globals, name, value);
+}
+
+static bool traceSetGlobal(VM* vm, ObjString* name, Value* value){
+    Value old;
+    if(!tableGet(&vm->globals, name, &old)) return false;
+    tableSet(&vm->globals, name, *value);
+    return true;
+}
+
+//The callee runs to completion off the trace. The frame's ip is only
+//read if it fails, for the stack trace
+static bool traceCall(VM* vm, CallFrame* frame, Value* args, int argCount, uint8_t* ip){
+    frame->ip = ip;
+    vm->stackTop = args + argCount + 1;
+    return callCompiled(vm, args, argCount, args);
+}
+
+//Exits unless reg holds kind, a number or an integer. Skipped when the
+//slot already passed a guard or was written as one this iteration
+static void guardKind(Jit* jit, uint8_t* kinds, int slot, Register reg, int step, SlotKind kind){
+    if(kinds[slot] == kind) return;
+    if(kind == KIND_INT) {
+        compareIntTag(jit, reg);
+        jumpIfNotEqualTo(jit, TARGET_SIDE_EXIT, step);
+    } else {
+        //mov rdx, reg; and rdx, r12; cmp rdx, r12; je exit
+        PUT(0x48, 0x89, 0xc2 | (reg << 3));
+        PUT(0x4c, 0x21, 0xe2);
+        PUT(0x4c, 0x39, 0xe2);
+        jumpIfEqualTo(jit, TARGET_SIDE_EXIT, step);
+    }
+    kinds[slot] = kind;
+}
+
+//Loads s[top - 1] and s[top] into rax and rcx, guarded to be what the
+//recording saw. Integers are unboxed, and if toDouble converted to xmm0
+//and xmm1 along with doubles
+static void traceOperands(Jit* jit, uint8_t* kinds, int top, int step, uint8_t flags, bool toDouble){
+    bool ints[2] = {(flags & TRACE_LEFT_INT) != 0, (flags & TRACE_RIGHT_INT) != 0};
+    loadSlot(jit, RAX, top - 1);
+    loadSlot(jit, RCX, top);
+    for(int i = 0; i < 2; i++){
+        Register reg = i == 0 ? RAX : RCX;
+        guardKind(jit, kinds, top - 1 + i, reg, step, ints[i] ? KIND_INT : KIND_NUMBER);
+        if(ints[i]) unboxInt(jit, reg);
+        if(!toDouble) continue;
+        if(ints[i]) {
+            shiftedToInt(jit, reg);
+            PUT(0xf2, 0x48, 0x0f, 0x2a, 0xc0 | (i << 3) | reg); // cvtsi2sd xmm, reg
+        } else {
+            PUT(0x66, 0x48, 0x0f, 0x6e, 0xc0 | (i << 3) | reg); // movq xmm, reg
+        }
+    }
+}
+
+//Two integers stay integers, leaving the trace if the result doesn't
+//fit. Anything with a double in it, and every division, is done in SSE
+static void traceArithmetic(Jit* jit, uint8_t* kinds, TraceStep* step, int index, uint8_t instruction, uint8_t op){
+    int top = step->depth - 1;
+    bool ints = (step->flags & (TRACE_LEFT_INT | TRACE_RIGHT_INT)) == (TRACE_LEFT_INT | TRACE_RIGHT_INT);
+    if(ints && instruction != OP_DIVIDE) {
+        traceOperands(jit, kinds, top, index, step->flags, false);
+        fixupAt(jit, intArithmetic(jit, instruction), TARGET_SIDE_EXIT, index);
+        boxInt(jit);
+        kinds[top - 1] = KIND_INT;
+    } else {
+        traceOperands(jit, kinds, top, index, step->flags, true);
+        PUT(0xf2, 0x0f, op, 0xc1);
+        PUT(0x66, 0x48, 0x0f, 0x7e, 0xc0); // movq rax, xmm0
+        kinds[top - 1] = KIND_NUMBER;
+    }
+    storeSlot(jit, RAX, top - 1);
+}
+
+static void traceComparison(Jit* jit, uint8_t* kinds, TraceStep* step, int index, bool less){
+    int top = step->depth - 1;
+    bool ints = (step->flags & (TRACE_LEFT_INT | TRACE_RIGHT_INT)) == (TRACE_LEFT_INT | TRACE_RIGHT_INT);
+    if(ints) {
+        traceOperands(jit, kinds, top, index, step->flags, false);
+        intComparison(jit, less);
+    } else {
+        traceOperands(jit, kinds, top, index, step->flags, true);
+        if(less) {
+            PUT(0x66, 0x0f, 0x2e, 0xc8); // ucomisd xmm1, xmm0
+        } else {
+            PUT(0x66, 0x0f, 0x2e, 0xc1); // ucomisd xmm0, xmm1
+        }
+        PUT(0x0f, 0x97, 0xc0); // seta al
+    }
+    setBool(jit);
+    storeSlot(jit, RAX, top - 1);
+    kinds[top - 1] = KIND_UNKNOWN;
+}
+
+//Negate and increment, with the same split as traceArithmetic
+static void traceUnary(Jit* jit, uint8_t* kinds, TraceStep* step, int index, bool negate){
+    int top = step->depth - 1;
+    int result = negate ? top : step->depth;
+    loadSlot(jit, RAX, top);
+    if(step->flags & TRACE_RIGHT_INT) {
+        guardKind(jit, kinds, top, RAX, index, KIND_INT);
+        unboxInt(jit, RAX);
+        fixupAt(jit, intUnary(jit, negate), TARGET_SIDE_EXIT, index);
+        boxInt(jit);
+        kinds[result] = KIND_INT;
+    } else {
+        guardKind(jit, kinds, top, RAX, index, KIND_NUMBER);
+        if(negate) {
+            PUT(0x48, 0x0f, 0xba, 0xf8, 0x3f); // btc rax, 63
+        } else {
+            PUT(0x66, 0x48, 0x0f, 0x6e, 0xc0); // movq xmm0, rax
+            loadImmediate(jit, RCX, NUMBER_VAL(1));
+            PUT(0x66, 0x48, 0x0f, 0x6e, 0xc9); // movq xmm1, rcx
+            PUT(0xf2, 0x0f, 0x58, 0xc1);       // addsd xmm0, xmm1
+            PUT(0x66, 0x48, 0x0f, 0x7e, 0xc0); // movq rax, xmm0
+        }
+        kinds[result] = KIND_NUMBER;
+    }
+    storeSlot(jit, RAX, result);
+}
+
+//kinds tracks what each slot is known to hold at this point of the
+//iteration, so each value is only checked once
+static void traceInstruction(Jit* jit, uint8_t* kinds, TraceStep* step, int index){
+    Chunk* chunk = &jit->function->chunk;
+    uint8_t* code = &chunk->code[step->offset];
+    Value* constants = chunk->constants.values;
+    int depth = step->depth;
+    int top = depth - 1;
+
+    switch(genericOpcode(code[0])){
+        case OP_CONSTANT:
+            loadImmediate(jit, RAX, constants[code[1]]);
+            storeSlot(jit, RAX, depth);
+            kinds[depth] = IS_NUMBER(constants[code[1]]) ? KIND_NUMBER
+                         : IS_INT(constants[code[1]]) ? KIND_INT : KIND_UNKNOWN;
+            break;
+        case OP_NIL:
+        case OP_TRUE:
+        case OP_FALSE: {
+            uint8_t instruction = genericOpcode(code[0]);
+            loadImmediate(jit, RAX, instruction == OP_NIL ? NIL_VAL : instruction == OP_TRUE ? TRUE_VAL : FALSE_VAL);
+            storeSlot(jit, RAX, depth);
+            kinds[depth] = KIND_UNKNOWN;
+            break;
+        }
+        case OP_NEGATE: traceUnary(jit, kinds, step, index, true); break;
+        case OP_INCREMENT: traceUnary(jit, kinds, step, index, false); break;
+        case OP_ADD:
+            if(step->flags & TRACE_STRINGS) {
+                loadVM(jit);
+                slotAddress(jit, RSI, top - 1);
+                callRuntime(jit, traceConcat);
+                PUT(0x84, 0xc0); // test al, al
+                jumpIfEqualTo(jit, TARGET_SIDE_EXIT, index);
+                kinds[top - 1] = KIND_UNKNOWN;
+            } else {
+                traceArithmetic(jit, kinds, step, index, OP_ADD, 0x58);
+            }
+            break;
+        case OP_SUBTRACT: traceArithmetic(jit, kinds, step, index, OP_SUBTRACT, 0x5c); break;
+        case OP_MULTIPLY: traceArithmetic(jit, kinds, step, index, OP_MULTIPLY, 0x59); break;
+        case OP_DIVIDE: traceArithmetic(jit, kinds, step, index, OP_DIVIDE, 0x5e); break;
+        case OP_GREATER: traceComparison(jit, kinds, step, index, false); break;
+        case OP_LESS: traceComparison(jit, kinds, step, index, true); break;
+        case OP_NOT:
+            loadSlot(jit, RDI, top);
+            callRuntime(jit, jitNot);
+            storeSlot(jit, RAX, top);
+            kinds[top] = KIND_UNKNOWN;
+            break;
+        case OP_EQUAL:
+            loadSlot(jit, RDI, top - 1);
+            loadSlot(jit, RSI, top);
+            callRuntime(jit, jitEqual);
+            storeSlot(jit, RAX, top - 1);
+            kinds[top - 1] = KIND_UNKNOWN;
+            break;
+        case OP_PRINT:
+            loadSlot(jit, RDI, top);
+            callRuntime(jit, jitPrint);
+            break;
+        case OP_POP:
+        case OP_JUMP:
+            break;
+        case OP_DEFINE_GLOBAL:
+            loadVM(jit);
+            loadImmediate(jit, RSI, (uint64_t)(uintptr_t)AS_STRING(constants[code[1]]));
+            loadSlot(jit, RDX, top);
+            callRuntime(jit, jitDefineGlobal);
+            break;
+        case OP_GET_GLOBAL:
+        case OP_SET_GLOBAL: {
+            bool set = genericOpcode(code[0]) == OP_SET_GLOBAL;
+            loadVM(jit);
+            loadImmediate(jit, RSI, (uint64_t)(uintptr_t)AS_STRING(constants[code[1]]));
+            slotAddress(jit, RDX, set ? top : depth);
+            callRuntime(jit, set ? (void*)traceSetGlobal : (void*)traceGetGlobal);
+            PUT(0x84, 0xc0); // test al, al
+            jumpIfEqualTo(jit, TARGET_SIDE_EXIT, index);
+            if(!set) kinds[depth] = KIND_UNKNOWN;
+            break;
+        }
+        case OP_GET_LOCAL:
+            loadSlot(jit, RAX, code[1]);
+            storeSlot(jit, RAX, depth);
+            kinds[depth] = kinds[code[1]];
+            break;
+        case OP_SET_LOCAL:
+            loadSlot(jit, RAX, top);
+            storeSlot(jit, RAX, code[1]);
+            kinds[code[1]] = kinds[top];
+            break;
+        case OP_JUMP_IF_FALSE:
+            //Only the direction the recording went stays on the trace
+            loadSlot(jit, RAX, top);
+            loadImmediate(jit, RCX, FALSE_VAL);
+            PUT(0x48, 0x39, 0xc8); // cmp rax, rcx
+            if(step->flags & TRACE_TAKEN) {
+                int falsey = jumpForward(jit, true);
+                loadImmediate(jit, RCX, NIL_VAL);
+                PUT(0x48, 0x39, 0xc8);
+                jumpIfNotEqualTo(jit, TARGET_SIDE_EXIT, index);
+                landHere(jit, falsey);
+            } else {
+                jumpIfEqualTo(jit, TARGET_SIDE_EXIT, index);
+                loadImmediate(jit, RCX, NIL_VAL);
+                PUT(0x48, 0x39, 0xc8);
+                jumpIfEqualTo(jit, TARGET_SIDE_EXIT, index);
+            }
+            break;
+        case OP_CALL: {
+            int callee = top - code[1];
+            loadVM(jit);
+            loadContext(jit);
+            slotAddress(jit, RDX, callee);
+            loadInt(jit, RCX, code[1]);
+            loadImmediate(jit, R8, (uint64_t)(uintptr_t)(code + 3));
+            callRuntime(jit, traceCall);
+            errorIfFalse(jit);
+            kinds[callee] = KIND_UNKNOWN;
+            break;
+        }
+        case OP_CLOSURE:
+            loadVM(jit);
+            loadImmediate(jit, RSI, (uint64_t)(uintptr_t)AS_FUNCTION(constants[code[1]]));
+            slotAddress(jit, RDX, depth);
+            callRuntime(jit, traceClosure);
+            PUT(0x84, 0xc0); // test al, al
+            jumpIfEqualTo(jit, TARGET_SIDE_EXIT, index);
+            kinds[depth] = KIND_UNKNOWN;
+            break;
+        case OP_LOOP:
+            //Back to the top, where nothing is known about the slots again
+            jumpTo(jit, TARGET_BYTECODE, 0);
+            break;
+    }
+}
+
+static Trace* compileTrace(VM* vm, TraceRecorder* recorder){
+    ObjFunction* function = recorder->function;
+    Jit state = {NULL, 0, 0, NULL, 0, 0, function, vm};
+    Jit* jit = &state;
+
+    //Same registers as a compiled function, except rbx points straight
+    //at the interpreter's slots and r14 at its frame
+    emitSaveRegisters(jit);
+    PUT(0x48, 0x83, 0xec, 0x08); // sub rsp, 8
+    PUT(0x49, 0x89, 0xff);       // mov r15, rdi
+    PUT(0x48, 0x89, 0xf3);       // mov rbx, rsi
+    PUT(0x49, 0x89, 0xd6);       // mov r14, rdx
+    PUT(0x49, 0xbc);             // mov r12, QNAN
+    put64(jit, QNAN);
+
+    int loopStart = jit->count;
+    uint8_t* kinds = ALLOCATE(uint8_t, function->maxStack);
+    for(int i = 0; i < function->maxStack; i++) kinds[i] = KIND_UNKNOWN;
+    for(int i = 0; i < recorder->count; i++){
+        traceInstruction(jit, kinds, &recorder->steps[i], i);
+    }
+    FREE_ARRAY(uint8_t, kinds, function->maxStack);
+
+    //Each step's exit stub returns its index, errors return -1
+    int* sideExits = ALLOCATE(int, recorder->count);
+    for(int i = 0; i < recorder->count; i++){
+        sideExits[i] = jit->count;
+        loadInt(jit, RAX, i);
+        jumpTo(jit, TARGET_EXIT, 0);
+    }
+    int error = jit->count;
+    loadInt(jit, RAX, -1);
+    int finish = jit->count;
+    emitReturn(jit);
+    resolveFixups(jit, &loopStart, sideExits, error, finish);
+    FREE_ARRAY(int, sideExits, recorder->count);
+
+    uint8_t* code;
+    Trace* trace;
+    CodeArena* arena = installCode(jit, sizeof(Trace) + sizeof(TraceExit) * recorder->count, (void**)&trace, &code);
+    if(arena == NULL) {
+        freeJit(jit);
+        return NULL;
+    }
+    trace->code = (TraceFn)(void*)code;
+    trace->exitCount = recorder->count;
+    for(int i = 0; i < recorder->count; i++){
+        trace->exits[i].offset = recorder->steps[i].offset;
+        trace->exits[i].depth = recorder->steps[i].depth;
+    }
+    makeExecutable(arena);
+    freeJit(jit);
+    return trace;
+}
+
+static void stopRecording(VM* vm, bool compiled){
+    TraceRecorder* recorder = vm->recorder;
+    if(!compiled) recorder->loop->hotness = -1;
+    vm->recorder = NULL;
+    FREE(TraceRecorder, recorder);
+}
+
+//Called on the back edge that made the loop hot. The interpreter is
+//about to run the loop header, recording starts there
+void traceStart(VM* vm, LoopCounter* loop){
+    TraceRecorder* recorder = ALLOCATE(TraceRecorder, 1);
+    recorder->loop = loop;
+    recorder->frame = vm->frameCount - 1;
+    recorder->function = vm->frames[recorder->frame].closure->function;
+    recorder->count = 0;
+    vm->recorder = recorder;
+}
+
+void traceAbort(VM* vm){
+    if(vm->recorder != NULL) stopRecording(vm, false);
+}
+
+//Called before each instruction while recording. Instructions of callees
+//are run by the trace through a call, so only the loop's own frame is
+//recorded. Reaching the back edge again closes the trace
+//Whether a closure made in the function can reach its slots, where a
+//call could change them behind the trace's back
+static bool capturesLocals(Chunk* chunk){
+    for(int offset = 0; offset < chunk->count; offset += instructionLength(chunk->code[offset])){
+        if(chunk->code[offset] == OP_CAPTURE && chunk->code[offset + 1]) return true;
+    }
+    return false;
+}
+
+void traceRecord(VM* vm, uint8_t* ip, Value* stackTop){
+    TraceRecorder* recorder = vm->recorder;
+    int frameIndex = vm->frameCount - 1;
+    if(frameIndex > recorder->frame) return;
+    if(frameIndex < recorder->frame || recorder->count == TRACE_MAX) {
+        traceAbort(vm);
+        return;
+    }
+
+    CallFrame* frame = &vm->frames[frameIndex];
+    if(frame->closure->function != recorder->function) {
+        traceAbort(vm);
+        return;
+    }
+    Chunk* chunk = &recorder->function->chunk;
+    int offset = (int)(ip - chunk->code);
+    uint8_t instruction = genericOpcode(*ip);
+    TraceStep* step = &recorder->steps[recorder->count++];
+    step->offset = offset;
+    step->depth = (int)(stackTop - frame->slots);
+    step->flags = 0;
+
+    switch(instruction){
+        case OP_ADD:
+            if(IS_STRING(stackTop[-1]) && IS_STRING(stackTop[-2])) {
+                step->flags = TRACE_STRINGS;
+                break;
+            }
+            //fallthrough
+        case OP_SUBTRACT:
+        case OP_MULTIPLY:
+        case OP_DIVIDE:
+        case OP_GREATER:
+        case OP_LESS:
+            //About to fail, nothing worth compiling
+            if(!IS_NUMERIC(stackTop[-1]) || !IS_NUMERIC(stackTop[-2])) {
+                traceAbort(vm);
+                break;
+            }
+            if(IS_INT(stackTop[-2])) step->flags |= TRACE_LEFT_INT;
+            if(IS_INT(stackTop[-1])) step->flags |= TRACE_RIGHT_INT;
+            break;
+        case OP_NEGATE:
+        case OP_INCREMENT:
+            if(!IS_NUMERIC(stackTop[-1])) {
+                traceAbort(vm);
+                break;
+            }
+            if(IS_INT(stackTop[-1])) step->flags = TRACE_RIGHT_INT;
+            break;
+        case OP_JUMP_IF_FALSE:
+            if(isFalsey(stackTop[-1])) step->flags = TRACE_TAKEN;
+            break;
+        case OP_CALL:
+            if(capturesLocals(chunk)) traceAbort(vm);
+            break;
+        case OP_CLOSURE:
+            //jitClosure has nothing to capture with
+            if(AS_FUNCTION(chunk->constants.values[ip[1]])->upvalueCount > 0) traceAbort(vm);
+            break;
+        case OP_LOOP:
+            //An inner loop's back edge would need a trace of its own
+            if(jumpTarget(chunk->code, offset) != recorder->loop->header) {
+                traceAbort(vm);
+                break;
+            }
+            recorder->loop->trace = compileTrace(vm, recorder);
+            stopRecording(vm, recorder->loop->trace != NULL);
+            break;
+        case OP_RETURN:
+        case OP_CONSTANT_LONG:
+        case OP_GET_UPVALUE:
+        case OP_SET_UPVALUE:
+        case OP_YIELD:
+        case OP_RESUME:
+        case OP_CLOSE_UPVALUE:
+            traceAbort(vm);
+            break;
+        default:
+            break;
+    }
+}
+
+#else
+
+bool jitCompile(VM* vm, ObjFunction* function){
+    (void)vm;
+    (void)function;
+    return false;
+}
+
+//Nothing to record for, so the loop stops counting
+void traceStart(VM* vm, LoopCounter* loop){
+    (void)vm;
+    loop->hotness = -1;
+}
+
+void traceRecord(VM* vm, uint8_t* ip, Value* stackTop){
+    (void)vm;
+    (void)ip;
+    (void)stackTop;
+}
+
+void traceAbort(VM* vm){
+    (void)vm;
+}
+
+#endif
@@ -0,0 +1,42 @@
+#ifndef cInterp_jit_h
+#define cInterp_jit_h
+
+#include "common.h"
+#include "object.h"
+#include "vm.h"
+
+//Calls plus loop back edges a function runs interpreted before --jit
+//compiles it. The new code is used from the next call on
+#define JIT_THRESHOLD 1000
+//Back edges before a loop running in the interpreter gets a trace, and
+//the most instructions one iteration may record
+#define TRACE_THRESHOLD 50
+#define TRACE_MAX 512
+
+//Templates assume x86-64 and a Value that fits in a register
+#if defined(__x86_64__) && defined(NAN_BOXING)
+#define JIT_SUPPORTED
+#endif
+
+//Where the interpreter picks up after a guard fails
+typedef struct {
+    int offset;
+    int depth;
+} TraceExit;
+
+//Runs the loop on the frame's slots until a guard fails. Returns the
+//index of the exit taken, or -1 after reporting a runtime error
+typedef int (*TraceFn)(VM* vm, Value* slots, CallFrame* frame);
+
+typedef struct Trace {
+    TraceFn code;
+    int exitCount;
+    TraceExit exits[]; // one per recorded instruction
+} Trace;
+
+bool jitCompile(VM* vm, ObjFunction* function);
+void traceStart(VM* vm, LoopCounter* loop);
+void traceRecord(VM* vm, uint8_t* ip, Value* stackTop);
+void traceAbort(VM* vm);
+
+#endif
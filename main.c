@@ -5,7 +5,25 @@
 #include "chunk.h"
 #include "debug.h"
 #include "vm.h"
-static void repl(){
+#include "cache.h"
+#include "snapshot.h"
+#include "aot.h"
+
+//--budget ran out before the script finished
+static void outOfBudget(){
+    fprintf(stderr, "Out of budget.\n");
+    exit(75);
+}
+
+//The VM's stacks are reserved up front, and that can fail
+static void startVM(VM* vm){
+    if(!initVM(vm)) {
+        fprintf(stderr, "Out of memory.\n");
+        exit(70);
+    }
+}
+
+static void repl(VM* vm){
     char line[1024];
     while(true){
         printf("> ");
@@ -13,7 +31,7 @@ static void repl(){
             printf("\n");
             break;
         }
-        interpret(line);
+        if(interpret(vm, line) == INTERPRET_OUT_OF_BUDGET) outOfBudget();
     }
 }
 
@@ -47,28 +65,176 @@ static char* readFile(const char* path){
     return buffer;
 }
 
-//Read the file and execute the string of source code
-static void runFile(const char* path) {
+//foo.lox becomes foo<extension>, anything else gets it appended
+static char* pathFor(const char* path, const char* extension) {
+    size_t length = strlen(path);
+    char* result = (char*)malloc(length + strlen(extension) + 1);
+    if(length > 4 && strcmp(path + length - 4, ".lox") == 0) {
+        length -= 4;
+    }
+    memcpy(result, path, length);
+    strcpy(result + length, extension);
+    return result;
+}
+
+//Compiles the script once, bypassing the cache, and builds foo.so
+//from it. runFile then picks foo.so up while the source is unchanged
+static void emitNative(VM* vm, const char* path) {
+    char* source = readFile(path);
+    ObjFunction* function = compile(vm, source);
+    if(function == NULL) exit(65);
+
+    char* cPath = pathFor(path, ".c");
+    char* nativePath = pathFor(path, ".so");
+    if(!emitC(cPath, source, function)) {
+        fprintf(stderr, "Could not write \"%s\".\n", cPath);
+        exit(74);
+    }
+    if(!buildNative(cPath, nativePath)) {
+        fprintf(stderr, "Could not build \"%s\".\n", nativePath);
+        exit(70);
+    }
+    free(cPath);
+    free(nativePath);
+    free(source);
+}
+
+//Read the file and execute the string of source code,
+//skipping the compiler when the cache matches the source
+static void runFile(VM* vm, const char* path) {
     char* source = readFile(path);
-    InterpretResult result = interpret(source);
+    char* cachePath = pathFor(path, ".loxc");
+    ObjFunction* function = loadCache(vm, cachePath, source);
+    if(function == NULL) {
+        function = compile(vm, source);
+        if(function != NULL) writeCache(cachePath, source, function);
+    }
+    if(function != NULL) {
+        char* nativePath = pathFor(path, ".so");
+        loadNative(nativePath, source, function);
+        free(nativePath);
+    }
+    free(cachePath);
     free(source);
 
+    if(function == NULL) exit(65);
+    InterpretResult result = interpretFunction(vm, function);
+
     if(result == INTERPRET_COMPILE_ERR) exit(65);
     if(result == INTERPRET_RUNTIME_ERR) exit(70);
+    if(result == INTERPRET_OUT_OF_BUDGET) outOfBudget();
+}
+
+//Compiles every file up front across all cores, then runs them in order
+static void runFiles(VM* vm, const char* paths[], int count) {
+    const char** sources = (const char**)malloc(sizeof(char*) * count);
+    ObjFunction** functions = (ObjFunction**)malloc(sizeof(ObjFunction*) * count);
+    for(int i = 0; i < count; i++) sources[i] = readFile(paths[i]);
+
+    bool compiled = compileParallel(vm, sources, count, functions);
+    for(int i = 0; i < count; i++) free((char*)sources[i]);
+    free(sources);
+    if(!compiled) exit(65);
+
+    for(int i = 0; i < count; i++){
+        InterpretResult result = interpretFunction(vm, functions[i]);
+        if(result == INTERPRET_RUNTIME_ERR) exit(70);
+        if(result == INTERPRET_OUT_OF_BUDGET) outOfBudget();
+    }
+    free(functions);
+}
+
+static void usage() {
+    fprintf(stderr, "Usage: cInterp [--jit] [--max-frames n] [--budget n] [--max-heap bytes] [--restore image] [path...]\n");
+    fprintf(stderr, "       cInterp --snapshot image script\n");
+    fprintf(stderr, "       cInterp --emit-c script\n");
+    exit(64);
 }
 
 int main(int argc, const char* argv[]) {
-    initVM();
+    //--jit compiles hot functions and loops to machine code as they run,
+    //--max-frames sets how deep calls may nest, --budget how many loop
+    //iterations and calls the program may run, --max-heap how much it
+    //may allocate
+    bool jit = false;
+    long budget = -1;
+    long heapLimit = 0;
+    VM vm;
+    while(argc > 1) {
+        if(strcmp(argv[1], "--jit") == 0) {
+            jit = true;
+            argv++;
+            argc--;
+        } else if(strcmp(argv[1], "--max-frames") == 0) {
+            if(argc < 3) usage();
+            int limit = atoi(argv[2]);
+            if(limit < 1 || limit > FRAMES_LIMIT) usage();
+            setFrameLimit(limit);
+            argv += 2;
+            argc -= 2;
+        } else if(strcmp(argv[1], "--budget") == 0) {
+            if(argc < 3) usage();
+            budget = atol(argv[2]);
+            if(budget < 0) usage();
+            argv += 2;
+            argc -= 2;
+        } else if(strcmp(argv[1], "--max-heap") == 0) {
+            if(argc < 3) usage();
+            heapLimit = atol(argv[2]);
+            if(heapLimit < 1) usage();
+            argv += 2;
+            argc -= 2;
+        } else {
+            break;
+        }
+    }
+
+    //--snapshot runs a startup script once and saves the heap it leaves behind
+    if(argc > 1 && strcmp(argv[1], "--snapshot") == 0) {
+        if(argc != 4) usage();
+        startVM(&vm);
+        runFile(&vm, argv[3]);
+        if(!writeSnapshot(&vm, argv[2])) {
+            fprintf(stderr, "Could not write snapshot \"%s\".\n", argv[2]);
+            exit(74);
+        }
+        freeVM(&vm);
+        return 0;
+    }
+
+    if(argc > 1 && strcmp(argv[1], "--emit-c") == 0) {
+        if(argc != 3) usage();
+        startVM(&vm);
+        emitNative(&vm, argv[2]);
+        freeVM(&vm);
+        return 0;
+    }
+
+    //--restore starts from that heap instead of an empty VM
+    if(argc > 1 && strcmp(argv[1], "--restore") == 0) {
+        if(argc < 3) usage();
+        if(!restoreSnapshot(&vm, argv[2])) {
+            fprintf(stderr, "Could not restore snapshot \"%s\".\n", argv[2]);
+            exit(74);
+        }
+        argv += 2;
+        argc -= 2;
+    } else {
+        startVM(&vm);
+    }
+    vm.jit = jit;
+    if(budget >= 0) setBudget(&vm, budget);
+    setHeapLimit(&vm, (size_t)heapLimit);
+
     if(argc == 1) {
-        repl();
+        repl(&vm);
     } else if (argc == 2){
-        runFile(argv[1]);
+        runFile(&vm, argv[1]);
     } else {
-        fprintf(stderr, "Usage: cInterp [path]\n");
-        exit(64);
+        runFiles(&vm, argv + 1, argc - 1);
     }
     
-    freeVM();
+    freeVM(&vm);
     // freeChunk(&chunk);
     return 0;
 }
\ No newline at end of file
@@ -1,20 +1,100 @@
+#include <stdio.h>
 #include <stdlib.h>
+#include <sys/mman.h>
 #include "memory.h"
 #include "vm.h"
+#include "worker.h"
+
+//The VM running on this thread, which reallocate charges. Objects are
+//allocated against bare object lists, so this is the one place that
+//sees every allocation a script makes
+static __thread VM* heapOwner = NULL;
+
+//Given back to malloc when it runs dry, so what cannot fail still gets
+//its memory and the VM stops at its next safepoint instead
+#define SPARE_SIZE (1024 * 1024)
+static void* spare = NULL;
+
+//Makes vm the one this thread charges, returning the one it was. The
+//spare is put back here once a VM has used it up
+VM* useHeap(VM* vm){
+    if(vm != NULL && __atomic_load_n(&spare, __ATOMIC_ACQUIRE) == NULL) {
+        void* fresh = malloc(SPARE_SIZE);
+        void* expected = NULL;
+        if(!__atomic_compare_exchange_n(&spare, &expected, fresh, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) free(fresh);
+    }
+    VM* previous = heapOwner;
+    heapOwner = vm;
+    return previous;
+}
+
+bool heapExceeded(VM* vm){
+    return vm->outOfMemory || (vm->heapLimit > 0 && vm->bytesAllocated > vm->heapLimit);
+}
+
+//Memory allocated before the VM started charging may be freed while it
+//does, so the count stops at zero
+static void chargeHeap(VM* vm, size_t oldSize, size_t newSize){
+    if(newSize >= oldSize) {
+        vm->bytesAllocated += newSize - oldSize;
+    } else {
+        size_t freed = oldSize - newSize;
+        vm->bytesAllocated -= freed < vm->bytesAllocated ? freed : vm->bytesAllocated;
+    }
+    //Only what the script allocates can fail, the tables and arrays
+    //around it still go ahead. The next safepoint takes the slow path
+    //and raises the error, with what the slice used until now still
+    //charged to the budget
+    if(heapExceeded(vm) && vm->ticks > 0) {
+        vm->slice -= vm->ticks;
+        vm->ticks = 0;
+    }
+}
 
 //Frees allocation or uses realloc to resize
 void* reallocate(void* pointer, size_t oldSize, size_t newSize){
+    //Arrays allocated lazily are freed with their count whether or not
+    //they were ever made
+    if(pointer == NULL) oldSize = 0;
+    if(heapOwner != NULL) chargeHeap(heapOwner, oldSize, newSize);
     if(newSize == 0 ){
         free(pointer);
         return NULL;
     }
     void* result = realloc(pointer, newSize);
-    // Sometimes realloc returns NULL (ie out of memory);
-    if(result == NULL) exit(1);
+    if(result == NULL) {
+        free(__atomic_exchange_n(&spare, NULL, __ATOMIC_ACQ_REL));
+        if(heapOwner != NULL) heapOwner->outOfMemory = true;
+        result = realloc(pointer, newSize);
+    }
+    //Nothing left to hand out, not even the spare
+    if(result == NULL) {
+        fprintf(stderr, "Out of memory.\n");
+        exit(70);
+    }
     return result;
 }
 
-static void freeObject(Obj* object){
+//For what a running script allocates, which the VM turns into a runtime
+//error: NULL when growing would take it past its limit or nothing is
+//left, with the old block untouched and nothing charged
+void* tryReallocate(void* pointer, size_t oldSize, size_t newSize){
+    if(pointer == NULL) oldSize = 0;
+    VM* vm = heapOwner;
+    if(vm != NULL && newSize > oldSize && (vm->outOfMemory ||
+       (vm->heapLimit > 0 && vm->bytesAllocated + (newSize - oldSize) > vm->heapLimit))) {
+        return NULL;
+    }
+    void* result = realloc(pointer, newSize);
+    if(result == NULL) {
+        if(vm != NULL) vm->outOfMemory = true;
+        return NULL;
+    }
+    if(vm != NULL) chargeHeap(vm, oldSize, newSize);
+    return result;
+}
+
+void freeObject(Obj* object){
     switch(object->type){
         Value test = OBJ_VAL(object);
         case OBJ_FUNCTION: {
@@ -36,7 +116,24 @@ static void freeObject(Obj* object){
             break;
         }
         case OBJ_CLOSURE: {
-            FREE(ObjClosure, object);
+            ObjClosure* closure = (ObjClosure*)object;
+            reallocate(object, CLOSURE_SIZE(closure->upvalueCount), 0);
+            break;
+        }
+        case OBJ_UPVALUE: {
+            FREE(ObjUpvalue, object);
+            break;
+        }
+        case OBJ_CHANNEL: {
+            releaseChannel(((ObjChannel*)object)->channel);
+            FREE(ObjChannel, object);
+            break;
+        }
+        case OBJ_FIBER: {
+            ObjFiber* fiber = (ObjFiber*)object;
+            freeFiberStack(fiber);
+            if(fiber->result != NULL) finishJob(fiber->result, NULL);
+            FREE(ObjFiber, object);
             break;
         }
         default:
@@ -44,11 +141,75 @@ static void freeObject(Obj* object){
     }
 }
 
-void freeObjects(){
-    Obj* object = vm.objects;
+//A finished fiber never runs again, so its stack can go before it does
+void freeFiberStack(ObjFiber* fiber){
+    FiberStack* stack = &fiber->stack;
+    releaseMemory(stack->frames, sizeof(CallFrame) * stack->framesMax);
+    releaseMemory(stack->stack, sizeof(Value) * stack->framesMax * FRAME_SLOTS);
+    stack->frames = NULL;
+    stack->frameCount = 0;
+    stack->stack = NULL;
+    stack->stackTop = NULL;
+    stack->stackEnd = NULL;
+}
+
+void freeObjects(VM* vm){
+    Obj* object = vm->objects;
     while(object != NULL){
         Obj* next = object->next;
         freeObject(object);
         object = next;
     }
 }
+
+//Maps a fresh region of pages for finalized chunks, NULL if there is no
+//room left. Size includes the CodeArena header itself
+CodeArena* allocateCodeArena(size_t size){
+    void* region = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(region == MAP_FAILED) return NULL;
+    CodeArena* arena = (CodeArena*)region;
+    arena->size = size;
+    arena->next = NULL;
+    arena->mapping = NULL;
+    arena->mappingSize = 0;
+    return arena;
+}
+
+//Hands an arena to the VM, which unmaps it in freeVM
+void adoptCodeArena(VM* vm, CodeArena* arena){
+    arena->next = vm->codeArenas;
+    vm->codeArenas = arena;
+}
+
+//For arenas holding only constants, which nothing writes once loaded.
+//Bytecode is quickened in place so it stays writable.
+//Must come after adoptCodeArena since the header is sealed too
+void sealCodeArena(CodeArena* arena){
+    mprotect(arena, arena->size, PROT_READ);
+}
+
+//Address space for memory that must never move, pages are only backed
+//once touched. NULL when even that has run out
+void* reserveMemory(size_t size){
+    void* region = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if(region == MAP_FAILED) {
+        if(heapOwner != NULL) heapOwner->outOfMemory = true;
+        return NULL;
+    }
+    return region;
+}
+
+void releaseMemory(void* pointer, size_t size){
+    if(pointer != NULL) munmap(pointer, size);
+}
+
+void freeCodeArenas(VM* vm){
+    CodeArena* arena = vm->codeArenas;
+    while(arena != NULL){
+        CodeArena* next = arena->next;
+        if(arena->mapping != NULL) munmap(arena->mapping, arena->mappingSize);
+        munmap(arena, arena->size);
+        arena = next;
+    }
+    vm->codeArenas = NULL;
+}
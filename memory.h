@@ -2,6 +2,7 @@
 #define cInterp_memory_h
 
 #include "common.h"
+#include "object.h"
 
 #define ALLOCATE(type, count) \
     (type*)reallocate(NULL, 0, sizeof(type) * (count))
@@ -17,11 +18,34 @@
         sizeof(type) * (newCount))
 
 #define FREE_ARRAY(type, pointer, oldCount) \
-    reallocate(pointer, oldCount, 0)
+    reallocate(pointer, sizeof(type) * (oldCount), 0)
 
 #define FREE(type, pointer) reallocate(pointer, sizeof(type), 0);
 
+#define TRY_ALLOCATE(type, count) \
+    (type*)tryReallocate(NULL, 0, sizeof(type) * (count))
+
+//Header at the start of every code arena, arenas are chained
+//so the VM can unmap them all when it shuts down
+typedef struct CodeArena {
+    struct CodeArena* next;
+    size_t size;
+    void* mapping; // file mapping the arena's chunks also point into
+    size_t mappingSize;
+} CodeArena;
+
 void* reallocate(void* pointer, size_t oldSize, size_t newSize);
-void freeObjects();
+void* tryReallocate(void* pointer, size_t oldSize, size_t newSize);
+VM* useHeap(VM* vm);
+bool heapExceeded(VM* vm);
+void freeObject(Obj* object);
+void freeFiberStack(ObjFiber* fiber);
+void freeObjects(VM* vm);
+CodeArena* allocateCodeArena(size_t size);
+void adoptCodeArena(VM* vm, CodeArena* arena);
+void sealCodeArena(CodeArena* arena);
+void freeCodeArenas(VM* vm);
+void* reserveMemory(size_t size);
+void releaseMemory(void* pointer, size_t size);
 
 #endif
\ No newline at end of file
@@ -5,33 +5,55 @@
 #include "table.h"
 #include "value.h"
 #include "vm.h"
+#include "worker.h"
 
-#define ALLOCATE_OBJ(type, objectType) \
-    (type*)allocateObject(sizeof(type), objectType)
+#define ALLOCATE_OBJ(objects, type, objectType) \
+    (type*)allocateObject(objects, sizeof(type), objectType, false)
 
-//Allocates based on given size of the heap
-static Obj* allocateObject(size_t size, ObjType type) {
-    Obj* object = (Obj*)(reallocate(NULL, 0, size));
+#define TRY_ALLOCATE_OBJ(objects, type, objectType) \
+    (type*)allocateObject(objects, sizeof(type), objectType, true)
+
+//Allocates based on given size of the heap and links it into
+//the given object list so it gets freed with it. What a running script
+//allocates is fallible, NULL once the VM's heap has no room for it
+static Obj* allocateObject(Obj** objects, size_t size, ObjType type, bool fallible) {
+    Obj* object = (Obj*)(fallible ? tryReallocate(NULL, 0, size) : reallocate(NULL, 0, size));
+    if(object == NULL) return NULL;
     object->type = type;
-    object->next = vm.objects;
-    vm.objects = object;
+    object->next = *objects;
+    *objects = object;
     return object;
 }
 
-ObjClosure* newClosure(ObjFunction* function){
-    ObjClosure* closure = ALLOCATE_OBJ(ObjClosure, OBJ_CLOSURE);
+//The caller fills in the upvalues
+ObjClosure* newClosure(VM* vm, ObjFunction* function){
+    ObjClosure* closure = (ObjClosure*)allocateObject(&vm->objects, CLOSURE_SIZE(function->upvalueCount), OBJ_CLOSURE, true);
+    if(closure == NULL) return NULL;
     closure->function = function;
+    closure->upvalueCount = function->upvalueCount;
+    for(int i = 0; i < function->upvalueCount; i++) closure->upvalues[i] = NULL;
     return closure;
 }
 
+//Open on slot, or closed over nil when slot is NULL
+ObjUpvalue* newUpvalue(VM* vm, Value* slot){
+    ObjUpvalue* upvalue = TRY_ALLOCATE_OBJ(&vm->objects, ObjUpvalue, OBJ_UPVALUE);
+    if(upvalue == NULL) return NULL;
+    upvalue->closed = NIL_VAL;
+    upvalue->location = slot != NULL ? slot : &upvalue->closed;
+    upvalue->next = NULL;
+    return upvalue;
+}
+
 //Creates new object on heap and initialiszes it (similar to constructors)
-static ObjString* allocateString(char* chars, int length, uint32_t hash) {
+static ObjString* allocateString(Obj** objects, Table* strings, char* chars, int length, uint32_t hash, bool fallible) {
     //Init object so vm knows type of object
-    ObjString* string = ALLOCATE_OBJ(ObjString, OBJ_STRING);
+    ObjString* string = (ObjString*)allocateObject(objects, sizeof(ObjString), OBJ_STRING, fallible);
+    if(string == NULL) return NULL;
     string->length = length;
     string->chars = chars;
     string->hash = hash;
-    tableSet(&vm.strings,  string, NIL_VAL);
+    tableSet(strings,  string, NIL_VAL);
     return string;
 }
 
@@ -46,9 +68,10 @@ static uint32_t hashString(const char* key, int length){
     return hash;
 }
 
-ObjString* copyString(const char* chars, int length){
+//copyString against any object list and intern table, not just the VM's
+ObjString* internString(Obj** objects, Table* strings, const char* chars, int length){
     uint32_t hash = hashString(chars, length);
-    ObjString* interned = tableFindString(&vm.strings, chars, length, hash);
+    ObjString* interned = tableFindString(strings, chars, length, hash);
     if(interned != NULL) return interned;
     char* heapChars = ALLOCATE(char, length+1);
     //Copy char from chars to heapChars in memory
@@ -56,34 +79,205 @@ ObjString* copyString(const char* chars, int length){
     //Null terminator to end string
     heapChars[length] = '\0';
 
-    return allocateString(heapChars, length, hash); 
+    return allocateString(objects, strings, heapChars, length, hash, false); 
+}
+
+//Same for a running script, NULL when the VM's heap has no room
+ObjString* copyString(VM* vm, const char* chars, int length){
+    uint32_t hash = hashString(chars, length);
+    ObjString* interned = tableFindString(&vm->strings, chars, length, hash);
+    if(interned != NULL) return interned;
+    char* heapChars = TRY_ALLOCATE(char, length+1);
+    if(heapChars == NULL) return NULL;
+    memcpy(heapChars, chars, length);
+    heapChars[length] = '\0';
+    return takeString(vm, heapChars, length);
 }
 
-ObjString* takeString(char* chars, int length){
+ObjString* takeString(VM* vm, char* chars, int length){
     uint32_t hash = hashString(chars, length);
     //If string already exists, free up memory for the string passed in
     //Since we do not need the duplicate string
-    ObjString* interned = tableFindString(&vm.strings, chars, length, hash);
+    ObjString* interned = tableFindString(&vm->strings, chars, length, hash);
     if(interned != NULL) {
         FREE_ARRAY(char, chars, length+1);
         return interned;
     }
-    return allocateString(chars, length, hash);
+    //Chars are freed on failure too, the string owned them either way
+    ObjString* string = allocateString(&vm->objects, &vm->strings, chars, length, hash, true);
+    if(string == NULL) FREE_ARRAY(char, chars, length+1);
+    return string;
 }
 
-ObjFunction* newFunction() {
-    ObjFunction* function = ALLOCATE_OBJ(ObjFunction, OBJ_FUNCTION);
+ObjFunction* newFunction(Obj** objects) {
+    ObjFunction* function = ALLOCATE_OBJ(objects, ObjFunction, OBJ_FUNCTION);
     function->arity = 0;
     function->name = NULL;
     function->upvalueCount = 0;
+    function->maxStack = 0;
+    function->compiled = NULL;
+    function->hotness = 0;
     initChunk(&function->chunk);
     return function;
 }
 
 //Constructor
-ObjNative* newNative(NativeFn function){
-    ObjNative* native = ALLOCATE_OBJ(ObjNative, OBJ_NATIVE);
-    native->function = function;
+ObjNative* newNative(VM* vm, const NativeEntry* entry){
+    ObjNative* native = ALLOCATE_OBJ(&vm->objects, ObjNative, OBJ_NATIVE);
+    native->entry = entry;
     return native;
 }
 
+
+//Takes a reference on the channel, freeObject drops it
+ObjChannel* newChannel(Obj** objects, Channel* channel){
+    ObjChannel* handle = ALLOCATE_OBJ(objects, ObjChannel, OBJ_CHANNEL);
+    handle->channel = channel;
+    retainChannel(channel);
+    return handle;
+}
+
+//Stacks are reserved up front like the VM's own, so frames and slots
+//never move while the fiber is suspended. NULL if either the stacks or
+//the fiber don't fit
+ObjFiber* newFiber(VM* vm, ObjClosure* closure){
+    CallFrame* frames = reserveMemory(sizeof(CallFrame) * FIBER_FRAMES);
+    Value* stack = reserveMemory(sizeof(Value) * FIBER_FRAMES * FRAME_SLOTS);
+    ObjFiber* fiber = frames == NULL || stack == NULL ? NULL : TRY_ALLOCATE_OBJ(&vm->objects, ObjFiber, OBJ_FIBER);
+    if(fiber == NULL) {
+        releaseMemory(frames, sizeof(CallFrame) * FIBER_FRAMES);
+        releaseMemory(stack, sizeof(Value) * FIBER_FRAMES * FRAME_SLOTS);
+        return NULL;
+    }
+    fiber->closure = closure;
+    fiber->state = FIBER_NEW;
+    fiber->caller = NULL;
+    fiber->task = false;
+    fiber->waitFd = -1;
+    fiber->result = NULL;
+    fiber->top = NULL;
+    fiber->stack.framesMax = FIBER_FRAMES;
+    fiber->stack.frameCount = 0;
+    fiber->stack.frames = frames;
+    fiber->stack.stack = stack;
+    fiber->stack.stackTop = fiber->stack.stack;
+    fiber->stack.stackEnd = fiber->stack.stack + FIBER_FRAMES * FRAME_SLOTS;
+    fiber->stack.openUpvalues = NULL;
+    return fiber;
+}
+
+//Only the generic bytecode is copied. Caches, loop counters and machine
+//code all belong to the heap the function came from
+static ObjFunction* copyFunction(Obj** objects, Table* strings, ObjFunction* function){
+    ObjFunction* copy = newFunction(objects);
+    copy->arity = function->arity;
+    copy->upvalueCount = function->upvalueCount;
+    copy->maxStack = function->maxStack;
+    if(function->name != NULL) {
+        copy->name = internString(objects, strings, function->name->chars, function->name->length);
+    }
+
+    Chunk* from = &function->chunk;
+    Chunk* to = &copy->chunk;
+    to->code = ALLOCATE(uint8_t, from->count);
+    copyGenericCode(from, to->code);
+    to->count = to->capacity = from->count;
+    to->lines = ALLOCATE(LineStart, from->lineCount);
+    if(from->lineCount > 0) memcpy(to->lines, from->lines, sizeof(LineStart) * from->lineCount);
+    to->lineCount = to->lineCapacity = from->lineCount;
+    to->callSites = from->callSites;
+    for(int i = 0; i < from->constants.count; i++){
+        writeValueArray(&to->constants, copyValue(objects, strings, from->constants.values[i]));
+    }
+    return copy;
+}
+
+//Objects already copied by one copyValue, so closures sharing an upvalue
+//still share it in the copy and cycles through upvalues end
+typedef struct {
+    Obj** from;
+    Obj** to;
+    int count;
+    int capacity;
+} CopyMap;
+
+static Obj* copiedObject(CopyMap* map, Obj* from){
+    for(int i = 0; i < map->count; i++){
+        if(map->from[i] == from) return map->to[i];
+    }
+    return NULL;
+}
+
+static void addCopied(CopyMap* map, Obj* from, Obj* to){
+    if(map->count == map->capacity) {
+        int oldCapacity = map->capacity;
+        map->capacity = GROW_CAPACITY(oldCapacity);
+        map->from = GROW_ARRAY(Obj*, map->from, oldCapacity, map->capacity);
+        map->to = GROW_ARRAY(Obj*, map->to, oldCapacity, map->capacity);
+    }
+    map->from[map->count] = from;
+    map->to[map->count] = to;
+    map->count++;
+}
+
+static Value copyMapped(Obj** objects, Table* strings, CopyMap* map, Value value);
+
+//The copy is always closed, the stack the variable lived on stays behind
+static ObjUpvalue* copyUpvalue(Obj** objects, Table* strings, CopyMap* map, ObjUpvalue* upvalue){
+    ObjUpvalue* copy = (ObjUpvalue*)copiedObject(map, (Obj*)upvalue);
+    if(copy != NULL) return copy;
+    copy = ALLOCATE_OBJ(objects, ObjUpvalue, OBJ_UPVALUE);
+    copy->closed = NIL_VAL;
+    copy->location = &copy->closed;
+    copy->next = NULL;
+    addCopied(map, (Obj*)upvalue, (Obj*)copy);
+    copy->closed = copyMapped(objects, strings, map, *upvalue->location);
+    return copy;
+}
+
+static Value copyMapped(Obj** objects, Table* strings, CopyMap* map, Value value){
+    if(!IS_OBJ(value)) return value;
+    switch(OBJ_TYPE(value)){
+        case OBJ_STRING:
+            return OBJ_VAL(internString(objects, strings, AS_CSTRING(value), AS_STRING(value)->length));
+        case OBJ_FUNCTION:
+            return OBJ_VAL(copyFunction(objects, strings, AS_FUNCTION(value)));
+        case OBJ_NATIVE: {
+            ObjNative* native = ALLOCATE_OBJ(objects, ObjNative, OBJ_NATIVE);
+            native->entry = AS_NATIVE(value)->entry;
+            return OBJ_VAL(native);
+        }
+        case OBJ_CLOSURE: {
+            ObjClosure* from = AS_CLOSURE(value);
+            Obj* copied = copiedObject(map, (Obj*)from);
+            if(copied != NULL) return OBJ_VAL(copied);
+            ObjFunction* function = copyFunction(objects, strings, from->function);
+            ObjClosure* closure = (ObjClosure*)allocateObject(objects, CLOSURE_SIZE(from->upvalueCount), OBJ_CLOSURE, false);
+            closure->function = function;
+            closure->upvalueCount = from->upvalueCount;
+            for(int i = 0; i < from->upvalueCount; i++) closure->upvalues[i] = NULL;
+            addCopied(map, (Obj*)from, (Obj*)closure);
+            for(int i = 0; i < from->upvalueCount; i++){
+                closure->upvalues[i] = copyUpvalue(objects, strings, map, from->upvalues[i]);
+            }
+            return OBJ_VAL(closure);
+        }
+        case OBJ_CHANNEL:
+            return OBJ_VAL(newChannel(objects, AS_CHANNEL(value)->channel));
+        case OBJ_FIBER:
+        case OBJ_UPVALUE:
+            return NIL_VAL;
+    }
+    return NIL_VAL;
+}
+
+//Deep copies a value into another heap, interning its strings in that
+//heap's table. Channels are the one thing shared, the copy refers to
+//the same channel. Fibers stay in the VM that made them and arrive as nil
+Value copyValue(Obj** objects, Table* strings, Value value){
+    CopyMap map = {NULL, NULL, 0, 0};
+    Value copy = copyMapped(objects, strings, &map, value);
+    FREE_ARRAY(Obj*, map.from, map.capacity);
+    FREE_ARRAY(Obj*, map.to, map.capacity);
+    return copy;
+}
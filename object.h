@@ -10,18 +10,28 @@
 #define IS_FUNCTION(value) (isObjType(value, OBJ_FUNCTION))
 #define IS_NATIVE(value) (isObjType(value, OBJ_NATIVE))
 #define IS_CLOSURE(value) (isObjType(value, OBJ_CLOSURE))
+#define IS_CHANNEL(value) (isObjType(value, OBJ_CHANNEL))
+#define IS_FIBER(value) (isObjType(value, OBJ_FIBER))
 #define AS_STRING(value) ((ObjString*)AS_OBJ(value)) //Return as ObjString* pointer
 #define AS_CSTRING(value) (((ObjString*)AS_OBJ(value))->chars) // return as chars array
 #define AS_FUNCTION(value) ((ObjFunction*)AS_OBJ(value))
-#define AS_NATIVE(value) (((ObjNative*)AS_OBJ(value))->function)
+#define AS_NATIVE(value) ((ObjNative*)AS_OBJ(value))
 #define AS_CLOSURE(value) ((ObjClosure*)AS_OBJ(value))
+#define AS_CHANNEL(value) ((ObjChannel*)AS_OBJ(value))
+#define AS_FIBER(value) ((ObjFiber*)AS_OBJ(value))
 
 
+//Defined in vm.h, objects and natives only pass it around
+typedef struct VM VM;
+
 typedef enum {
     OBJ_STRING,
     OBJ_FUNCTION,
     OBJ_NATIVE,
     OBJ_CLOSURE,
+    OBJ_CHANNEL,
+    OBJ_FIBER,
+    OBJ_UPVALUE,
 } ObjType;
 
 
@@ -37,37 +47,122 @@ struct sObjString {
     uint32_t hash;
 };
 
+//Body of a function built by --emit-c or --jit. slots holds the
+//callee and its arguments, returns false after reporting a runtime error
+typedef bool (*CompiledFn)(VM* vm, Value* slots, Value* result);
+
 typedef struct {
     Obj obj;
     int arity;
     int upvalueCount;
+    int maxStack; // deepest the stack gets, counting the callee and arguments
     Chunk chunk;
     ObjString* name;
+    CompiledFn compiled; // NULL unless a native build was loaded or --jit compiled it
+    int hotness; // calls and back edges so far under --jit, -1 once it can't compile
 } ObjFunction;
 
+//A variable a closure captured. While open it points at the slot on the
+//stack, once the slot goes away the value moves into closed
+typedef struct ObjUpvalue {
+    Obj obj;
+    Value* location;
+    Value closed;
+    struct ObjUpvalue* next; // open upvalues of the same stack, deepest slot first
+} ObjUpvalue;
+
+//The upvalues are part of the closure's own allocation
 typedef struct {
     Obj obj;
     ObjFunction* function;
+    int upvalueCount;
+    ObjUpvalue* upvalues[];
 } ObjClosure;
 
+#define CLOSURE_SIZE(upvalueCount) (sizeof(ObjClosure) + sizeof(ObjUpvalue*) * (upvalueCount))
 
-typedef Value (*NativeFn)(int argCount, Value* args);
+
+//Natives get a window onto their arguments, args[0] is the first. They
+//write *result and return true, or call nativeError and return false
+typedef bool (*NativeFn)(VM* vm, int argCount, Value* args, Value* result);
+
+//Natives with a fixed arity of 2 or less that can't fail can give an
+//entry taking the arguments directly instead
+typedef union {
+    Value (*arity0)(void);
+    Value (*arity1)(Value a);
+    Value (*arity2)(Value a, Value b);
+} NativeFast;
+
+typedef struct {
+    const char* name;
+    int arity; // -1 takes any number of arguments
+    NativeFn function; // may be NULL when there is a fast entry
+    NativeFast fast; // arity0 is NULL when there isn't
+} NativeEntry;
 
 typedef struct {
     Obj obj;
-    NativeFn function;
+    const NativeEntry* entry;
 } ObjNative;
 
+//Defined in worker.c. A channel lives outside every heap so workers can
+//share it, each VM holding its own ObjChannel pointing at it
+typedef struct Channel Channel;
+
+typedef struct {
+    Obj obj;
+    Channel* channel;
+} ObjChannel;
+
+typedef enum {
+    FIBER_NEW,
+    FIBER_SUSPENDED,
+    FIBER_RUNNING, // resumed, possibly resuming another fiber itself
+    FIBER_WAITING, // a task parked on the event loop, see io.c
+    FIBER_PREEMPTED, // a task stopped at a safepoint to let others run
+    FIBER_DONE,
+} FiberState;
+
+//A call stack the VM can run on. The VM keeps the running one in its
+//own fields and parks the others in one of these
+typedef struct {
+    struct CallFrame* frames;
+    int frameCount;
+    int framesMax;
+    Value* stack;
+    Value* stackTop;
+    Value* stackEnd;
+    ObjUpvalue* openUpvalues;
+} FiberStack;
+
+typedef struct ObjFiber {
+    Obj obj;
+    ObjClosure* closure;
+    FiberState state;
+    struct ObjFiber* caller; // the resumer while running, NULL for the VM's own stack
+    bool task; // started by async(), only the event loop resumes it
+    int waitFd; // descriptor a waiting task is parked on, -1 for a timer
+    Channel* result; // a submit() job's, which gets what the task returns
+    struct ObjFiber* top; // fiber a preempted task had resumed, where it carries on
+    FiberStack stack;
+} ObjFiber;
+
 //Not a macro because it would evaluate twice.
 //I.E if isObjType(pop()) would pop  twice
 static inline bool isObjType(Value value, ObjType type) {
   return IS_OBJ(value) && AS_OBJ(value)->type == type;
 }
 
-ObjClosure* newClosure(ObjFunction* function);
-ObjString* copyString(const char* chars, int length);
-ObjString* takeString(char* chars, int length);
-ObjFunction* newFunction();
-ObjNative* newNative(NativeFn function);
+ObjClosure* newClosure(VM* vm, ObjFunction* function);
+ObjUpvalue* newUpvalue(VM* vm, Value* slot);
+ObjString* internString(Obj** objects, Table* strings, const char* chars, int length);
+ObjString* copyString(VM* vm, const char* chars, int length);
+ObjString* takeString(VM* vm, char* chars, int length);
+ObjFunction* newFunction(Obj** objects);
+ObjNative* newNative(VM* vm, const NativeEntry* entry);
+ObjChannel* newChannel(Obj** objects, Channel* channel);
+ObjFiber* newFiber(VM* vm, ObjClosure* closure);
+Value copyValue(Obj** objects, Table* strings, Value value);
 
 #endif
\ No newline at end of file
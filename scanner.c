@@ -5,76 +5,74 @@
 #include "scanner.h"
 
 
-Scanner scanner;
-
-void initScanner(const char* source){
-    scanner.start = source;
-    scanner.current = source;
-    scanner.line = 1;
+void initScanner(Scanner* scanner, const char* source){
+    scanner->start = source;
+    scanner->current = source;
+    scanner->line = 1;
 }
-static bool isAtEnd(){
-    return *scanner.current == '\0';
+static bool isAtEnd(Scanner* scanner){
+    return *scanner->current == '\0';
 }
 
-static char peek(){
-    return *scanner.current;
+static char peek(Scanner* scanner){
+    return *scanner->current;
 }
 
-static char peekNext(){
-    if(isAtEnd()) return '\0';
-    return  scanner.current[1];
+static char peekNext(Scanner* scanner){
+    if(isAtEnd(scanner)) return '\0';
+    return  scanner->current[1];
 }
 
 
-static Token makeToken(TokenType type){
+static Token makeToken(Scanner* scanner, TokenType type){
     Token token;
     token.type = type;
-    token.start = scanner.start;
-    token.length = (int)(scanner.current - scanner.start);
-    token.line = scanner.line;
+    token.start = scanner->start;
+    token.length = (int)(scanner->current - scanner->start);
+    token.line = scanner->line;
     return token;
 }
 
-static Token errorToken(const char* message){
+static Token errorToken(Scanner* scanner, const char* message){
     Token token;
     token.type = TOKEN_ERROR;
     token.start = message;
     token.length = (int)strlen(message);
-    token.line = scanner.line;
+    token.line = scanner->line;
 
     return token;
 }
-static char advance(){
-    scanner.current++;
-    return scanner.current[-1];
+static char advance(Scanner* scanner){
+    scanner->current++;
+    return scanner->current[-1];
 }
 
-static bool match(char expected){
-    if(isAtEnd()) return false;
-    if(*scanner.current != expected) return false;
+static bool match(Scanner* scanner, char expected){
+    if(isAtEnd(scanner)) return false;
+    if(*scanner->current != expected) return false;
 
-    scanner.current++;
+    scanner->current++;
     return true;
 }
 
-static void skipWhitespace(){
+static void skipWhitespace(Scanner* scanner){
     while(true){
-        char c = peek();
+        char c = peek(scanner);
         switch(c){
             case ' ':
             case '\r': //carraige return
             case '\t': //tab
-                advance();
+                advance(scanner);
                 break;
             
             case '\n':
-                scanner.line++;
-                advance();
+                scanner->line++;
+                advance(scanner);
                 break;
             
             case '/':
-                if(peekNext() == '/') {
-                    while(peek() != '\n' && !isAtEnd()) advance();
+                if(peekNext(scanner) == '/') {
+                    while(peek(scanner) != '\n' && !isAtEnd(scanner)) advance(scanner);
                 } else {
                     return;
                 }
@@ -85,39 +83,39 @@ static void skipWhitespace(){
 }
 
 ///Check if the keyword is a type or identifier
-static TokenType checkKeyword(int start, int length, const char* rest, TokenType type) {
+static TokenType checkKeyword(Scanner* scanner, int start, int length, const char* rest, TokenType type) {
     //1. Check that lexeme is as long as keyword
     //2. Check that the right characters are present
-    if(scanner.current - scanner.start == start + length && 
-    memcmp(scanner.start + start, rest, length) == 0) {
+    if(scanner->current - scanner->start == start + length && 
+    memcmp(scanner->start + start, rest, length) == 0) {
         return type;
     }
 
     return TOKEN_IDENTIFIER;
 }
-static Token string(){
-    while(peek() != '"' && !isAtEnd()){
-        if(peek()  == '\n') scanner.line++;
-        advance();
+static Token string(Scanner* scanner){
+    while(peek(scanner) != '"' && !isAtEnd(scanner)){
+        if(peek(scanner)  == '\n') scanner->line++;
+        advance(scanner);
     }
-    if(isAtEnd()) return errorToken("Unterminated string");
+    if(isAtEnd(scanner)) return errorToken(scanner, "Unterminated string");
 
-    advance();
-    return makeToken(TOKEN_STRING);
+    advance(scanner);
+    return makeToken(scanner, TOKEN_STRING);
 }
 
 static bool isDigit(char c){
     return c >= '0' && c <= '9';
 }
 
-static Token number(){
-    while(isDigit(peek())) advance();
+static Token number(Scanner* scanner){
+    while(isDigit(peek(scanner))) advance(scanner);
     //decimal number?
-    if(peek() == '.' && isDigit(peekNext())){
-        advance();
-        while(isDigit(peek())) advance();
+    if(peek(scanner) == '.' && isDigit(peekNext(scanner))){
+        advance(scanner);
+        while(isDigit(peek(scanner))) advance(scanner);
     }
-    return makeToken(TOKEN_NUMBER);
+    return makeToken(scanner, TOKEN_NUMBER);
 }
 
 static bool isAlpha(char c) {
@@ -127,74 +125,82 @@ static bool isAlpha(char c) {
 }
 
 
-static TokenType identifierType(){
-    switch(scanner.start[0]) {
-        case 'a': return checkKeyword(1,2,"nd", TOKEN_AND);
-        case 'c': return checkKeyword(1,4, "lass" , TOKEN_CLASS);
-        case 'e': return checkKeyword(1,3, "lse", TOKEN_ELSE);
-        case 'i': return checkKeyword(1,1,"f", TOKEN_IF);
-        case 'n': return checkKeyword(1,2,"il",TOKEN_NIL);
-        case 'o': return checkKeyword(1,1, "r" , TOKEN_OR);
-        case 'p': return checkKeyword(1,4,"rint" ,TOKEN_PRINT);
-        case 'r': return checkKeyword(1,5,"eturn", TOKEN_RETURN);
-        case 's': return checkKeyword(1,4,"uper", TOKEN_SUPER);
-        case 'v': return checkKeyword(1, 2, "ar", TOKEN_VAR);
-        case 'w': return checkKeyword(1, 4, "hile", TOKEN_WHILE);
+static TokenType identifierType(Scanner* scanner){
+    switch(scanner->start[0]) {
+        case 'a': return checkKeyword(scanner, 1,2,"nd", TOKEN_AND);
+        case 'c': return checkKeyword(scanner, 1,4, "lass" , TOKEN_CLASS);
+        case 'e': return checkKeyword(scanner, 1,3, "lse", TOKEN_ELSE);
+        case 'i': return checkKeyword(scanner, 1,1,"f", TOKEN_IF);
+        case 'n': return checkKeyword(scanner, 1,2,"il",TOKEN_NIL);
+        case 'o': return checkKeyword(scanner, 1,1, "r" , TOKEN_OR);
+        case 'p': return checkKeyword(scanner, 1,4,"rint" ,TOKEN_PRINT);
+        case 'r':
+            if(scanner->current - scanner->start > 2 && scanner->start[1] == 'e') {
+                switch(scanner->start[2]){
+                    case 's': return checkKeyword(scanner, 3,3,"ume", TOKEN_RESUME);
+                    case 't': return checkKeyword(scanner, 3,3,"urn", TOKEN_RETURN);
+                }
+            }
+            break;
+        case 's': return checkKeyword(scanner, 1,4,"uper", TOKEN_SUPER);
+        case 'v': return checkKeyword(scanner, 1, 2, "ar", TOKEN_VAR);
+        case 'w': return checkKeyword(scanner, 1, 4, "hile", TOKEN_WHILE);
+        case 'y': return checkKeyword(scanner, 1, 4, "ield", TOKEN_YIELD);
         case 'f': 
-            if(scanner.current - scanner.start > 1) {
-                switch(scanner.start[1]){
-                    case 'a': return checkKeyword(2, 3, "lse", TOKEN_FALSE);
-                    case 'o': return checkKeyword(2,1,"r",TOKEN_FOR);
-                    case 'u': return checkKeyword(2,1,"n", TOKEN_FUN);
+            if(scanner->current - scanner->start > 1) {
+                switch(scanner->start[1]){
+                    case 'a': return checkKeyword(scanner, 2, 3, "lse", TOKEN_FALSE);
+                    case 'o': return checkKeyword(scanner, 2,1,"r",TOKEN_FOR);
+                    case 'u': return checkKeyword(scanner, 2,1,"n", TOKEN_FUN);
                 }
             }
             break;
         case 't':
-            if(scanner.current - scanner.start > 1) {
-                switch(scanner.start[1]){
-                    case 'h': return checkKeyword(2,2,"is", TOKEN_THIS);
-                    case 'r': return checkKeyword(2,2,"ue", TOKEN_TRUE);
+            if(scanner->current - scanner->start > 1) {
+                switch(scanner->start[1]){
+                    case 'h': return checkKeyword(scanner, 2,2,"is", TOKEN_THIS);
+                    case 'r': return checkKeyword(scanner, 2,2,"ue", TOKEN_TRUE);
                 }
             }
     }
     return TOKEN_IDENTIFIER;
 }
-static Token identifier(){
-    while(isAlpha(peek()) || isDigit(peek())) advance();
-    return makeToken(identifierType());
+static Token identifier(Scanner* scanner){
+    while(isAlpha(peek(scanner)) || isDigit(peek(scanner))) advance(scanner);
+    return makeToken(scanner, identifierType(scanner));
 }
-Token scanToken(){
-    skipWhitespace();
-    scanner.start = scanner.current;
-    if(isAtEnd()) return makeToken(TOKEN_EOF);
+Token scanToken(Scanner* scanner){
+    skipWhitespace(scanner);
+    scanner->start = scanner->current;
+    if(isAtEnd(scanner)) return makeToken(scanner, TOKEN_EOF);
 
-    char c = advance();
-    if(isDigit(c)) return number();
-    if(isAlpha(c)) return identifier();
+    char c = advance(scanner);
+    if(isDigit(c)) return number(scanner);
+    if(isAlpha(c)) return identifier(scanner);
     switch(c) {
-        case '(': return makeToken(TOKEN_LEFT_PAREN);
-        case ')': return makeToken(TOKEN_RIGHT_PAREN);
-        case '{': return makeToken(TOKEN_LEFT_BRACE);
-        case '}': return makeToken(TOKEN_RIGHT_BRACE);
-        case ';': return makeToken(TOKEN_SEMICOLON);
-        case ',': return makeToken(TOKEN_COMMA);
-        case '.': return makeToken(TOKEN_DOT);
-        case '-': return makeToken(TOKEN_MINUS);
+        case '(': return makeToken(scanner, TOKEN_LEFT_PAREN);
+        case ')': return makeToken(scanner, TOKEN_RIGHT_PAREN);
+        case '{': return makeToken(scanner, TOKEN_LEFT_BRACE);
+        case '}': return makeToken(scanner, TOKEN_RIGHT_BRACE);
+        case ';': return makeToken(scanner, TOKEN_SEMICOLON);
+        case ',': return makeToken(scanner, TOKEN_COMMA);
+        case '.': return makeToken(scanner, TOKEN_DOT);
+        case '-': return makeToken(scanner, TOKEN_MINUS);
         case '+': 
-            return makeToken(match('+') ? TOKEN_PLUS_PLUS : TOKEN_PLUS);
-        case '/': return makeToken(TOKEN_SLASH);
-        case '*': return makeToken(TOKEN_STAR);
+            return makeToken(scanner, match(scanner, '+') ? TOKEN_PLUS_PLUS : TOKEN_PLUS);
+        case '/': return makeToken(scanner, TOKEN_SLASH);
+        case '*': return makeToken(scanner, TOKEN_STAR);
         case '!':
-            return makeToken(match('=') ? TOKEN_BANG_EQUAL: TOKEN_BANG);
+            return makeToken(scanner, match(scanner, '=') ? TOKEN_BANG_EQUAL: TOKEN_BANG);
         case '=':
-            return makeToken(match('=') ? TOKEN_EQUAL_EQUAL : TOKEN_EQUAL );
+            return makeToken(scanner, match(scanner, '=') ? TOKEN_EQUAL_EQUAL : TOKEN_EQUAL );
         case '<':
-            return makeToken(match('=') ? TOKEN_LESS_EQUAL: TOKEN_LESS);
+            return makeToken(scanner, match(scanner, '=') ? TOKEN_LESS_EQUAL: TOKEN_LESS);
         case '>':
-            return makeToken(match('=') ? TOKEN_GREATER_EQUAL: TOKEN_GREATER);
+            return makeToken(scanner, match(scanner, '=') ? TOKEN_GREATER_EQUAL: TOKEN_GREATER);
         case '"':
-            return string();
+            return string(scanner);
         
     }
-    return errorToken("Unexpected character.");
+    return errorToken(scanner, "Unexpected character.");
 }
\ No newline at end of file
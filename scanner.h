@@ -26,6 +26,7 @@ typedef enum {
     TOKEN_FOR, TOKEN_FUN, TOKEN_IF, TOKEN_NIL, TOKEN_OR,
     TOKEN_PRINT, TOKEN_RETURN, TOKEN_SUPER, TOKEN_THIS,
     TOKEN_TRUE, TOKEN_VAR, TOKEN_WHILE,
+    TOKEN_YIELD, TOKEN_RESUME,
 
     TOKEN_ERROR,
     TOKEN_EOF
@@ -39,7 +40,7 @@ typedef struct {
 }Token;
 
 
-void initScanner(const char* source);
-Token scanToken();
+void initScanner(Scanner* scanner, const char* source);
+Token scanToken(Scanner* scanner);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,554 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "snapshot.h"
+#include "memory.h"
+#include "object.h"
+#include "vm.h"
+
+//A snapshot is the whole heap after some script has run: every object
+//in vm.objects, plus vm.globals. The layout is a header followed by
+//object records, values, line tables, bytecode and chars. Objects refer
+//to each other by their index in the object section. Upvalues are
+//always written closed, over the value their variable has now
+#define SNAPSHOT_MAGIC "LOXS"
+#define SNAPSHOT_NONE UINT32_MAX
+
+typedef struct {
+    char magic[4];
+    uint32_t version;
+    uint32_t size;
+    uint32_t objectCount;
+    uint32_t valueCount; // every constant table, closures' upvalues and upvalues' values, then the globals as key/value pairs
+    uint32_t globalCount;
+    uint32_t lineCount;
+    uint32_t codeCount;
+    uint32_t charCount;
+    uint32_t padding;
+} SnapshotHeader;
+
+typedef struct {
+    uint32_t type;
+    uint32_t padding; // keeps records, and the values after them, 8 byte aligned
+    union {
+        //Strings, and natives by their registered name
+        struct {
+            uint32_t start;
+            uint32_t length;
+        } chars;
+        struct {
+            uint32_t name;
+            uint32_t arity;
+            uint32_t upvalueCount;
+            uint32_t padding; // maxStack and callSites are worked out again from the code
+            uint32_t constantStart;
+            uint32_t constantCount;
+            uint32_t lineStart;
+            uint32_t lineCount;
+            uint32_t codeStart;
+            uint32_t codeCount;
+        } function;
+        struct {
+            uint32_t function;
+            uint32_t upvalueStart; // the function's upvalueCount values, each an upvalue object
+        } closure;
+        struct {
+            uint32_t value;
+        } upvalue;
+    } as;
+} SnapshotObject;
+
+typedef enum {
+    SNAPSHOT_NIL,
+    SNAPSHOT_BOOL,
+    SNAPSHOT_NUMBER,
+    SNAPSHOT_INT,
+    SNAPSHOT_OBJECT,
+} SnapshotValueType;
+
+typedef struct {
+    uint32_t type;
+    uint32_t index; // object index, or the bool
+    union {
+        double number;
+        int64_t integer;
+    };
+} SnapshotValue;
+
+typedef struct {
+    size_t objects;
+    size_t values;
+    size_t lines;
+    size_t code;
+    size_t chars;
+    size_t end;
+} SnapshotLayout;
+
+static SnapshotLayout layoutFor(SnapshotHeader* header){
+    SnapshotLayout layout;
+    layout.objects = sizeof(SnapshotHeader);
+    layout.values = layout.objects + sizeof(SnapshotObject) * (size_t)header->objectCount;
+    layout.lines = layout.values + sizeof(SnapshotValue) * (size_t)header->valueCount;
+    layout.code = layout.lines + sizeof(LineStart) * (size_t)header->lineCount;
+    layout.chars = layout.code + header->codeCount;
+    layout.end = layout.chars + header->charCount;
+    return layout;
+}
+
+typedef struct {
+    Obj* object;
+    uint32_t index;
+} ObjectIndex;
+
+static int compareObjects(const void* a, const void* b){
+    Obj* left = ((const ObjectIndex*)a)->object;
+    Obj* right = ((const ObjectIndex*)b)->object;
+    return left < right ? -1 : left > right;
+}
+
+static uint32_t indexOf(ObjectIndex* index, uint32_t count, Obj* object){
+    ObjectIndex key = {object, 0};
+    ObjectIndex* found = bsearch(&key, index, count, sizeof(ObjectIndex), compareObjects);
+    return found == NULL ? SNAPSHOT_NONE : found->index;
+}
+
+static void encodeValue(ObjectIndex* index, uint32_t count, Value value, SnapshotValue* out){
+    out->index = 0;
+    out->number = 0;
+    if(IS_BOOL(value)) {
+        out->type = SNAPSHOT_BOOL;
+        out->index = AS_BOOL(value);
+    } else if(IS_NUMBER(value)) {
+        out->type = SNAPSHOT_NUMBER;
+        out->number = AS_NUM(value);
+    } else if(IS_INT(value)) {
+        out->type = SNAPSHOT_INT;
+        out->integer = AS_INT(value);
+    } else if(IS_OBJ(value)) {
+        out->type = SNAPSHOT_OBJECT;
+        out->index = indexOf(index, count, AS_OBJ(value));
+    } else {
+        out->type = SNAPSHOT_NIL;
+    }
+}
+
+bool writeSnapshot(VM* vm, const char* path){
+    SnapshotHeader header;
+    memset(&header, 0, sizeof(SnapshotHeader));
+    memcpy(header.magic, SNAPSHOT_MAGIC, 4);
+    header.version = SNAPSHOT_VERSION;
+
+    for(Obj* object = vm->objects; object != NULL; object = object->next){
+        header.objectCount++;
+    }
+    Obj** objects = ALLOCATE(Obj*, header.objectCount);
+    ObjectIndex* index = ALLOCATE(ObjectIndex, header.objectCount);
+    uint32_t count = 0;
+    uint32_t constantCount = 0;
+    for(Obj* object = vm->objects; object != NULL; object = object->next){
+        objects[count] = object;
+        index[count].object = object;
+        index[count].index = count;
+        count++;
+
+        switch(object->type){
+            case OBJ_STRING:
+                header.charCount += ((ObjString*)object)->length + 1;
+                break;
+            case OBJ_CHANNEL:
+            case OBJ_FIBER:
+                //Other processes can't reach the other end of a channel,
+                //and a fiber's stack may point anywhere
+                FREE_ARRAY(Obj*, objects, header.objectCount);
+                FREE_ARRAY(ObjectIndex, index, header.objectCount);
+                return false;
+            case OBJ_NATIVE: {
+                const char* name = nativeName(((ObjNative*)object)->entry);
+                if(name == NULL) {
+                    FREE_ARRAY(Obj*, objects, header.objectCount);
+                    FREE_ARRAY(ObjectIndex, index, header.objectCount);
+                    return false;
+                }
+                header.charCount += (uint32_t)strlen(name) + 1;
+                break;
+            }
+            case OBJ_FUNCTION: {
+                Chunk* chunk = &((ObjFunction*)object)->chunk;
+                constantCount += chunk->constants.count;
+                header.lineCount += chunk->lineCount;
+                header.codeCount += chunk->count;
+                break;
+            }
+            case OBJ_CLOSURE:
+                header.valueCount += ((ObjClosure*)object)->upvalueCount;
+                break;
+            case OBJ_UPVALUE:
+                header.valueCount++;
+                break;
+            default:
+                break;
+        }
+    }
+    qsort(index, count, sizeof(ObjectIndex), compareObjects);
+
+    for(int i = 0; i < vm->globals.capacity; i++){
+        if(vm->globals.entries[i].key != NULL) header.globalCount++;
+    }
+    header.valueCount += constantCount + header.globalCount * 2;
+
+    SnapshotLayout layout = layoutFor(&header);
+    header.size = (uint32_t)layout.end;
+    uint8_t* buffer = ALLOCATE(uint8_t, layout.end);
+    memset(buffer, 0, layout.end);
+    memcpy(buffer, &header, sizeof(SnapshotHeader));
+
+    SnapshotObject* records = (SnapshotObject*)(buffer + layout.objects);
+    SnapshotValue* values = (SnapshotValue*)(buffer + layout.values);
+    uint32_t valueStart = 0, lineStart = 0, codeStart = 0, charStart = 0;
+    uint32_t captureStart = constantCount;
+    for(uint32_t i = 0; i < count; i++){
+        Obj* object = objects[i];
+        SnapshotObject* record = &records[i];
+        record->type = object->type;
+        switch(object->type){
+            case OBJ_STRING: {
+                ObjString* string = (ObjString*)object;
+                record->as.chars.start = charStart;
+                record->as.chars.length = string->length;
+                memcpy(buffer + layout.chars + charStart, string->chars, string->length + 1);
+                charStart += string->length + 1;
+                break;
+            }
+            case OBJ_NATIVE: {
+                //Checked again rather than trusting the first pass
+                const char* name = nativeName(((ObjNative*)object)->entry);
+                if(name == NULL) {
+                    FREE_ARRAY(uint8_t, buffer, layout.end);
+                    FREE_ARRAY(Obj*, objects, header.objectCount);
+                    FREE_ARRAY(ObjectIndex, index, header.objectCount);
+                    return false;
+                }
+                uint32_t length = (uint32_t)strlen(name);
+                record->as.chars.start = charStart;
+                record->as.chars.length = length;
+                memcpy(buffer + layout.chars + charStart, name, length + 1);
+                charStart += length + 1;
+                break;
+            }
+            case OBJ_FUNCTION: {
+                ObjFunction* function = (ObjFunction*)object;
+                Chunk* chunk = &function->chunk;
+                record->as.function.name = function->name == NULL ? SNAPSHOT_NONE :
+                    indexOf(index, count, (Obj*)function->name);
+                record->as.function.arity = function->arity;
+                record->as.function.upvalueCount = function->upvalueCount;
+                record->as.function.constantStart = valueStart;
+                record->as.function.constantCount = chunk->constants.count;
+                record->as.function.lineStart = lineStart;
+                record->as.function.lineCount = chunk->lineCount;
+                record->as.function.codeStart = codeStart;
+                record->as.function.codeCount = chunk->count;
+
+                for(int j = 0; j < chunk->constants.count; j++){
+                    encodeValue(index, count, chunk->constants.values[j], &values[valueStart + j]);
+                }
+                if(chunk->lineCount > 0){
+                    memcpy((LineStart*)(buffer + layout.lines) + lineStart, chunk->lines, sizeof(LineStart) * chunk->lineCount);
+                }
+                copyGenericCode(chunk, buffer + layout.code + codeStart);
+                valueStart += chunk->constants.count;
+                lineStart += chunk->lineCount;
+                codeStart += chunk->count;
+                break;
+            }
+            case OBJ_CLOSURE: {
+                ObjClosure* closure = (ObjClosure*)object;
+                record->as.closure.function = indexOf(index, count, (Obj*)closure->function);
+                record->as.closure.upvalueStart = captureStart;
+                for(int j = 0; j < closure->upvalueCount; j++){
+                    encodeValue(index, count, OBJ_VAL(closure->upvalues[j]), &values[captureStart++]);
+                }
+                break;
+            }
+            case OBJ_UPVALUE:
+                record->as.upvalue.value = captureStart;
+                encodeValue(index, count, *((ObjUpvalue*)object)->location, &values[captureStart++]);
+                break;
+            case OBJ_CHANNEL:
+            case OBJ_FIBER:
+                //Turned away by the first pass
+                break;
+        }
+    }
+    valueStart = captureStart;
+
+    for(int i = 0; i < vm->globals.capacity; i++){
+        Entry* entry = &vm->globals.entries[i];
+        if(entry->key == NULL) continue;
+        encodeValue(index, count, OBJ_VAL(entry->key), &values[valueStart++]);
+        encodeValue(index, count, entry->value, &values[valueStart++]);
+    }
+
+    size_t tempLength = strlen(path) + 5;
+    char* tempPath = ALLOCATE(char, tempLength);
+    snprintf(tempPath, tempLength, "%s.tmp", path);
+    FILE* file = fopen(tempPath, "wb");
+    bool success = file != NULL;
+    if(file != NULL){
+        success = fwrite(buffer, 1, layout.end, file) == layout.end;
+        success = fclose(file) == 0 && success;
+    }
+    if(success) success = rename(tempPath, path) == 0;
+    if(!success) remove(tempPath);
+
+    FREE_ARRAY(char, tempPath, tempLength);
+    FREE_ARRAY(uint8_t, buffer, layout.end);
+    FREE_ARRAY(Obj*, objects, header.objectCount);
+    FREE_ARRAY(ObjectIndex, index, header.objectCount);
+    return success;
+}
+
+static bool validValue(SnapshotHeader* header, SnapshotValue* value){
+    switch(value->type){
+        case SNAPSHOT_NIL:
+        case SNAPSHOT_BOOL:
+        case SNAPSHOT_NUMBER:
+            return true;
+        case SNAPSHOT_INT:
+            return value->integer >= INT_VAL_MIN && value->integer <= INT_VAL_MAX;
+        case SNAPSHOT_OBJECT:
+            return value->index < header->objectCount;
+        default:
+            return false;
+    }
+}
+
+//Checks every range, index and native name up front so that building
+//the heap can't go wrong. The bytecode is checked by verifyChunk once
+//the constants it refers to exist
+static bool validateSnapshot(uint8_t* base, size_t size){
+    if(size < sizeof(SnapshotHeader)) return false;
+    SnapshotHeader* header = (SnapshotHeader*)base;
+    if(memcmp(header->magic, SNAPSHOT_MAGIC, 4) != 0) return false;
+    if(header->version != SNAPSHOT_VERSION || header->size != size) return false;
+    SnapshotLayout layout = layoutFor(header);
+    if(layout.end != size) return false;
+    if((uint64_t)header->globalCount * 2 > header->valueCount) return false;
+
+    SnapshotObject* records = (SnapshotObject*)(base + layout.objects);
+    SnapshotValue* values = (SnapshotValue*)(base + layout.values);
+    for(uint32_t i = 0; i < header->objectCount; i++){
+        SnapshotObject* record = &records[i];
+        switch(record->type){
+            case OBJ_STRING:
+            case OBJ_NATIVE:
+                if((uint64_t)record->as.chars.start + record->as.chars.length >= header->charCount) return false;
+                if(record->type == OBJ_NATIVE &&
+                   findNative((char*)base + layout.chars + record->as.chars.start, record->as.chars.length) == NULL) {
+                    return false;
+                }
+                break;
+            case OBJ_FUNCTION: {
+                uint32_t name = record->as.function.name;
+                if(name != SNAPSHOT_NONE && (name >= header->objectCount || records[name].type != OBJ_STRING)) return false;
+                if((uint64_t)record->as.function.constantStart + record->as.function.constantCount > header->valueCount) return false;
+                if((uint64_t)record->as.function.lineStart + record->as.function.lineCount > header->lineCount) return false;
+                if((uint64_t)record->as.function.codeStart + record->as.function.codeCount > header->codeCount) return false;
+                if(record->as.function.arity > 255 || record->as.function.upvalueCount > UINT8_COUNT) return false;
+                break;
+            }
+            case OBJ_CLOSURE: {
+                uint32_t function = record->as.closure.function;
+                if(function >= header->objectCount || records[function].type != OBJ_FUNCTION) return false;
+                uint32_t upvalueCount = records[function].as.function.upvalueCount;
+                if((uint64_t)record->as.closure.upvalueStart + upvalueCount > header->valueCount) return false;
+                for(uint32_t j = 0; j < upvalueCount; j++){
+                    SnapshotValue* upvalue = &values[record->as.closure.upvalueStart + j];
+                    if(upvalue->type != SNAPSHOT_OBJECT || upvalue->index >= header->objectCount ||
+                       records[upvalue->index].type != OBJ_UPVALUE) {
+                        return false;
+                    }
+                }
+                break;
+            }
+            case OBJ_UPVALUE:
+                if(record->as.upvalue.value >= header->valueCount) return false;
+                break;
+            default:
+                return false;
+        }
+    }
+
+    for(uint32_t i = 0; i < header->valueCount; i++){
+        if(!validValue(header, &values[i])) return false;
+    }
+    SnapshotValue* globals = values + header->valueCount - header->globalCount * 2;
+    for(uint32_t i = 0; i < header->globalCount; i++){
+        SnapshotValue* key = &globals[i * 2];
+        if(key->type != SNAPSHOT_OBJECT || records[key->index].type != OBJ_STRING) return false;
+    }
+    return true;
+}
+
+static Value decodeValue(Obj** objects, SnapshotValue* value){
+    switch(value->type){
+        case SNAPSHOT_BOOL: return BOOL_VAL(value->index != 0);
+        case SNAPSHOT_NUMBER: return NUMBER_VAL(value->number);
+        case SNAPSHOT_INT: return INT_VAL(value->integer);
+        case SNAPSHOT_OBJECT: return OBJ_VAL(objects[value->index]);
+        default: return NIL_VAL;
+    }
+}
+
+//Replaces initVM. Natives come back by name instead of being
+//registered again, and every global the snapshotted script
+//defined is there before the first instruction runs
+bool restoreSnapshot(VM* vm, const char* path){
+    int fd = open(path, O_RDONLY);
+    if(fd < 0) return false;
+    struct stat info;
+    if(fstat(fd, &info) != 0 || info.st_size == 0) {
+        close(fd);
+        return false;
+    }
+    size_t size = (size_t)info.st_size;
+    //Writable but private, quickening dirties pages in memory and never the file
+    uint8_t* base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(base == MAP_FAILED) return false;
+    if(!validateSnapshot(base, size)) {
+        munmap(base, size);
+        return false;
+    }
+
+    if(!initEmptyVM(vm)) {
+        freeVM(vm);
+        munmap(base, size);
+        return false;
+    }
+    SnapshotHeader* header = (SnapshotHeader*)base;
+    SnapshotLayout layout = layoutFor(header);
+    SnapshotObject* records = (SnapshotObject*)(base + layout.objects);
+    SnapshotValue* values = (SnapshotValue*)(base + layout.values);
+    char* chars = (char*)base + layout.chars;
+
+    //Closures need their function to exist first. Those and upvalues are
+    //the objects that can fail to allocate
+    Obj** objects = ALLOCATE(Obj*, header->objectCount);
+    bool allocated = true;
+    for(uint32_t i = 0; i < header->objectCount; i++){
+        SnapshotObject* record = &records[i];
+        switch(record->type){
+            case OBJ_STRING:
+                objects[i] = (Obj*)internString(&vm->objects, &vm->strings, chars + record->as.chars.start, record->as.chars.length);
+                break;
+            case OBJ_NATIVE:
+                objects[i] = (Obj*)newNative(vm, findNative(chars + record->as.chars.start, record->as.chars.length));
+                break;
+            case OBJ_FUNCTION: {
+                ObjFunction* function = newFunction(&vm->objects);
+                function->arity = record->as.function.arity;
+                function->upvalueCount = record->as.function.upvalueCount;
+                Chunk* chunk = &function->chunk;
+                chunk->code = base + layout.code + record->as.function.codeStart;
+                chunk->count = chunk->capacity = record->as.function.codeCount;
+                chunk->lines = (LineStart*)(base + layout.lines) + record->as.function.lineStart;
+                chunk->lineCount = chunk->lineCapacity = record->as.function.lineCount;
+                chunk->packed = true;
+                objects[i] = (Obj*)function;
+                break;
+            }
+            case OBJ_UPVALUE:
+                objects[i] = (Obj*)newUpvalue(vm, NULL);
+                allocated = allocated && objects[i] != NULL;
+                break;
+            default:
+                objects[i] = NULL;
+                break;
+        }
+    }
+
+    for(uint32_t i = 0; i < header->objectCount; i++){
+        SnapshotObject* record = &records[i];
+        if(record->type == OBJ_CLOSURE) {
+            objects[i] = (Obj*)newClosure(vm, (ObjFunction*)objects[record->as.closure.function]);
+            allocated = allocated && objects[i] != NULL;
+        } else if(record->type == OBJ_FUNCTION) {
+            ObjFunction* function = (ObjFunction*)objects[i];
+            uint32_t name = record->as.function.name;
+            function->name = name == SNAPSHOT_NONE ? NULL : (ObjString*)objects[name];
+        }
+    }
+
+    //Like the bytecode cache, code and lines stay in the mapping and
+    //the constant tables are the only thing rebuilt
+    uint32_t constantCount = 0;
+    for(uint32_t i = 0; i < header->objectCount; i++){
+        SnapshotObject* record = &records[i];
+        if(record->type != OBJ_FUNCTION) continue;
+        uint32_t end = record->as.function.constantStart + record->as.function.constantCount;
+        if(end > constantCount) constantCount = end;
+    }
+    CodeArena* arena = allocated ? allocateCodeArena(sizeof(CodeArena) + sizeof(Value) * constantCount) : NULL;
+    if(arena == NULL) {
+        FREE_ARRAY(Obj*, objects, header->objectCount);
+        freeVM(vm);
+        munmap(base, size);
+        return false;
+    }
+    arena->mapping = base;
+    arena->mappingSize = size;
+    Value* constants = (Value*)((char*)arena + sizeof(CodeArena));
+    //Upvalues can hold closures and closures upvalues, so both are filled
+    //in once every object exists
+    for(uint32_t i = 0; i < header->objectCount; i++){
+        SnapshotObject* record = &records[i];
+        if(record->type == OBJ_CLOSURE) {
+            ObjClosure* closure = (ObjClosure*)objects[i];
+            for(int j = 0; j < closure->upvalueCount; j++){
+                closure->upvalues[j] = (ObjUpvalue*)objects[values[record->as.closure.upvalueStart + j].index];
+            }
+        } else if(record->type == OBJ_UPVALUE) {
+            ((ObjUpvalue*)objects[i])->closed = decodeValue(objects, &values[record->as.upvalue.value]);
+        }
+    }
+    for(uint32_t i = 0; i < header->objectCount; i++){
+        SnapshotObject* record = &records[i];
+        if(record->type != OBJ_FUNCTION) continue;
+        ValueArray* array = &((ObjFunction*)objects[i])->chunk.constants;
+        array->values = constants + record->as.function.constantStart;
+        array->count = array->capacity = record->as.function.constantCount;
+        for(uint32_t j = 0; j < record->as.function.constantCount; j++){
+            array->values[j] = decodeValue(objects, &values[record->as.function.constantStart + j]);
+        }
+    }
+
+    //Also sets maxStack and callSites, which the file isn't trusted with
+    for(uint32_t i = 0; i < header->objectCount; i++){
+        if(records[i].type != OBJ_FUNCTION) continue;
+        ObjFunction* function = (ObjFunction*)objects[i];
+        function->maxStack = verifyChunk(&function->chunk, function->arity, function->upvalueCount);
+        if(function->maxStack < 0) {
+            FREE_ARRAY(Obj*, objects, header->objectCount);
+            freeVM(vm);
+            munmap(arena, arena->size);
+            munmap(base, size);
+            return false;
+        }
+    }
+    adoptCodeArena(vm, arena);
+    sealCodeArena(arena);
+
+    SnapshotValue* globals = values + header->valueCount - header->globalCount * 2;
+    for(uint32_t i = 0; i < header->globalCount; i++){
+        tableSet(&vm->globals, (ObjString*)objects[globals[i * 2].index],
+                 decodeValue(objects, &globals[i * 2 + 1]));
+    }
+
+    FREE_ARRAY(Obj*, objects, header->objectCount);
+    return true;
+}
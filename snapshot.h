@@ -0,0 +1,13 @@
+#ifndef cInterp_snapshot_h
+#define cInterp_snapshot_h
+
+#include "common.h"
+#include "object.h"
+
+//Bump whenever the object layout, bytecode or file layout changes
+#define SNAPSHOT_VERSION 7
+
+bool writeSnapshot(VM* vm, const char* path);
+bool restoreSnapshot(VM* vm, const char* path);
+
+#endif
@@ -129,6 +129,13 @@ bool tableGet(Table* table, ObjString* key, Value* value) {
     return true;
 }
 
+//Where the key lives, or NULL. Only good until the table is next changed
+Entry* tableGetEntry(Table* table, ObjString* key) {
+    if(table->count == 0) return NULL;
+    Entry* entry = findEntry(table->entries, table->capacity, key);
+    return entry->key == NULL ? NULL : entry;
+}
+
 bool tableDelete(Table* table, ObjString* key){
     if(table->count == 0 )return false;
 
@@ -1,6 +1,8 @@
+#include <inttypes.h>
 #include <stdio.h>
 #include <string.h>
 #include "memory.h"
+#include "arena.h"
 #include "value.h"
 #include "object.h"
 
@@ -8,13 +10,14 @@ void initValueArray(ValueArray* array){
     array->values = NULL;
     array->capacity = 0;
     array->count = 0;
+    array->arena = NULL;
 }
 
 void writeValueArray(ValueArray* array, Value value){
     if(array->capacity < array->count+1){
         int oldCapacity = array->capacity;
         array->capacity = GROW_CAPACITY(oldCapacity);
-        array->values = GROW_ARRAY(Value, array->values, oldCapacity, array->capacity);
+        array->values = GROW_ARRAY_IN(array->arena, Value, array->values, oldCapacity, array->capacity);
         
     }
 
@@ -23,7 +26,7 @@ void writeValueArray(ValueArray* array, Value value){
 }
 
 void freeValueArray(ValueArray* array){
-    FREE_ARRAY(Value, array->values, array->count);
+    FREE_ARRAY(Value, array->values, array->capacity);
     initValueArray(array);
 }
 
@@ -47,24 +50,57 @@ void printObject(Value value){
         case OBJ_CLOSURE:
             printFunction(AS_CLOSURE(value)->function);
             break;
+        case OBJ_CHANNEL:
+            printf("<channel>");
+            break;
+        case OBJ_FIBER:
+            printf("<fiber>");
+            break;
+        case OBJ_UPVALUE:
+            printf("upvalue");
+            break;
     }
 }
 
 void printValue(Value value){
+#ifdef NAN_BOXING
+    if(IS_BOOL(value)) {
+        printf(AS_BOOL(value) ? "true" : "false");
+    } else if(IS_NIL(value)) {
+        printf("nil");
+    } else if(IS_NUMBER(value)) {
+        printf("%g",AS_NUM(value));
+    } else if(IS_INT(value)) {
+        printf("%" PRId64, AS_INT(value));
+    } else if(IS_OBJ(value)) {
+        printObject(value);
+    }
+#else
     switch(value.type){
         case VAL_BOOL: printf(AS_BOOL(value) ? "true" : "false");break;
         case VAL_NIL: printf("nil"); break;
         case VAL_NUMBER: printf("%g",AS_NUM(value)); break;
+        case VAL_INT: printf("%" PRId64, AS_INT(value)); break;
         case VAL_OBJ: printObject(value);
     }
+#endif
 }
 
 bool valuesEqual(Value a, Value b){
+    //An integer equals the double with the same value
+    if(IS_INT(a) != IS_INT(b) && IS_NUMERIC(a) && IS_NUMERIC(b)) return AS_DOUBLE(a) == AS_DOUBLE(b);
+#ifdef NAN_BOXING
+    //Compared as doubles so NaN still isn't equal to itself
+    if(IS_NUMBER(a) && IS_NUMBER(b)) return AS_NUM(a) == AS_NUM(b);
+    return a == b;
+#else
     if(a.type != b.type) return false;
     switch (a.type){
         case VAL_BOOL: return AS_BOOL(a) == AS_BOOL(b);
         case VAL_NIL: return true;
         case VAL_NUMBER: return AS_NUM(a) == AS_NUM(b);
+        case VAL_INT: return AS_INT(a) == AS_INT(b);
         case VAL_OBJ: return AS_OBJ(a) == AS_OBJ(b);
     }
+#endif
 }
\ No newline at end of file
@@ -1,52 +1,194 @@
 #ifndef cInterp_value_h
 #define cInterp_value_h
+#include <string.h>
 #include "common.h"
+#include "arena.h"
 
 
 typedef struct sObj Obj;
 typedef struct sObjString ObjString;
 
 
+#ifdef NAN_BOXING
+
+//Any double that isn't a quiet NaN is stored as itself. The rest of the
+//quiet NaN space holds everything else: the sign bit marks an Obj*
+//in the low 48 bits, INT_BIT a 49 bit integer below it, small tags in
+//the low bits mark nil and booleans
+#define SIGN_BIT ((uint64_t)0x8000000000000000)
+#define QNAN ((uint64_t)0x7ffc000000000000)
+#define INT_BIT ((uint64_t)0x0002000000000000)
+#define INT_PAYLOAD (INT_BIT - 1)
+
+#define TAG_NIL 1
+#define TAG_FALSE 2
+#define TAG_TRUE 3
+
+//Integers are exact in this range, arithmetic that leaves it gives a
+//double instead
+#define INT_VAL_MAX (((int64_t)1 << 48) - 1)
+#define INT_VAL_MIN (-((int64_t)1 << 48))
+
+typedef uint64_t Value;
+
+#else
+
 typedef enum {
     VAL_BOOL,
     VAL_NIL,
     VAL_NUMBER,
+    VAL_INT,
     VAL_OBJ
 } ValueType;
 
+#define INT_VAL_MAX INT64_MAX
+#define INT_VAL_MIN INT64_MIN
+
 //Unions allow you to store in the same memory location
 typedef struct {
     ValueType type;
     union {
         bool boolean;
         double number;
+        int64_t integer;
         Obj* obj;
     } as;
 } Value;
 
+#endif
+
 typedef struct {
     int capacity;
     int count;
     Value* values;
+    Arena* arena; // NULL when the array grows on the heap
 } ValueArray;
+#ifdef NAN_BOXING
+
+//memcpy rather than a pointer cast keeps this clear of strict aliasing,
+//and compiles down to a plain register move
+static inline double valueToNum(Value value) {
+    double number;
+    memcpy(&number, &value, sizeof(Value));
+    return number;
+}
+
+static inline Value numToValue(double number) {
+    Value value;
+    memcpy(&value, &number, sizeof(double));
+    return value;
+}
+
+#define FALSE_VAL ((Value)(uint64_t)(QNAN | TAG_FALSE))
+#define TRUE_VAL ((Value)(uint64_t)(QNAN | TAG_TRUE))
+
+#define BOOL_VAL(value) ((value) ? TRUE_VAL : FALSE_VAL)
+#define NIL_VAL ((Value)(uint64_t)(QNAN | TAG_NIL))
+#define NUMBER_VAL(value) numToValue(value)
+#define INT_VAL(value) ((Value)(QNAN | INT_BIT | ((uint64_t)(int64_t)(value) & INT_PAYLOAD)))
+#define OBJ_VAL(object) (Value)(SIGN_BIT | QNAN | (uint64_t)(uintptr_t)(object))
+
+#define AS_BOOL(value) ((value) == TRUE_VAL)
+#define AS_NUM(value) valueToNum(value)
+//Shifting the payload up to the sign bit and back sign extends it
+#define AS_INT(value) ((int64_t)((value) << 15) >> 15)
+#define AS_OBJ(value) ((Obj*)(uintptr_t)((value) & ~(SIGN_BIT | QNAN)))
+
+//false and true only differ in the low bit
+#define IS_BOOL(value) (((value) | 1) == TRUE_VAL)
+#define IS_NIL(value) ((value) == NIL_VAL)
+#define IS_NUMBER(value) (((value) & QNAN) != QNAN)
+#define IS_INT(value) (((value) & (SIGN_BIT | QNAN | INT_BIT)) == (QNAN | INT_BIT))
+#define IS_OBJ(value) (((value) & (QNAN | SIGN_BIT)) == (QNAN | SIGN_BIT))
+
+#else
+
 //takes a value of C type and produces a Value with 
 //the correct type tag and underlying value
 #define BOOL_VAL(value) ((Value){VAL_BOOL, {.boolean = value}})
 #define NIL_VAL ((Value){VAL_NIL, {.number = 0}})
 #define NUMBER_VAL(value) ((Value) {VAL_NUMBER, {.number = value}})
+#define INT_VAL(value) ((Value) {VAL_INT, {.integer = value}})
 #define OBJ_VAL(object) ((Value) {VAL_OBJ,  {.obj = (Obj*)object}})
 
 //unpack and give the C value
 #define AS_BOOL(value) ((value).as.boolean)
 #define AS_NUM(value) ((value).as.number)
+#define AS_INT(value) ((value).as.integer)
 #define AS_OBJ(value) ((value).as.obj)
 
 //Used to safeguard the AS_ macros so types do not get mixed up
 #define IS_BOOL(value) ((value).type == VAL_BOOL)
 #define IS_NIL(value) ((value).type == VAL_NIL)
 #define IS_NUMBER(value) ((value).type == VAL_NUMBER)
+#define IS_INT(value) ((value).type == VAL_INT)
 #define IS_OBJ(value) ((value).type == VAL_OBJ)
 
+#endif
+
+//IS_NUMBER is only the doubles, anything taking a number of either kind
+//checks IS_NUMERIC and reads it with AS_DOUBLE or as an integer
+#define IS_NUMERIC(value) (IS_NUMBER(value) || IS_INT(value))
+#define AS_DOUBLE(value) (IS_INT(value) ? (double)AS_INT(value) : AS_NUM(value))
+
+//Arithmetic on two numeric values, shared by the interpreter and compiled
+//code. Two integers give an integer unless the exact result doesn't fit,
+//anything else is done in doubles. Division always gives a double
+static inline Value intResult(int64_t result, bool overflow, double inexact){
+    if(overflow || result < INT_VAL_MIN || result > INT_VAL_MAX) return NUMBER_VAL(inexact);
+    return INT_VAL(result);
+}
+
+static inline Value addValues(Value a, Value b){
+    if(IS_INT(a) && IS_INT(b)) {
+        int64_t result;
+        bool overflow = __builtin_add_overflow(AS_INT(a), AS_INT(b), &result);
+        return intResult(result, overflow, (double)AS_INT(a) + (double)AS_INT(b));
+    }
+    return NUMBER_VAL(AS_DOUBLE(a) + AS_DOUBLE(b));
+}
+
+static inline Value subtractValues(Value a, Value b){
+    if(IS_INT(a) && IS_INT(b)) {
+        int64_t result;
+        bool overflow = __builtin_sub_overflow(AS_INT(a), AS_INT(b), &result);
+        return intResult(result, overflow, (double)AS_INT(a) - (double)AS_INT(b));
+    }
+    return NUMBER_VAL(AS_DOUBLE(a) - AS_DOUBLE(b));
+}
+
+static inline Value multiplyValues(Value a, Value b){
+    if(IS_INT(a) && IS_INT(b)) {
+        int64_t result;
+        bool overflow = __builtin_mul_overflow(AS_INT(a), AS_INT(b), &result);
+        return intResult(result, overflow, (double)AS_INT(a) * (double)AS_INT(b));
+    }
+    return NUMBER_VAL(AS_DOUBLE(a) * AS_DOUBLE(b));
+}
+
+static inline Value divideValues(Value a, Value b){
+    return NUMBER_VAL(AS_DOUBLE(a) / AS_DOUBLE(b));
+}
+
+static inline Value negateValue(Value value){
+    if(IS_INT(value)) {
+        int64_t result;
+        bool overflow = __builtin_sub_overflow((int64_t)0, AS_INT(value), &result);
+        return intResult(result, overflow, -(double)AS_INT(value));
+    }
+    return NUMBER_VAL(-AS_NUM(value));
+}
+
+static inline Value greaterValues(Value a, Value b){
+    if(IS_INT(a) && IS_INT(b)) return BOOL_VAL(AS_INT(a) > AS_INT(b));
+    return BOOL_VAL(AS_DOUBLE(a) > AS_DOUBLE(b));
+}
+
+static inline Value lessValues(Value a, Value b){
+    if(IS_INT(a) && IS_INT(b)) return BOOL_VAL(AS_INT(a) < AS_INT(b));
+    return BOOL_VAL(AS_DOUBLE(a) < AS_DOUBLE(b));
+}
+
 
 void initValueArray(ValueArray* array);
 void writeValueArray(ValueArray* array, Value value);
@@ -7,358 +7,1245 @@
 #include "compiler.h"
 #include "object.h"
 #include "table.h"
+#include "jit.h"
+#include "worker.h"
+#include "io.h"
 #include <stdio.h>
 #include <stdarg.h>
 #include <string.h>
 #include <time.h>
 
+//Threaded dispatch needs GCC's labels as values. Tracing prints from
+//the top of the loop, so it keeps the plain switch
+#if defined(__GNUC__) && !defined(DEBUG_TRACE_EXECUTION) && !defined(NO_COMPUTED_GOTO)
+#define COMPUTED_GOTO
+#endif
 
-VM vm;
+static void saveStack(VM* vm, FiberStack* stack){
+    stack->frames = vm->frames;
+    stack->frameCount = vm->frameCount;
+    stack->framesMax = vm->framesMax;
+    stack->stack = vm->stack;
+    stack->stackTop = vm->stackTop;
+    stack->stackEnd = vm->stackEnd;
+    stack->openUpvalues = vm->openUpvalues;
+}
+
+static void loadStack(VM* vm, FiberStack* stack){
+    vm->frames = stack->frames;
+    vm->frameCount = stack->frameCount;
+    vm->framesMax = stack->framesMax;
+    vm->stack = stack->stack;
+    vm->stackTop = stack->stackTop;
+    vm->stackEnd = stack->stackEnd;
+    vm->openUpvalues = stack->openUpvalues;
+}
+
+static FiberStack* stackOf(VM* vm, ObjFiber* fiber){
+    return fiber == NULL ? &vm->rootStack : &fiber->stack;
+}
+
+//Runs on fiber's stack from here on, NULL being the VM's own. Only
+//pointers move, the values stay where they are
+static void switchFiber(VM* vm, ObjFiber* fiber){
+    traceAbort(vm);
+    saveStack(vm, stackOf(vm, vm->fiber));
+    vm->fiber = fiber;
+    loadStack(vm, stackOf(vm, fiber));
+}
 
-Obj* objects;
+//Shares the upvalue already open on local if a closure captured it
+//before. The list is kept sorted so the search stops at the first slot
+//below local
+static ObjUpvalue* captureUpvalue(VM* vm, Value* local){
+    ObjUpvalue* previous = NULL;
+    ObjUpvalue* upvalue = vm->openUpvalues;
+    while(upvalue != NULL && upvalue->location > local){
+        previous = upvalue;
+        upvalue = upvalue->next;
+    }
+    if(upvalue != NULL && upvalue->location == local) return upvalue;
 
-static void resetStack(){
-    vm.stackCount = 0;
+    ObjUpvalue* created = newUpvalue(vm, local);
+    if(created == NULL) return NULL;
+    created->next = upvalue;
+    if(previous == NULL) {
+        vm->openUpvalues = created;
+    } else {
+        previous->next = created;
+    }
+    return created;
 }
-static Value clockNative(int argCount, Value* args){
+
+//Moves every slot from last up off the stack and into its upvalue
+static void closeUpvalues(ObjUpvalue** open, Value* last){
+    while(*open != NULL && (*open)->location >= last){
+        ObjUpvalue* upvalue = *open;
+        upvalue->closed = *upvalue->location;
+        upvalue->location = &upvalue->closed;
+        *open = upvalue->next;
+    }
+}
+
+static void resetStack(VM* vm){
+    traceAbort(vm);
+    //An error ends every fiber between here and the VM's own stack. Their
+    //stacks go away, so closures that outlive them keep the values
+    if(vm->fiber != NULL) {
+        ObjFiber* fiber = vm->fiber;
+        saveStack(vm, &fiber->stack);
+        vm->fiber = NULL;
+        loadStack(vm, &vm->rootStack);
+        while(fiber != NULL){
+            ObjFiber* caller = fiber->caller;
+            fiber->state = FIBER_DONE;
+            fiber->caller = NULL;
+            closeUpvalues(&fiber->stack.openUpvalues, fiber->stack.stack);
+            freeFiberStack(fiber);
+            fiber = caller;
+        }
+    }
+    closeUpvalues(&vm->openUpvalues, vm->stack);
+    vm->waiting = false;
+    vm->stackTop = vm->stack;
+    vm->frameCount = 0;
+    vm->compiledDepth = 0;
+}
+static Value clockNative(void){
     return NUMBER_VAL((double)clock()/CLOCKS_PER_SEC);
 }
 
-static void runtimeError(const char* format, ...){
+static void printFrame(ObjFunction* function, int line){
+    fprintf(stderr, "[line %d] in ", line);
+    if(function->name == NULL){
+        fprintf(stderr, "script \n");
+    } else {
+        fprintf(stderr, "%s()\n", function->name->chars);
+    }
+}
+
+static void printFrames(CallFrame* frames, int frameCount){
+    for(int i = frameCount - 1; i >= 0; i--) {
+        CallFrame* frame = &frames[i];
+        ObjFunction* function = frame->closure->function;
+
+        //-1 cause IP is sitting on the next instruction to be executed
+        size_t instruction = frame->ip - frame->closure->function->chunk.code - 1;
+        printFrame(function, getLine(&function->chunk, (int)instruction));
+    }
+}
+
+//Inside a fiber the trace carries on through whoever resumed it
+static void printStackTrace(VM* vm){
+    printFrames(vm->frames, vm->frameCount);
+    for(ObjFiber* fiber = vm->fiber; fiber != NULL; fiber = fiber->caller){
+        FiberStack* stack = stackOf(vm, fiber->caller);
+        printFrames(stack->frames, stack->frameCount);
+    }
+}
+
+static void reportError(VM* vm, const char* format, va_list args){
+    vfprintf(stderr, format, args);
+    fputs("\n", stderr);
+
+    printStackTrace(vm);
+    resetStack(vm);
+}
+
+static void runtimeError(VM* vm, const char* format, ...){
+    va_list args;
+    va_start(args, format);
+    reportError(vm, format, args);
+    va_end(args);
+}
+
+//The native still on the stack is reported from its caller's line
+void nativeError(VM* vm, const char* format, ...){
+    va_list args;
+    va_start(args, format);
+    reportError(vm, format, args);
+    va_end(args);
+}
+
+//Compiled code has no CallFrame, so it passes its own line along.
+//Interpreted frames that called into it are still printed below it
+void compiledError(VM* vm, ObjFunction* function, int line, const char* format, ...){
     va_list args;
     va_start(args, format);
     vfprintf(stderr, format, args);
     va_end(args);
     fputs("\n", stderr);
 
-    // CallFrame* frame = &vm.frames[vm.frameCount - 1];
-    // size_t instruction = frame->ip - frame->function->chunk.code - 1;
-    // int line = getLine(&frame->function->chunk, instruction);
-    // fprintf(stderr, "[line %d] in script \n", line);
+    printFrame(function, line);
+    printStackTrace(vm);
+    resetStack(vm);
+}
 
-    for(int i = vm.frameCount - 1; i >= 0; i--) {
-        CallFrame* frame = &vm.frames[i];
-        ObjFunction* function = frame->closure->function;
+//An allocation the script asked for failed, on the heap limit or with
+//malloc out of memory. Compiled code passes its function and line, the
+//interpreter and natives NULL
+void memoryError(VM* vm, ObjFunction* function, int line){
+    bool exhausted = vm->outOfMemory;
+    vm->outOfMemory = false;
+    if(exhausted && function != NULL) {
+        compiledError(vm, function, line, "Out of memory.");
+    } else if(exhausted) {
+        runtimeError(vm, "Out of memory.");
+    } else if(function != NULL) {
+        compiledError(vm, function, line, "Out of memory, the heap is limited to %zu bytes.", vm->heapLimit);
+    } else {
+        runtimeError(vm, "Out of memory, the heap is limited to %zu bytes.", vm->heapLimit);
+    }
+}
 
-        //-1 cause IP is sitting on the next instruction to be executed
-        size_t instruction = frame->ip - frame->closure->function->chunk.code - 1;
-        fprintf(stderr, "[line %d] in", function->chunk.lines[instruction].line);
-        if(function->name == NULL){
-            fprintf(stderr, "script \n");
-        } else {
-            fprintf(stderr, "%s()\n", function->name->chars);
+static void defineNative(VM* vm, const NativeEntry* entry) {
+    push(vm, OBJ_VAL(internString(&vm->objects, &vm->strings, entry->name, (int)strlen(entry->name))));
+    push(vm, OBJ_VAL(newNative(vm, entry)));
+    tableSet(&vm->globals, AS_STRING(vm->stack[0]), vm->stack[1]);
+    pop(vm);
+    pop(vm);
+}
+
+//Entries are used in place, so the table has to outlive the VM. The
+//arity is checked here once, calls only compare it with argCount
+void defineNatives(VM* vm, const NativeEntry* entries, int count){
+    for(int i = 0; i < count; i++){
+        const NativeEntry* entry = &entries[i];
+        bool fast = entry->fast.arity0 != NULL;
+        if(entry->arity < -1 || entry->arity > UINT8_MAX ||
+           (fast && entry->arity > 2) || (fast && entry->arity < 0) ||
+           (!fast && entry->function == NULL)) {
+            fprintf(stderr, "Native '%s' has an invalid arity or no entry point.\n", entry->name);
+            continue;
         }
+        defineNative(vm, entry);
     }
-
-    resetStack();
 }
 
-static void defineNative(const char* name, NativeFn function) {
-    push(OBJ_VAL(copyString(name, (int)strlen(name))));
-    push(OBJ_VAL(newNative(function)));
-    tableSet(&vm.globals, AS_STRING(vm.stack[0]), vm.stack[1]);
-    pop();
-    pop();
+//fiber(fn) wraps a function taking at most one argument, which gets the
+//value of the first resume
+static bool fiberNative(VM* vm, int argCount, Value* args, Value* result){
+    (void)argCount;
+    if(!IS_CLOSURE(args[0]) || AS_CLOSURE(args[0])->function->arity > 1) {
+        nativeError(vm, "A fiber needs a function taking at most one argument.");
+        return false;
+    }
+    ObjFiber* fiber = newFiber(vm, AS_CLOSURE(args[0]));
+    if(fiber == NULL) {
+        memoryError(vm, NULL, 0);
+        return false;
+    }
+    *result = OBJ_VAL(fiber);
+    return true;
 }
 
-void initVM(){
-    vm.stackCapacity = 0;
-    vm.stackCount = 0;
-    vm.objects = NULL;
-    vm.frameCount = 0;
-    initTable(&vm.globals);
-    initTable(&vm.strings);
-    defineNative("clock", clockNative);
-    resetStack();
+//True once the fiber's function has returned
+static bool doneNative(VM* vm, int argCount, Value* args, Value* result){
+    (void)argCount;
+    if(!IS_FIBER(args[0])) {
+        nativeError(vm, "Expect a fiber.");
+        return false;
+    }
+    *result = BOOL_VAL(AS_FIBER(args[0])->state == FIBER_DONE);
+    return true;
 }
 
-void freeVM(){
-    freeTable(&vm.strings);
-    freeTable(&vm.globals);
-    freeObjects();
+//Every native the VM provides. Snapshots store natives by name
+//and look them up here again on restore
+static const NativeEntry natives[] = {
+    {"clock", 0, NULL, {.arity0 = clockNative}},
+    {"spawn", -1, spawnNative, {NULL}},
+    {"submit", -1, submitNative, {NULL}},
+    {"channel", -1, channelNative, {NULL}},
+    {"send", 2, sendNative, {NULL}},
+    {"trySend", 2, trySendNative, {NULL}},
+    {"receive", 1, receiveNative, {NULL}},
+    {"tryReceive", 1, tryReceiveNative, {NULL}},
+    {"close", 1, closeNative, {NULL}},
+    {"fiber", 1, fiberNative, {NULL}},
+    {"done", 1, doneNative, {NULL}},
+    {"async", -1, asyncNative, {NULL}},
+    {"sleep", 1, sleepNative, {NULL}},
+    {"listen", 1, listenNative, {NULL}},
+    {"localPort", 1, localPortNative, {NULL}},
+    {"accept", 1, acceptNative, {NULL}},
+    {"connect", 2, connectNative, {NULL}},
+    {"pipe", 0, pipeNative, {NULL}},
+    {"pipeWriter", 1, pipeWriterNative, {NULL}},
+    {"openFile", 1, openFileNative, {NULL}},
+    {"read", 2, readNative, {NULL}},
+    {"write", 2, writeNative, {NULL}},
+    {"closeFd", 1, closeFdNative, {NULL}},
+};
+
+#define NATIVE_COUNT ((int)(sizeof(natives) / sizeof(natives[0])))
+
+const NativeEntry* findNative(const char* name, int length){
+    for(int i = 0; i < NATIVE_COUNT; i++){
+        if((int)strlen(natives[i].name) == length && memcmp(natives[i].name, name, length) == 0) {
+            return &natives[i];
+        }
+    }
+    return NULL;
 }
 
-void push(Value value){
-    if(vm.stackCapacity < vm.stackCount + 1){
-        int oldCapacity = vm.stackCapacity;
-        vm.stackCapacity = GROW_CAPACITY(oldCapacity);
-        vm.stack = (Value*)reallocate(vm.stack, sizeof(Value) * (oldCapacity), sizeof(Value) * (vm.stackCapacity));
+//NULL for natives defined outside the built in table
+const char* nativeName(const NativeEntry* entry){
+    for(int i = 0; i < NATIVE_COUNT; i++){
+        if(&natives[i] == entry) return natives[i].name;
     }
-    vm.stack[vm.stackCount] = value;
-    vm.stackCount++;
+    return NULL;
+}
+
+static int frameLimit = FRAMES_DEFAULT;
+
+//Frame limit for every VM initialized or restored after this
+void setFrameLimit(int limit){
+    frameLimit = limit;
+}
+
+//Charges the safepoints the running slice went through to the budget
+static void chargeTicks(VM* vm){
+    if(vm->budget <= 0) return;
+    vm->budget -= vm->slice - vm->ticks;
+    if(vm->budget < 0) vm->budget = 0;
+}
+
+//Starts a new slice, cut short by what is left of the budget. Once that
+//is gone, every safepoint takes the slow path until one can stop
+static void refillTicks(VM* vm){
+    int slice = TASK_SLICE;
+    if(vm->budget >= 0 && vm->budget < slice) slice = vm->budget > 0 ? (int)vm->budget : 1;
+    vm->ticks = slice;
+    vm->slice = slice;
+}
+
+//Safepoints the VM may go through before run() stops with
+//INTERPRET_OUT_OF_BUDGET, -1 for no limit. Compiled code has no
+//safepoints, so it isn't run while there is a budget
+void setBudget(VM* vm, long budget){
+    vm->budget = budget;
+    if(budget >= 0) vm->jit = false;
+    refillTicks(vm);
+}
+
+//Nothing is collected until the VM is freed, so once a script has gone
+//past the limit every run() on the VM stops at its first safepoint. The
+//process and any other VM carry on
+void setHeapLimit(VM* vm, size_t limit){
+    vm->heapLimit = limit;
+}
+
+//A VM with nothing defined, which is what a snapshot gets restored into.
+//False when its stacks could not be reserved, it still has to be freed
+bool initEmptyVM(VM* vm){
+    vm->framesMax = frameLimit;
+    vm->frames = reserveMemory(sizeof(CallFrame) * vm->framesMax);
+    vm->stack = reserveMemory(sizeof(Value) * vm->framesMax * FRAME_SLOTS);
+    vm->stackEnd = vm->stack == NULL ? NULL : vm->stack + vm->framesMax * FRAME_SLOTS;
+    vm->openUpvalues = NULL;
+    vm->objects = NULL;
+    vm->codeArenas = NULL;
+    vm->frameCount = 0;
+    vm->compiledDepth = 0;
+    vm->jit = false;
+    vm->recorder = NULL;
+    vm->workers = NULL;
+    vm->fiber = NULL;
+    vm->loop = NULL;
+    vm->waiting = false;
+    vm->budget = -1;
+    refillTicks(vm);
+    vm->bytesAllocated = 0;
+    vm->heapLimit = 0;
+    vm->outOfMemory = false;
+    vm->pool = NULL;
+    vm->poolIndex = -1;
+    initTable(&vm->globals);
+    initTable(&vm->strings);
+    resetStack(vm);
+    return vm->frames != NULL && vm->stack != NULL;
+}
+
+bool initVM(VM* vm){
+    if(!initEmptyVM(vm)) return false;
+    defineNatives(vm, natives, NATIVE_COUNT);
+    return true;
+}
+
+void freeVM(VM* vm){
+    joinWorkers(vm);
+    freeEventLoop(vm);
+    freeTable(&vm->strings);
+    freeTable(&vm->globals);
+    freeObjects(vm);
+    freeCodeArenas(vm);
+    releaseMemory(vm->frames, sizeof(CallFrame) * vm->framesMax);
+    releaseMemory(vm->stack, sizeof(Value) * vm->framesMax * FRAME_SLOTS);
+    vm->frames = NULL;
+    vm->stack = NULL;
 }
 
-Value pop(){
-    vm.stackCount--;
-    return vm.stack[vm.stackCount];
+void push(VM* vm, Value value){
+    *vm->stackTop = value;
+    vm->stackTop++;
 }
 
-static Value peek(int distance){
-    return vm.stack[vm.stackCount -1 - distance];
+Value pop(VM* vm){
+    vm->stackTop--;
+    return *vm->stackTop;
 }
 
 bool isFalsey(Value value){
     return IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value));
 }
 
-static bool call(ObjClosure* closure, int argCount) {
+static InterpretResult run(VM* vm, int baseFrame, ObjFiber* baseFiber);
+
+//Compiled functions recurse on the C stack, so they share the frame
+//limit and stop early if the C stack itself is getting deep
+static bool runCompiled(VM* vm, ObjFunction* function, Value* args, Value* result){
+    char marker;
+    if(vm->frameCount + vm->compiledDepth >= vm->framesMax ||
+       vm->cStackBase - (uintptr_t)&marker > C_STACK_BUDGET) {
+        runtimeError(vm, "Stack overflow.");
+        return false;
+    }
+    vm->compiledDepth++;
+    bool success = function->compiled(vm, args, result);
+    if(success) vm->compiledDepth--;
+    return success;
+}
+
+//Under --jit, counts a call or loop back edge and compiles the function
+//once it gets hot. Functions the JIT can't handle stop counting
+static inline void countHotness(VM* vm, ObjFunction* function){
+    if(!vm->jit || function->compiled != NULL || function->hotness < 0) return;
+    if(++function->hotness >= JIT_THRESHOLD && !jitCompile(vm, function)) function->hotness = -1;
+}
+
+static bool call(VM* vm, ObjClosure* closure, int argCount) {
     if(argCount != closure->function->arity) {
-        runtimeError("Expect %d arguments but got %d.", closure->function->arity, argCount);
+        runtimeError(vm, "Expect %d arguments but got %d.", closure->function->arity, argCount);
         return false;
     }
-    if(vm.frameCount == FRAMES_MAX) {
-        runtimeError("Stack overflow.");
+    Value* slots = vm->stackTop - argCount - 1;
+    countHotness(vm, closure->function);
+    //Compiled code keeps its frames on the C stack, where a fiber
+    //couldn't switch away from them, and has no safepoints for a budget
+    if(closure->function->compiled != NULL && vm->fiber == NULL && vm->budget < 0) {
+        Value result;
+        if(!runCompiled(vm, closure->function, slots, &result)) return false;
+        vm->stackTop = slots;
+        push(vm, result);
+        return true;
+    }
+    if(vm->frameCount + vm->compiledDepth >= vm->framesMax ||
+       slots + closure->function->maxStack > vm->stackEnd) {
+        runtimeError(vm, "Stack overflow.");
         return false;
     }
     //Initialize frame
-    CallFrame* frame = &vm.frames[vm.frameCount++]; 
+    CallFrame* frame = &vm->frames[vm->frameCount++]; 
     frame->closure = closure;
     frame->ip = closure->function->chunk.code;
-    frame->slots = &vm.stack[vm.stackCount - argCount - 1];
-    frame->start = vm.stackCount - argCount - 1;
+    frame->slots = slots;
     return true;
 }
 
-static bool callValue(Value callee, int argCount) {
+//Arity is already checked, the call site's inline cache comes straight here
+static inline bool callNative(VM* vm, const NativeEntry* entry, int argCount, Value* args, Value* result){
+    if(entry->fast.arity0 != NULL) {
+        switch(entry->arity){
+            case 0: *result = entry->fast.arity0(); return true;
+            case 1: *result = entry->fast.arity1(args[0]); return true;
+            default: *result = entry->fast.arity2(args[0], args[1]); return true;
+        }
+    }
+    return entry->function(vm, argCount, args, result);
+}
+
+static bool callValue(VM* vm, Value callee, int argCount) {
     if(IS_OBJ(callee)) {
         switch(OBJ_TYPE(callee)) {
             // case OBJ_FUNCTION:
-            //     return call(AS_FUNCTION(callee), argCount);
+            //     return call(vm, AS_FUNCTION(callee), argCount);
             case OBJ_CLOSURE: {
-                return call(AS_CLOSURE(callee), argCount);
+                return call(vm, AS_CLOSURE(callee), argCount);
             }
             case OBJ_NATIVE: {
-                NativeFn native = AS_NATIVE(callee);
-                Value result = native(argCount, vm.stack - argCount);
-                vm.stackCount -= argCount + 1;
-                push(result);
+                const NativeEntry* entry = AS_NATIVE(callee)->entry;
+                if(entry->arity >= 0 && argCount != entry->arity) {
+                    runtimeError(vm, "Expect %d arguments but got %d.", entry->arity, argCount);
+                    return false;
+                }
+                Value result;
+                if(!callNative(vm, entry, argCount, vm->stackTop - argCount, &result)) return false;
+                //A task parked on the event loop reruns the call, arguments and all
+                if(vm->waiting) return true;
+                vm->stackTop -= argCount + 1;
+                push(vm, result);
                 return true;
             }
             default:
                 break;
         }
     }
-    runtimeError("Can only call functions and classes");
+    runtimeError(vm, "Can only call functions and classes");
     return false;
 }
 
-static void concatenate(){
-    ObjString* bString = AS_STRING(pop());
-    ObjString* aString = AS_STRING(pop());
+//Switches to the fiber, starting its function on the first resume or
+//handing value to the yield it is suspended in. A task waiting on the
+//event loop gets nothing, it reruns the call it was suspended in
+static void enterFiber(VM* vm, ObjFiber* fiber, Value value){
+    FiberState state = fiber->state;
+    fiber->caller = vm->fiber;
+    fiber->state = FIBER_RUNNING;
+    //A task preempted inside a fiber it resumed carries on in that fiber
+    ObjFiber* top = fiber->top != NULL ? fiber->top : fiber;
+    fiber->top = NULL;
+    switchFiber(vm, top);
+    if(state == FIBER_NEW) {
+        //async() put a task's function and arguments on its stack already
+        if(!fiber->task) {
+            push(vm, OBJ_VAL(fiber->closure));
+            if(fiber->closure->function->arity == 1) push(vm, value);
+        }
+        CallFrame* frame = &vm->frames[vm->frameCount++];
+        frame->closure = fiber->closure;
+        frame->ip = fiber->closure->function->chunk.code;
+        frame->slots = vm->stack;
+    } else if(state == FIBER_SUSPENDED) {
+        push(vm, value);
+    }
+}
 
+static bool resumeFiber(VM* vm, Value target, Value value){
+    if(!IS_FIBER(target)) {
+        runtimeError(vm, "Can only resume fibers.");
+        return false;
+    }
+    ObjFiber* fiber = AS_FIBER(target);
+    if(fiber->state == FIBER_RUNNING) {
+        runtimeError(vm, "Cannot resume a running fiber.");
+        return false;
+    }
+    if(fiber->state == FIBER_DONE) {
+        runtimeError(vm, "Cannot resume a finished fiber.");
+        return false;
+    }
+    if(fiber->task) {
+        runtimeError(vm, "Cannot resume a task, the event loop runs it.");
+        return false;
+    }
+    enterFiber(vm, fiber, value);
+    return true;
+}
+
+//Runs an event loop task for up to a slice, until it finishes, yields or
+//parks itself on the loop again. Its stack goes on top of whichever one
+//is running. value gets what it yielded or returned, nil otherwise
+InterpretResult runTask(VM* vm, ObjFiber* task, Value* value){
+    enterFiber(vm, task, NIL_VAL);
+    chargeTicks(vm);
+    refillTicks(vm);
+    InterpretResult result = run(vm, 0, task);
+    *value = NIL_VAL;
+    if(result == INTERPRET_OK && (task->state == FIBER_SUSPENDED || task->state == FIBER_DONE)) {
+        *value = pop(vm);
+    }
+    return result;
+}
+
+//The task the event loop is running, if the running fiber is that task
+//or one it resumed. NULL on anything that can't be preempted
+static ObjFiber* preemptible(VM* vm){
+    ObjFiber* task = currentTask(vm);
+    if(task == NULL) return NULL;
+    for(ObjFiber* fiber = vm->fiber; fiber != NULL; fiber = fiber->caller){
+        if(fiber == task) return task;
+    }
+    return NULL;
+}
+
+//Slow path of the safepoints at OP_LOOP and OP_CALL, taken when a slice
+//runs out or the heap goes past its limit. True if run() stops there: to
+//raise that error, to preempt the task the event loop is running, or
+//because the budget was already gone on the way in and the outermost
+//run() of the VM's own stack can be resumed from here. Checking before
+//charging means a resume always gets past the safepoint it stopped at
+static bool safepoint(VM* vm, int baseFrame, ObjFiber* baseFiber){
+    bool spent = vm->budget == 0;
+    bool fullSlice = vm->slice == TASK_SLICE;
+    chargeTicks(vm);
+    refillTicks(vm);
+    if(heapExceeded(vm)) return true;
+    if(!spent && !fullSlice) return false;
+    if(preemptible(vm) != NULL) return true;
+    return spent && baseFrame == 0 && baseFiber == NULL;
+}
+
+//Where run() goes once its frame is stored: back to the event loop for a
+//task a native parked or one that was preempted, an error for a heap
+//past its limit, out to whoever can resume the VM otherwise
+static InterpretResult stopRun(VM* vm){
+    vm->waiting = false;
+    ObjFiber* fiber = vm->fiber;
+    if(fiber != NULL && fiber->state == FIBER_WAITING) {
+        switchFiber(vm, fiber->caller);
+        fiber->caller = NULL;
+        return INTERPRET_OK;
+    }
+    if(heapExceeded(vm)) {
+        memoryError(vm, NULL, 0);
+        return INTERPRET_RUNTIME_ERR;
+    }
+    //The fibers between the task and the running one stay as they are
+    ObjFiber* task = preemptible(vm);
+    if(task != NULL) {
+        task->state = FIBER_PREEMPTED;
+        task->top = fiber == task ? NULL : fiber;
+        switchFiber(vm, task->caller);
+        task->caller = NULL;
+        return INTERPRET_OK;
+    }
+    return INTERPRET_OUT_OF_BUDGET;
+}
+
+//NULL when the heap has no room for the result
+ObjString* concatenateStrings(VM* vm, ObjString* aString, ObjString* bString){
     int length = aString->length + bString->length;
-    char* chars = ALLOCATE(char, length +1);
+    char* chars = TRY_ALLOCATE(char, length +1);
+    if(chars == NULL) return NULL;
     memcpy(chars, aString->chars, aString->length);
     memcpy(chars + aString->length, bString->chars, bString->length);
     chars[length] = '\0';
     
-    ObjString* result = takeString(chars, length);
-    push(OBJ_VAL(result));
+    return takeString(vm, chars, length);
 }
 
 
-static InterpretResult run(){
-    CallFrame* frame = &vm.frames[vm.frameCount - 1];
-    //frame->ip is the instruction pointer : 
-        // Which byte is it about to execute?
-    #define READ_BYTE() (*frame->ip++)
-    #define READ_CONSTANT() (frame->closure->function->chunk.constants.values[READ_BYTE()]) 
+
+//Runs until the frame at baseFrame on baseFiber's stack returns, leaving
+//its result on the stack. Compiled code calling back into the interpreter
+//nests here
+static InterpretResult run(VM* vm, int baseFrame, ObjFiber* baseFiber){
+    //The hot state is kept in locals so it can live in registers. It is
+    //written back to the frame and vm->stackTop only around calls, returns
+    //and errors, which read it from there
+    CallFrame* frame;
+    uint8_t* ip; // instruction pointer: which byte is it about to execute?
+    Value* slots;
+    Value* constants;
+    Value* stackTop;
+    #define LOAD_FRAME() \
+        (frame = &vm->frames[vm->frameCount - 1], \
+         ip = frame->ip, \
+         slots = frame->slots, \
+         constants = frame->closure->function->chunk.constants.values, \
+         stackTop = vm->stackTop)
+    #define STORE_FRAME() (frame->ip = ip, vm->stackTop = stackTop)
+    #define READ_BYTE() (*ip++)
+    #define READ_CONSTANT() (constants[READ_BYTE()]) 
     #define READ_STRING() AS_STRING(READ_CONSTANT())
     //Takes the next two bytes from the chunk and build a 16 bit unsigned int
     #define READ_SHORT() \
-        (frame->ip += 2, (uint16_t)((frame->ip[-2] << 8) | frame->ip[-1]))
-    #define BINARY_OP(valueType, op) \
+        (ip += 2, (uint16_t)((ip[-2] << 8) | ip[-1]))
+    //value may POP() itself, so it is read before stackTop moves
+    #define PUSH(value) \
+        do { \
+            Value pushed = (value); \
+            *stackTop++ = pushed; \
+        } while(false)
+    #define POP() (*--stackTop)
+    #define PEEK(distance) (stackTop[-1 - (distance)])
+    #define RUNTIME_ERROR(...) \
         do { \
-            if(!IS_NUMBER(peek(0)) || !IS_NUMBER(peek(1))){ \
-                runtimeError("Operands must be numbers"); \
-                return INTERPRET_RUNTIME_ERR;\
-            }\
-            double b = AS_NUM(pop()); \
-            double a = AS_NUM(pop()); \
-            push(valueType(a op b)); \
+            STORE_FRAME(); \
+            runtimeError(vm, __VA_ARGS__); \
+            return INTERPRET_RUNTIME_ERR; \
+        } while(false)
+    #define MEMORY_ERROR() \
+        do { \
+            STORE_FRAME(); \
+            memoryError(vm, NULL, 0); \
+            return INTERPRET_RUNTIME_ERR; \
+        } while(false)
+    //Leaves run() with ip backed up by the part of the instruction already
+    //read, so it is where things carry on
+    #define STOP(back) \
+        do { \
+            ip -= (back); \
+            STORE_FRAME(); \
+            return stopRun(vm); \
+        } while(false)
+    //The hot path of a safepoint is one decrement and a branch
+    #define SAFEPOINT(back) \
+        do { \
+            if(--vm->ticks <= 0 && safepoint(vm, baseFrame, baseFiber)) STOP(back); \
+        } while(false)
+    //Two doubles are done here, an integer on either side goes through
+    //function, one of value.h's
+    #define BINARY_OP(valueType, op, function) \
+        do { \
+            Value b = PEEK(0); \
+            Value a = PEEK(1); \
+            if(IS_NUMBER(a) && IS_NUMBER(b)) { \
+                stackTop[-2] = valueType(AS_NUM(a) op AS_NUM(b)); \
+            } else if(IS_NUMERIC(a) && IS_NUMERIC(b)) { \
+                stackTop[-2] = function(a, b); \
+            } else { \
+                RUNTIME_ERROR("Operands must be numbers"); \
+            } \
+            stackTop--; \
         } while(false) 
+    //Two integers stay one while the result fits, overflows is the
+    //matching __builtin_*_overflow
+    #define INT_OP(op, overflows, function) \
+        do { \
+            int64_t result; \
+            if(IS_INT(PEEK(0)) && IS_INT(PEEK(1)) && \
+               !overflows(AS_INT(PEEK(1)), AS_INT(PEEK(0)), &result) && \
+               result >= INT_VAL_MIN && result <= INT_VAL_MAX) { \
+                stackTop[-2] = INT_VAL(result); \
+                stackTop--; \
+            } else { \
+                BINARY_OP(NUMBER_VAL, op, function); \
+            } \
+        } while(false)
+    #define COMPARISON_OP(op, function) \
+        do { \
+            if(IS_INT(PEEK(0)) && IS_INT(PEEK(1))) { \
+                stackTop[-2] = BOOL_VAL(AS_INT(PEEK(1)) op AS_INT(PEEK(0))); \
+                stackTop--; \
+            } else { \
+                BINARY_OP(BOOL_VAL, op, function); \
+            } \
+        } while(false)
+
+    LOAD_FRAME();
+
+    #ifdef COMPUTED_GOTO
+    //Each handler jumps straight to the next one, so every opcode gets
+    //its own indirect branch to predict instead of sharing the switch's
+    static void* dispatchTable[UINT8_COUNT] = {
+        [0 ... UINT8_MAX] = &&op_UNKNOWN,
+        [OP_CONSTANT] = &&op_OP_CONSTANT,
+        [OP_RETURN] = &&op_OP_RETURN,
+        [OP_NEGATE] = &&op_OP_NEGATE,
+        [OP_ADD] = &&op_OP_ADD,
+        [OP_INCREMENT] = &&op_OP_INCREMENT,
+        [OP_SUBTRACT] = &&op_OP_SUBTRACT,
+        [OP_MULTIPLY] = &&op_OP_MULTIPLY,
+        [OP_DIVIDE] = &&op_OP_DIVIDE,
+        [OP_NIL] = &&op_OP_NIL,
+        [OP_TRUE] = &&op_OP_TRUE,
+        [OP_FALSE] = &&op_OP_FALSE,
+        [OP_NOT] = &&op_OP_NOT,
+        [OP_EQUAL] = &&op_OP_EQUAL,
+        [OP_GREATER] = &&op_OP_GREATER,
+        [OP_LESS] = &&op_OP_LESS,
+        [OP_PRINT] = &&op_OP_PRINT,
+        [OP_POP] = &&op_OP_POP,
+        [OP_DEFINE_GLOBAL] = &&op_OP_DEFINE_GLOBAL,
+        [OP_GET_GLOBAL] = &&op_OP_GET_GLOBAL,
+        [OP_SET_GLOBAL] = &&op_OP_SET_GLOBAL,
+        [OP_GET_LOCAL] = &&op_OP_GET_LOCAL,
+        [OP_SET_LOCAL] = &&op_OP_SET_LOCAL,
+        [OP_JUMP_IF_FALSE] = &&op_OP_JUMP_IF_FALSE,
+        [OP_JUMP] = &&op_OP_JUMP,
+        [OP_LOOP] = &&op_OP_LOOP,
+        [OP_CALL] = &&op_OP_CALL,
+        [OP_CLOSURE] = &&op_OP_CLOSURE,
+        [OP_YIELD] = &&op_OP_YIELD,
+        [OP_RESUME] = &&op_OP_RESUME,
+        [OP_GET_UPVALUE] = &&op_OP_GET_UPVALUE,
+        [OP_SET_UPVALUE] = &&op_OP_SET_UPVALUE,
+        [OP_CLOSE_UPVALUE] = &&op_OP_CLOSE_UPVALUE,
+        [OP_ADD_NUM] = &&op_OP_ADD_NUM,
+        [OP_GET_GLOBAL_CACHED] = &&op_OP_GET_GLOBAL_CACHED,
+    };
+    //Swapped in while a loop is being traced, so recording costs nothing
+    //the rest of the time
+    static void* recordTable[UINT8_COUNT] = {
+        [0 ... UINT8_MAX] = &&op_RECORD,
+    };
+    void** dispatch = vm->recorder != NULL ? recordTable : dispatchTable;
+    #define DISPATCH() goto *dispatch[READ_BYTE()]
+    #define CASE(op) op_##op
+    #else
+    #define DISPATCH() break
+    #define CASE(op) case op
+    #endif
     
     while(true){
         #ifdef DEBUG_TRACE_EXECUTION
             printf("      ");
-            for(int slot = 0; slot < vm.stackCount; slot++){
+            for(Value* slot = vm->stack; slot < stackTop; slot++){
                 printf("[ ");
+                printValue(*slot);
                 printf(" ]");
             }
             printf("\n");
             // vm.ip will always represent the next set of instructions,
             //So we will need to minus the 
-            disassembleInstruction(&frame->closure->function->chunk, (int)(frame->ip - frame->closure->function->chunk.code));
+            disassembleInstruction(&frame->closure->function->chunk, (int)(ip - frame->closure->function->chunk.code));
             
         #endif
-        uint8_t instructions;
-
-        switch(instructions = READ_BYTE()) {
-            case OP_CONSTANT:{
+        #ifdef COMPUTED_GOTO
+        DISPATCH();
+        #else
+        if(vm->recorder != NULL) {
+            STORE_FRAME();
+            traceRecord(vm, ip, stackTop);
+        }
+        switch(READ_BYTE())
+        #endif
+        {
+            CASE(OP_CONSTANT):{
                 Value constant = READ_CONSTANT();
-                push(constant);
-                break;
+                PUSH(constant);
+                DISPATCH();
             }
                
-            case OP_RETURN: {
-                Value result = pop();
-                vm.frameCount--;
-                //Last frame
-                if(vm.frameCount == 0) {
-                    pop();
-                    return INTERPRET_OK;
+            CASE(OP_RETURN): {
+                Value result = POP();
+                //Closures made by this call keep its variables past it
+                if(vm->openUpvalues != NULL) closeUpvalues(&vm->openUpvalues, slots);
+                vm->frameCount--;
+                stackTop = slots;
+                PUSH(result);
+                vm->stackTop = stackTop;
+                if(vm->frameCount == 0 && vm->fiber != NULL) {
+                    //The fiber's function returned, its resumer gets the result
+                    ObjFiber* fiber = vm->fiber;
+                    fiber->state = FIBER_DONE;
+                    switchFiber(vm, fiber->caller);
+                    fiber->caller = NULL;
+                    freeFiberStack(fiber);
+                    if(fiber == baseFiber) {
+                        push(vm, result);
+                        return INTERPRET_OK;
+                    }
+                    LOAD_FRAME();
+                    PUSH(result);
+                    DISPATCH();
                 }
-                vm.stackCount = frame->start;
-                push(result);
-                frame = &vm.frames[vm.frameCount-1];
-                break;      
+                if(vm->frameCount == baseFrame && vm->fiber == baseFiber) return INTERPRET_OK;
+                LOAD_FRAME();
+                DISPATCH();      
             }
             
-            case OP_NEGATE:
+            CASE(OP_NEGATE):
                 //Makes the top number negative
-                if(!IS_NUMBER(peek(0))){
-                    runtimeError("Operand must be a number");
-                    return INTERPRET_RUNTIME_ERR;
+                if(!IS_NUMERIC(PEEK(0))){
+                    RUNTIME_ERROR("Operand must be a number");
                 }
-                push(NUMBER_VAL(-AS_NUM(pop())));
-                break;
-            case OP_ADD:
-                if(IS_STRING(peek(0)) && IS_STRING(peek(1))) {
-                    concatenate();
+                PUSH(negateValue(POP()));
+                DISPATCH();
+            CASE(OP_ADD):
+                if(IS_STRING(PEEK(0)) && IS_STRING(PEEK(1))) {
+                    ObjString* b = AS_STRING(POP());
+                    ObjString* a = AS_STRING(POP());
+                    ObjString* joined = concatenateStrings(vm, a, b);
+                    if(joined == NULL) MEMORY_ERROR();
+                    PUSH(OBJ_VAL(joined));
                 } else {
-                    BINARY_OP(NUMBER_VAL,+);
+                    INT_OP(+, __builtin_add_overflow, addValues);
+                    //Numbers this time, guess it stays that way
+                    ip[-1] = OP_ADD_NUM;
                 }
               
-                break;
-            case OP_INCREMENT:{
-                if(!IS_NUMBER(peek(0))){
-                    runtimeError("Value must be number");
-                    return INTERPRET_RUNTIME_ERR;
+                DISPATCH();
+            CASE(OP_ADD_NUM):
+                if(!IS_NUMERIC(PEEK(0)) || !IS_NUMERIC(PEEK(1))) {
+                    //Guessed wrong, go back to the generic op and rerun it
+                    ip[-1] = OP_ADD;
+                    ip--;
+                    DISPATCH();
                 }
-                push(NUMBER_VAL(AS_NUM(peek(0)) + 1));
-                break;
+                INT_OP(+, __builtin_add_overflow, addValues);
+                DISPATCH();
+            CASE(OP_INCREMENT):{
+                Value value = PEEK(0);
+                if(IS_INT(value) && AS_INT(value) < INT_VAL_MAX) {
+                    PUSH(INT_VAL(AS_INT(value) + 1));
+                    DISPATCH();
+                }
+                if(!IS_NUMERIC(value)){
+                    RUNTIME_ERROR("Value must be number");
+                }
+                PUSH(NUMBER_VAL(AS_DOUBLE(value) + 1));
+                DISPATCH();
             }
-            case OP_SUBTRACT:
-                BINARY_OP(NUMBER_VAL,-);
-                break;
-            case OP_MULTIPLY:
-                BINARY_OP(NUMBER_VAL,*);
-                break;
-            case OP_DIVIDE:
-                BINARY_OP(NUMBER_VAL,/);
-                break;
-            case OP_NIL:
-                push(NIL_VAL); break;
-            case OP_TRUE:
-                push(BOOL_VAL(true)); break;
-            case OP_FALSE:
-                push(BOOL_VAL(false)); break;
-            case OP_NOT:
-                push(BOOL_VAL(isFalsey(pop()))); break;
-            case OP_EQUAL: {
-                Value b = pop();
-                Value a = pop();
-                push(BOOL_VAL(valuesEqual(a,b)));
-                break;
+            CASE(OP_SUBTRACT):
+                INT_OP(-, __builtin_sub_overflow, subtractValues);
+                DISPATCH();
+            CASE(OP_MULTIPLY):
+                INT_OP(*, __builtin_mul_overflow, multiplyValues);
+                DISPATCH();
+            CASE(OP_DIVIDE):
+                BINARY_OP(NUMBER_VAL, /, divideValues);
+                DISPATCH();
+            CASE(OP_NIL):
+                PUSH(NIL_VAL); DISPATCH();
+            CASE(OP_TRUE):
+                PUSH(BOOL_VAL(true)); DISPATCH();
+            CASE(OP_FALSE):
+                PUSH(BOOL_VAL(false)); DISPATCH();
+            CASE(OP_NOT):
+                PUSH(BOOL_VAL(isFalsey(POP()))); DISPATCH();
+            CASE(OP_EQUAL): {
+                Value b = POP();
+                Value a = POP();
+                PUSH(BOOL_VAL(valuesEqual(a,b)));
+                DISPATCH();
             }
-            case OP_GREATER:
-                BINARY_OP(BOOL_VAL, >);  break;
-            case OP_LESS:
-                BINARY_OP(BOOL_VAL, <); break;
-            case OP_PRINT:
-                printValue(pop());
+            CASE(OP_GREATER):
+                COMPARISON_OP(>, greaterValues);  DISPATCH();
+            CASE(OP_LESS):
+                COMPARISON_OP(<, lessValues); DISPATCH();
+            CASE(OP_PRINT):
+                printValue(POP());
                 printf("\n");
-                break;
-            case OP_POP: 
-                pop();
-                break;
-            case OP_DEFINE_GLOBAL: {
+                DISPATCH();
+            CASE(OP_POP): 
+                POP();
+                DISPATCH();
+            CASE(OP_DEFINE_GLOBAL): {
                 ObjString* name = READ_STRING();
-                tableSet(&vm.globals, name, peek(0));
-                pop();
-                break;
+                tableSet(&vm->globals, name, PEEK(0));
+                POP();
+                DISPATCH();
             }
-            case OP_GET_GLOBAL:{
-                ObjString* name = READ_STRING();
-                Value value;
-                if(!tableGet(&vm.globals,  name, &value)) {
-                    runtimeError("Undefined variable '%s' .",  name->chars);
-                    return INTERPRET_RUNTIME_ERR;
+            CASE(OP_GET_GLOBAL):{
+                uint8_t index = READ_BYTE();
+                ObjString* name = AS_STRING(constants[index]);
+                Entry* entry = tableGetEntry(&vm->globals, name);
+                if(entry == NULL) {
+                    RUNTIME_ERROR("Undefined variable '%s' .",  name->chars);
                 }
-                push(value);
-                break;
+                PUSH(entry->value);
+                //Remember where it was so next time skips the hashing
+                chunkGlobalSlots(&frame->closure->function->chunk)[index] = (int)(entry - vm->globals.entries);
+                ip[-2] = OP_GET_GLOBAL_CACHED;
+                DISPATCH();
+            }
+            CASE(OP_GET_GLOBAL_CACHED):{
+                uint8_t index = READ_BYTE();
+                int slot = frame->closure->function->chunk.globalSlots[index];
+                //The table may have grown or had the entry deleted since
+                if(slot < vm->globals.capacity && vm->globals.entries[slot].key == AS_STRING(constants[index])) {
+                    PUSH(vm->globals.entries[slot].value);
+                    DISPATCH();
+                }
+                ip[-2] = OP_GET_GLOBAL;
+                ip -= 2;
+                DISPATCH();
             }
             
-            case OP_SET_GLOBAL:{
+            CASE(OP_SET_GLOBAL):{
                 ObjString* name = READ_STRING();
-                if(tableSet(&vm.globals, name, peek(0))) {
-                    tableDelete(&vm.globals, name);
-                    runtimeError("Undefined variable '%s'.", name->chars);
-                    return INTERPRET_RUNTIME_ERR;
+                if(tableSet(&vm->globals, name, PEEK(0))) {
+                    tableDelete(&vm->globals, name);
+                    RUNTIME_ERROR("Undefined variable '%s'.", name->chars);
                 }
-                break;
+                DISPATCH();
             }
             //Pushes the local to top
-            case OP_GET_LOCAL:{
+            CASE(OP_GET_LOCAL):{
                 uint8_t slot = READ_BYTE();
-                push(frame->slots[slot]);
-                break;
+                PUSH(slots[slot]);
+                DISPATCH();
             }
 
-            case OP_SET_LOCAL:{
+            CASE(OP_SET_LOCAL):{
                 //Sets assigned value from the top and stores in the stack slot
                 //corresponding with the local variable
                 uint8_t slot = READ_BYTE();
-                frame->slots[slot] = peek(0);
-                break;
+                slots[slot] = PEEK(0);
+                DISPATCH();
             }
+            CASE(OP_GET_UPVALUE):{
+                uint8_t slot = READ_BYTE();
+                PUSH(*frame->closure->upvalues[slot]->location);
+                DISPATCH();
+            }
+            CASE(OP_SET_UPVALUE):{
+                uint8_t slot = READ_BYTE();
+                *frame->closure->upvalues[slot]->location = PEEK(0);
+                DISPATCH();
+            }
+            CASE(OP_CLOSE_UPVALUE):
+                //The variable going out of scope is on top
+                closeUpvalues(&vm->openUpvalues, stackTop - 1);
+                stackTop--;
+                DISPATCH();
 
-            case OP_JUMP_IF_FALSE: {
+            CASE(OP_JUMP_IF_FALSE): {
                 uint16_t offset = READ_SHORT();
-                if(isFalsey(peek(0))) frame->ip += offset;
-                break;
+                if(isFalsey(PEEK(0))) ip += offset;
+                DISPATCH();
             }
-            case OP_JUMP: {
+            CASE(OP_JUMP): {
                 uint16_t offset = READ_SHORT();
-                frame->ip += offset;
-                break;
+                ip += offset;
+                DISPATCH();
             }
-            case OP_LOOP: {
+            CASE(OP_LOOP): {
+                //Before the jump, so an error there is reported from the loop
+                SAFEPOINT(1);
                 uint16_t offset = READ_SHORT();
-                frame->ip -=offset; //Sends pointer back to begin of loop
-                break;
+                ip -=offset; //Sends pointer back to begin of loop
+                countHotness(vm, frame->closure->function);
+                if(vm->jit && vm->fiber == NULL) {
+                    Chunk* chunk = &frame->closure->function->chunk;
+                    LoopCounter* loop = chunkLoop(chunk, (int)(ip - chunk->code));
+                    if(loop->trace != NULL) {
+                        STORE_FRAME();
+                        int exit = loop->trace->code(vm, slots, frame);
+                        if(exit < 0) return INTERPRET_RUNTIME_ERR;
+                        ip = chunk->code + loop->trace->exits[exit].offset;
+                        stackTop = slots + loop->trace->exits[exit].depth;
+                    } else if(loop->hotness >= 0 && vm->recorder == NULL && ++loop->hotness == TRACE_THRESHOLD) {
+                        traceStart(vm, loop);
+                        #ifdef COMPUTED_GOTO
+                        if(vm->recorder != NULL) dispatch = recordTable;
+                        #endif
+                    }
+                }
+                DISPATCH();
             }
-            case OP_CALL: {
+            CASE(OP_CALL): {
+                SAFEPOINT(1);
                 int argCount = READ_BYTE();
-                if(!callValue(peek(argCount), argCount)){
+                uint8_t site = READ_BYTE();
+                Value callee = PEEK(argCount);
+                Obj** cache = frame->closure->function->chunk.callCache;
+
+                //Same callee as last time at this site: the type and arity
+                //were already checked, only the stack limits are left
+                if(cache != NULL && site != CALL_SITE_NONE && IS_OBJ(callee) && cache[site] == AS_OBJ(callee)) {
+                    if(AS_OBJ(callee)->type == OBJ_NATIVE) {
+                        STORE_FRAME();
+                        Value result;
+                        if(!callNative(vm, AS_NATIVE(callee)->entry, argCount, stackTop - argCount, &result)) {
+                            return INTERPRET_RUNTIME_ERR;
+                        }
+                        if(vm->waiting) STOP(3);
+                        stackTop -= argCount + 1;
+                        PUSH(result);
+                        DISPATCH();
+                    }
+                    ObjClosure* closure = AS_CLOSURE(callee);
+                    Value* calleeSlots = stackTop - argCount - 1;
+                    countHotness(vm, closure->function);
+                    if(closure->function->compiled == NULL &&
+                       vm->frameCount + vm->compiledDepth < vm->framesMax &&
+                       calleeSlots + closure->function->maxStack <= vm->stackEnd) {
+                        STORE_FRAME();
+                        CallFrame* next = &vm->frames[vm->frameCount++];
+                        next->closure = closure;
+                        next->ip = closure->function->chunk.code;
+                        next->slots = calleeSlots;
+                        LOAD_FRAME();
+                        DISPATCH();
+                    }
+                }
+
+                STORE_FRAME();
+                if(!callValue(vm, callee, argCount)){
                     return INTERPRET_RUNTIME_ERR;
                 }
-                frame = &vm.frames[vm.frameCount - 1];
-                break;
+                if(vm->waiting) STOP(3);
+                //Compiled closures keep going through call(), which runs them
+                if(site != CALL_SITE_NONE &&
+                   (IS_NATIVE(callee) || (IS_CLOSURE(callee) && AS_CLOSURE(callee)->function->compiled == NULL))) {
+                    chunkCallCache(&frame->closure->function->chunk)[site] = AS_OBJ(callee);
+                }
+                LOAD_FRAME();
+                DISPATCH();
             }
-            case OP_CLOSURE:{
+            CASE(OP_CLOSURE):{
                 ObjFunction* function = AS_FUNCTION(READ_CONSTANT());
-                ObjClosure* closure = newClosure(function);
-                push(OBJ_VAL(closure));
-                break;
+                ObjClosure* closure = newClosure(vm, function);
+                if(closure == NULL) MEMORY_ERROR();
+                //Each upvalue follows as an OP_CAPTURE
+                for(int i = 0; i < closure->upvalueCount; i++){
+                    ip++;
+                    uint8_t isLocal = READ_BYTE();
+                    uint8_t index = READ_BYTE();
+                    closure->upvalues[i] = isLocal ? captureUpvalue(vm, slots + index) : frame->closure->upvalues[index];
+                    if(closure->upvalues[i] == NULL) MEMORY_ERROR();
+                }
+                PUSH(OBJ_VAL(closure));
+                DISPATCH();
             }
+            CASE(OP_YIELD): {
+                Value value = POP();
+                if(vm->fiber == NULL) RUNTIME_ERROR("Can only yield from inside a fiber.");
+                STORE_FRAME();
+                ObjFiber* fiber = vm->fiber;
+                fiber->state = FIBER_SUSPENDED;
+                switchFiber(vm, fiber->caller);
+                fiber->caller = NULL;
+                if(fiber == baseFiber) {
+                    push(vm, value);
+                    return INTERPRET_OK;
+                }
+                LOAD_FRAME();
+                PUSH(value);
+                DISPATCH();
+            }
+            CASE(OP_RESUME): {
+                Value value = POP();
+                Value target = POP();
+                STORE_FRAME();
+                if(!resumeFiber(vm, target, value)) return INTERPRET_RUNTIME_ERR;
+                LOAD_FRAME();
+                DISPATCH();
+            }
+            #ifdef COMPUTED_GOTO
+            //Opcodes without a handler are skipped, like the switch does
+            op_UNKNOWN:
+                DISPATCH();
+            op_RECORD:
+                //A nested run() may have finished the recording already
+                if(vm->recorder != NULL) {
+                    STORE_FRAME();
+                    traceRecord(vm, ip - 1, stackTop);
+                }
+                if(vm->recorder == NULL) dispatch = dispatchTable;
+                goto *dispatchTable[ip[-1]];
+            #endif
         }
     }
+    #undef LOAD_FRAME
+    #undef STORE_FRAME
+    #undef PUSH
+    #undef POP
+    #undef PEEK
+    #undef RUNTIME_ERROR
+    #undef MEMORY_ERROR
+    #undef STOP
+    #undef SAFEPOINT
+    #undef BINARY_OP
+    #undef INT_OP
+    #undef COMPARISON_OP
+    #undef DISPATCH
+    #undef CASE
     #undef READ_BYTE 
     #undef READ_STRING
     #undef READ_SHORT
     #undef READ_CONSTANT
 }
 
-InterpretResult interpret(const char* source){
-    ObjFunction* function = compile(source);
-    if(function == NULL) return INTERPRET_COMPILE_ERR;
-    push(OBJ_VAL(function));
+//Tasks the script started but never waited for still get to finish
+static InterpretResult drainTasks(VM* vm){
+    if(!drainEventLoop(vm)) return INTERPRET_RUNTIME_ERR;
+    if(vm->budget == 0 && readyTasks(vm) > 0) return INTERPRET_OUT_OF_BUDGET;
+    return INTERPRET_OK;
+}
+
+//Drops the script's result, which the closure's slot was swapped for
+static InterpretResult finishScript(VM* vm){
+    pop(vm);
+    return drainTasks(vm);
+}
+
+//Runs a script that has already been compiled, i.e by compileParallel
+static InterpretResult runFunction(VM* vm, ObjFunction* function){
+    char marker;
+    if(vm->frameCount == 0 && vm->compiledDepth == 0) vm->cStackBase = (uintptr_t)&marker;
+    push(vm, OBJ_VAL(function));
     //Initialize callframe for script
-    ObjClosure* closure = newClosure(function);
-    pop();
-    push(OBJ_VAL(closure));
-    callValue(pop(), 0);
-    return run();
+    ObjClosure* closure = newClosure(vm, function);
+    pop(vm);
+    if(closure == NULL) {
+        memoryError(vm, NULL, 0);
+        return INTERPRET_RUNTIME_ERR;
+    }
+    push(vm, OBJ_VAL(closure));
+    //The closure stays in slot zero, OP_RETURN swaps it for the result
+    if(!call(vm, closure, 0)) return INTERPRET_RUNTIME_ERR;
+    InterpretResult result = vm->frameCount > 0 ? run(vm, 0, NULL) : INTERPRET_OK;
+    return result == INTERPRET_OK ? finishScript(vm) : result;
+}
+
+static InterpretResult resumeScript(VM* vm){
+    char marker;
+    vm->cStackBase = (uintptr_t)&marker;
+    if(vm->frameCount == 0) return drainTasks(vm);
+    InterpretResult result = run(vm, 0, NULL);
+    return result == INTERPRET_OK ? finishScript(vm) : result;
+}
+
+static InterpretResult runCall(VM* vm, int argCount, Value* result){
+    char marker;
+    vm->cStackBase = (uintptr_t)&marker;
+    if(!callValue(vm, vm->stackTop[-1 - argCount], argCount)) return INTERPRET_RUNTIME_ERR;
+    if(vm->frameCount > 0 && run(vm, 0, NULL) != INTERPRET_OK) return INTERPRET_RUNTIME_ERR;
+    *result = pop(vm);
+    return drainEventLoop(vm) ? INTERPRET_OK : INTERPRET_RUNTIME_ERR;
+}
+
+//The entry points below charge what the VM allocates to its own heap
+
+InterpretResult interpretFunction(VM* vm, ObjFunction* function){
+    VM* previous = useHeap(vm);
+    InterpretResult result = runFunction(vm, function);
+    useHeap(previous);
+    return result;
+}
+
+//Carries on after INTERPRET_OUT_OF_BUDGET, once setBudget has given the
+//VM more. A call that stopped waiting on tasks needs at least 2 to get
+//anywhere, one for the call itself and one for the tasks
+InterpretResult interpretResume(VM* vm){
+    VM* previous = useHeap(vm);
+    InterpretResult result = resumeScript(vm);
+    useHeap(previous);
+    return result;
+}
+
+//Calls what a VM with nothing running has pushed, i.e. a worker's
+//function and its arguments
+InterpretResult interpretCall(VM* vm, int argCount, Value* result){
+    VM* previous = useHeap(vm);
+    InterpretResult status = runCall(vm, argCount, result);
+    useHeap(previous);
+    return status;
+}
+
+//OP_CALL from compiled code. Compiled callees are called directly on
+//the caller's slots, anything else is pushed and run on the VM stack
+bool callCompiled(VM* vm, Value* args, int argCount, Value* result){
+    Value callee = args[0];
+    if(IS_CLOSURE(callee) && AS_CLOSURE(callee)->function->compiled != NULL) {
+        ObjFunction* function = AS_CLOSURE(callee)->function;
+        if(argCount != function->arity) {
+            runtimeError(vm, "Expect %d arguments but got %d.", function->arity, argCount);
+            return false;
+        }
+        return runCompiled(vm, function, args, result);
+    }
+
+    if(vm->stackTop + argCount + 1 > vm->stackEnd) {
+        runtimeError(vm, "Stack overflow.");
+        return false;
+    }
+    for(int i = 0; i <= argCount; i++) push(vm, args[i]);
+    int baseFrame = vm->frameCount;
+    if(!callValue(vm, callee, argCount)) return false;
+    if(vm->frameCount > baseFrame && run(vm, baseFrame, vm->fiber) != INTERPRET_OK) return false;
+    *result = pop(vm);
+    return true;
+}
+
+InterpretResult interpret(VM* vm, const char* source){
+    ObjFunction* function = compile(vm, source);
+    if(function == NULL) return INTERPRET_COMPILE_ERR;
+    return interpretFunction(vm, function);
 }
 
@@ -7,38 +7,94 @@
 #include "object.h"
 #include "compiler.h"
 #include "table.h"
+#include "memory.h"
 
-#define FRAMES_MAX 64
-typedef struct {
+//Call depth allowed unless --max-frames says otherwise, and the most
+//it will accept. Frames and stack are reserved for the limit up front,
+//but memory is only committed as calls actually get that deep
+#define FRAMES_DEFAULT 4096
+#define FRAMES_LIMIT (1 << 20)
+//Value stack reserved per frame
+#define FRAME_SLOTS UINT8_COUNT
+//Compiled code recurses on the C stack, which runs out well before the
+//frame limit can be reached that way
+#define C_STACK_BUDGET (4 * 1024 * 1024)
+//Frames a fiber's stack is reserved for
+#define FIBER_FRAMES 1024
+//Safepoints (loop back edges and calls) an event loop task runs through
+//before it is preempted
+#define TASK_SLICE 10000
+typedef struct CallFrame {
     ObjClosure* closure;
     uint8_t* ip;
     Value* slots; // points to first slot this function uses
-    int start;
 } CallFrame;
-typedef struct{
-    CallFrame frames[FRAMES_MAX];
+//One interpreter. Every function that touches interpreter state takes
+//the VM it works on, so a process can run several, one per thread
+struct VM {
+    //The running stack, the VM's own or a fiber's. Neither is ever moved,
+    //so pointers into them stay valid while they grow. call() checks each
+    //function's maxStack against stackEnd, push and pop don't check
+    CallFrame* frames;
     int frameCount;
+    int framesMax;
     Value* stack;
-    int stackCount;
-    int stackCapacity;
+    Value* stackEnd;
+    Value* stackTop;
+    ObjUpvalue* openUpvalues; // captured slots of the running stack, deepest first
     Table strings;
     Table globals;
     Obj* objects;
-} VM;
+    CodeArena* codeArenas;
+    int compiledDepth; // nested calls into compiled code, counted against framesMax
+    uintptr_t cStackBase; // C stack address at the outermost interpretFunction
+    bool jit; // compile hot functions and loops to machine code
+    struct TraceRecorder* recorder; // set while --jit records a loop
+    struct Worker* workers; // spawned from this VM, joined by freeVM
+    ObjFiber* fiber; // running fiber, NULL on the VM's own stack
+    FiberStack rootStack; // the VM's own stack while a fiber runs
+    struct EventLoop* loop; // created by the first native that needs it
+    bool waiting; // a native just parked the running task on the loop
+    int ticks; // safepoints left in the running slice
+    int slice; // what ticks started from
+    long budget; // safepoints left before run() stops, -1 for no limit
+    size_t bytesAllocated; // charged by reallocate while the VM runs
+    size_t heapLimit; // bytes past which it raises an error, 0 for no limit
+    bool outOfMemory; // malloc came back empty, raised like the limit
+    struct Pool* pool; // submit()'s threads, shared by the VMs running on them
+    int poolIndex; // which of the pool's workers this VM is, -1 for none
+};
 
 typedef enum{
     INTERPRET_OK,
     INTERPRET_RUNTIME_ERR,
     INTERPRET_COMPILE_ERR,
+    INTERPRET_OUT_OF_BUDGET, // stopped at a safepoint, interpretResume goes on
 } InterpretResult;
 
 
-void initVM();
-void freeVM();
-void push();
-Value pop();
-InterpretResult interpret(const char* source);
-
-extern VM vm;
+void setFrameLimit(int limit);
+void setBudget(VM* vm, long budget);
+void setHeapLimit(VM* vm, size_t limit);
+bool initVM(VM* vm);
+bool initEmptyVM(VM* vm);
+void freeVM(VM* vm);
+void defineNatives(VM* vm, const NativeEntry* entries, int count);
+const NativeEntry* findNative(const char* name, int length);
+const char* nativeName(const NativeEntry* entry);
+void nativeError(VM* vm, const char* format, ...);
+void push(VM* vm, Value value);
+Value pop(VM* vm);
+bool isFalsey(Value value);
+ObjString* concatenateStrings(VM* vm, ObjString* a, ObjString* b);
+//Entry points for code generated by --emit-c
+bool callCompiled(VM* vm, Value* args, int argCount, Value* result);
+void compiledError(VM* vm, ObjFunction* function, int line, const char* format, ...);
+void memoryError(VM* vm, ObjFunction* function, int line);
+InterpretResult interpret(VM* vm, const char* source);
+InterpretResult interpretFunction(VM* vm, ObjFunction* function);
+InterpretResult interpretCall(VM* vm, int argCount, Value* result);
+InterpretResult interpretResume(VM* vm);
+InterpretResult runTask(VM* vm, ObjFiber* task, Value* value);
 
 #endif
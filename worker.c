@@ -0,0 +1,639 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+#include "worker.h"
+#include "io.h"
+#include "memory.h"
+#include "table.h"
+#include "vm.h"
+
+//Workers are whole VMs on their own threads. Nothing in one heap is
+//ever reachable from another: values cross over as deep copies, and a
+//channel is the only thing two VMs hold at once.
+
+//A value in flight, copied out of the sender's heap along with every
+//object it reaches. The receiver copies it again into its own heap.
+//Messages and channels belong to no VM, whichever thread frees them,
+//so no VM's heap limit is charged for them
+typedef struct {
+    Value value;
+    Obj* objects;
+} Message;
+
+struct Channel {
+    pthread_mutex_t lock;
+    pthread_cond_t notEmpty;
+    pthread_cond_t notFull;
+    int refs; // ObjChannels pointing here, across every VM
+    bool closed;
+    int capacity;
+    int head; // oldest message in the ring
+    int count;
+    Message* messages;
+    //eventfds for VMs with an event loop, which can't block their thread
+    //on the conditions. Opened by the first one to wait, -1 until then
+    int notEmptyFd;
+    int notFullFd;
+};
+
+typedef struct Worker {
+    VM vm;
+    pthread_t thread;
+    int argCount;
+    Channel* result;
+    struct Worker* next;
+} Worker;
+
+static Message packMessage(Value value){
+    Message message = {value, NULL};
+    if(!IS_OBJ(value)) return message;
+    VM* previous = useHeap(NULL);
+    //Strings only need interning within the message
+    Table strings;
+    initTable(&strings);
+    message.value = copyValue(&message.objects, &strings, value);
+    freeTable(&strings);
+    useHeap(previous);
+    return message;
+}
+
+static void freeMessage(Message* message){
+    VM* previous = useHeap(NULL);
+    Obj* object = message->objects;
+    while(object != NULL){
+        Obj* next = object->next;
+        freeObject(object);
+        object = next;
+    }
+    message->objects = NULL;
+    useHeap(previous);
+}
+
+static Value unpackMessage(VM* vm, Message* message){
+    Value value = copyValue(&vm->objects, &vm->strings, message->value);
+    freeMessage(message);
+    return value;
+}
+
+//Starts with no references, the first ObjChannel takes one
+static Channel* allocateChannel(int capacity){
+    VM* previous = useHeap(NULL);
+    Channel* channel = ALLOCATE(Channel, 1);
+    pthread_mutex_init(&channel->lock, NULL);
+    pthread_cond_init(&channel->notEmpty, NULL);
+    pthread_cond_init(&channel->notFull, NULL);
+    channel->refs = 0;
+    channel->closed = false;
+    channel->capacity = capacity;
+    channel->head = 0;
+    channel->count = 0;
+    channel->messages = ALLOCATE(Message, capacity);
+    channel->notEmptyFd = -1;
+    channel->notFullFd = -1;
+    useHeap(previous);
+    return channel;
+}
+
+void retainChannel(Channel* channel){
+    pthread_mutex_lock(&channel->lock);
+    channel->refs++;
+    pthread_mutex_unlock(&channel->lock);
+}
+
+//Messages nobody received go with the last reference
+void releaseChannel(Channel* channel){
+    pthread_mutex_lock(&channel->lock);
+    bool last = --channel->refs == 0;
+    pthread_mutex_unlock(&channel->lock);
+    if(!last) return;
+
+    VM* previous = useHeap(NULL);
+    for(int i = 0; i < channel->count; i++){
+        freeMessage(&channel->messages[(channel->head + i) % channel->capacity]);
+    }
+    FREE_ARRAY(Message, channel->messages, channel->capacity);
+    if(channel->notEmptyFd >= 0) close(channel->notEmptyFd);
+    if(channel->notFullFd >= 0) close(channel->notFullFd);
+    pthread_mutex_destroy(&channel->lock);
+    pthread_cond_destroy(&channel->notEmpty);
+    pthread_cond_destroy(&channel->notFull);
+    FREE(Channel, channel);
+    useHeap(previous);
+}
+
+static void notify(int fd){
+    if(fd < 0) return;
+    uint64_t one = 1;
+    ssize_t written = write(fd, &one, sizeof(one));
+    (void)written;
+}
+
+//False if the channel is closed, or full and wait is false
+static bool channelSend(Channel* channel, Value value, bool wait){
+    Message message = packMessage(value);
+    pthread_mutex_lock(&channel->lock);
+    while(wait && !channel->closed && channel->count == channel->capacity){
+        pthread_cond_wait(&channel->notFull, &channel->lock);
+    }
+    bool sent = !channel->closed && channel->count < channel->capacity;
+    if(sent) {
+        channel->messages[(channel->head + channel->count) % channel->capacity] = message;
+        channel->count++;
+        pthread_cond_signal(&channel->notEmpty);
+        notify(channel->notEmptyFd);
+    }
+    pthread_mutex_unlock(&channel->lock);
+    if(!sent) freeMessage(&message);
+    return sent;
+}
+
+//False if there is nothing to take, after waiting for the channel to
+//be closed when wait is true
+static bool channelReceive(Channel* channel, Message* message, bool wait){
+    pthread_mutex_lock(&channel->lock);
+    while(wait && !channel->closed && channel->count == 0){
+        pthread_cond_wait(&channel->notEmpty, &channel->lock);
+    }
+    bool received = channel->count > 0;
+    if(received) {
+        *message = channel->messages[channel->head];
+        channel->head = (channel->head + 1) % channel->capacity;
+        channel->count--;
+        pthread_cond_signal(&channel->notFull);
+        notify(channel->notFullFd);
+    }
+    pthread_mutex_unlock(&channel->lock);
+    return received;
+}
+
+//Wakes everyone waiting, what is already buffered can still be received
+static void closeChannel(Channel* channel){
+    pthread_mutex_lock(&channel->lock);
+    channel->closed = true;
+    pthread_cond_broadcast(&channel->notEmpty);
+    pthread_cond_broadcast(&channel->notFull);
+    notify(channel->notEmptyFd);
+    notify(channel->notFullFd);
+    pthread_mutex_unlock(&channel->lock);
+}
+
+//The eventfd to wait on for a channel that is still full to a sender or
+//empty to a receiver, drained so only what happens from now on wakes
+//the waiter. -1 if there is no need to wait after all, or no eventfd
+static int channelWaitFd(Channel* channel, bool sending){
+    pthread_mutex_lock(&channel->lock);
+    int fd = -1;
+    if(!channel->closed && channel->count == (sending ? channel->capacity : 0)) {
+        int* slot = sending ? &channel->notFullFd : &channel->notEmptyFd;
+        if(*slot < 0) *slot = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        fd = *slot;
+        uint64_t count;
+        if(fd >= 0 && read(fd, &count, sizeof(count)) < 0) count = 0;
+    }
+    pthread_mutex_unlock(&channel->lock);
+    return fd;
+}
+
+//Hands a job's result channel value, or nothing if it failed, then
+//closes it and drops the job's reference
+void finishJob(Channel* channel, Value* value){
+    if(value != NULL) channelSend(channel, *value, false);
+    closeChannel(channel);
+    releaseChannel(channel);
+}
+
+static void* runWorker(void* argument){
+    Worker* worker = (Worker*)argument;
+    Value value;
+    bool success = interpretCall(&worker->vm, worker->argCount, &value) == INTERPRET_OK;
+    finishJob(worker->result, success ? &value : NULL);
+    freeVM(&worker->vm);
+    return NULL;
+}
+
+//Starts child from a copy of parent's globals
+static void copyGlobals(VM* child, VM* parent){
+    for(int i = 0; i < parent->globals.capacity; i++){
+        Entry* entry = &parent->globals.entries[i];
+        if(entry->key == NULL) continue;
+        Value key = copyValue(&child->objects, &child->strings, OBJ_VAL(entry->key));
+        tableSet(&child->globals, AS_STRING(key), copyValue(&child->objects, &child->strings, entry->value));
+    }
+}
+
+//submit()'s pool: a thread per core, each with a VM of its own that runs
+//the jobs it takes as event loop tasks. Every worker has a deque of jobs
+//waiting to start. It takes the newest of its own first and steals the
+//oldest from the others once it runs out. A job that has started lives
+//in its worker's heap and stays there, preemption at safepoints is what
+//lets the jobs on one worker share it
+
+//A function and its arguments in flight to whichever worker runs them
+typedef struct {
+    int count;
+    Message* values;
+    Channel* result;
+} Job;
+
+typedef struct {
+    pthread_mutex_t lock;
+    int head; // oldest job in the ring, the one thieves take
+    int count;
+    int capacity;
+    Job* jobs;
+} Deque;
+
+typedef struct {
+    VM vm;
+    pthread_t thread;
+    Deque deque;
+    struct Pool* pool;
+} PoolWorker;
+
+typedef struct Pool {
+    pthread_mutex_t lock;
+    pthread_cond_t work; // idle workers wait here for jobs
+    int queued; // jobs in all the deques together
+    bool stopping;
+    int size;
+    int next; // worker the next job from outside the pool goes to
+    PoolWorker* workers;
+} Pool;
+
+static void pushJob(Deque* deque, Job job){
+    pthread_mutex_lock(&deque->lock);
+    if(deque->count == deque->capacity) {
+        int oldCapacity = deque->capacity;
+        int capacity = GROW_CAPACITY(oldCapacity);
+        Job* jobs = ALLOCATE(Job, capacity);
+        for(int i = 0; i < deque->count; i++) jobs[i] = deque->jobs[(deque->head + i) % oldCapacity];
+        FREE_ARRAY(Job, deque->jobs, oldCapacity);
+        deque->jobs = jobs;
+        deque->head = 0;
+        deque->capacity = capacity;
+    }
+    deque->jobs[(deque->head + deque->count) % deque->capacity] = job;
+    deque->count++;
+    pthread_mutex_unlock(&deque->lock);
+}
+
+//The owner takes from the back
+static bool popJob(Deque* deque, Job* job){
+    pthread_mutex_lock(&deque->lock);
+    bool taken = deque->count > 0;
+    if(taken) {
+        deque->count--;
+        *job = deque->jobs[(deque->head + deque->count) % deque->capacity];
+    }
+    pthread_mutex_unlock(&deque->lock);
+    return taken;
+}
+
+//Thieves take from the front
+static bool stealJob(Deque* deque, Job* job){
+    pthread_mutex_lock(&deque->lock);
+    bool taken = deque->count > 0;
+    if(taken) {
+        *job = deque->jobs[deque->head];
+        deque->head = (deque->head + 1) % deque->capacity;
+        deque->count--;
+    }
+    pthread_mutex_unlock(&deque->lock);
+    return taken;
+}
+
+//Jobs from a pool worker go on its own deque, others are dealt out in turn
+static void submitJob(Pool* pool, int index, Job job){
+    pthread_mutex_lock(&pool->lock);
+    if(index < 0) index = pool->next++ % pool->size;
+    pthread_mutex_unlock(&pool->lock);
+    pushJob(&pool->workers[index].deque, job);
+    pthread_mutex_lock(&pool->lock);
+    pool->queued++;
+    pthread_cond_signal(&pool->work);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+static bool takeJob(Pool* pool, int index, Job* job){
+    pthread_mutex_lock(&pool->lock);
+    bool any = pool->queued > 0;
+    pthread_mutex_unlock(&pool->lock);
+    if(!any) return false;
+
+    bool taken = popJob(&pool->workers[index].deque, job);
+    for(int i = 1; !taken && i < pool->size; i++){
+        taken = stealJob(&pool->workers[(index + i) % pool->size].deque, job);
+    }
+    if(taken) {
+        pthread_mutex_lock(&pool->lock);
+        pool->queued--;
+        pthread_mutex_unlock(&pool->lock);
+    }
+    return taken;
+}
+
+static void startJob(VM* vm, Job* job){
+    Value values[UINT8_COUNT + 1];
+    for(int i = 0; i < job->count; i++) values[i] = unpackMessage(vm, &job->values[i]);
+    FREE_ARRAY(Message, job->values, job->count);
+    ObjFiber* task = queueTask(vm, AS_CLOSURE(values[0]), job->count - 1, values + 1);
+    if(task == NULL) {
+        memoryError(vm, NULL, 0);
+        finishJob(job->result, NULL);
+        return;
+    }
+    task->result = job->result;
+}
+
+static void* runPoolWorker(void* argument){
+    PoolWorker* worker = (PoolWorker*)argument;
+    Pool* pool = worker->pool;
+    VM* vm = &worker->vm;
+    char marker;
+    vm->cStackBase = (uintptr_t)&marker;
+    useHeap(vm);
+    while(true){
+        //Another job starts here once those already running are all
+        //waiting on something, or one of them was preempted so that one
+        //that never waits can't hold back the jobs behind it. Until then
+        //the other workers can steal it
+        Job job;
+        if((readyTasks(vm) == 0 || preemptedTasks(vm) > 0) && takeJob(pool, vm->poolIndex, &job)) startJob(vm, &job);
+        if(readyTasks(vm) > 0 || waitingTasks(vm) > 0) {
+            //A job that fails has reported it and closed its channel
+            stepEventLoop(vm, POOL_POLL_MS);
+            continue;
+        }
+        pthread_mutex_lock(&pool->lock);
+        while(pool->queued == 0 && !pool->stopping) pthread_cond_wait(&pool->work, &pool->lock);
+        bool stop = pool->queued == 0 && pool->stopping;
+        pthread_mutex_unlock(&pool->lock);
+        if(stop) break;
+    }
+    return NULL;
+}
+
+//Lets the workers finish every job there is, then frees them. started is
+//how many of them have threads
+static void stopPool(Pool* pool, int started){
+    pthread_mutex_lock(&pool->lock);
+    pool->stopping = true;
+    pthread_cond_broadcast(&pool->work);
+    pthread_mutex_unlock(&pool->lock);
+    for(int i = 0; i < pool->size; i++){
+        PoolWorker* worker = &pool->workers[i];
+        if(i < started) pthread_join(worker->thread, NULL);
+        freeVM(&worker->vm);
+        FREE_ARRAY(Job, worker->deque.jobs, worker->deque.capacity);
+        pthread_mutex_destroy(&worker->deque.lock);
+    }
+    FREE_ARRAY(PoolWorker, pool->workers, pool->size);
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->work);
+    FREE(Pool, pool);
+}
+
+//Workers start from a copy of the globals as they are when the pool is
+static Pool* startPool(VM* vm){
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    Pool* pool = ALLOCATE(Pool, 1);
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->work, NULL);
+    pool->queued = 0;
+    pool->stopping = false;
+    pool->size = cores < 1 ? 1 : cores > POOL_MAX ? POOL_MAX : (int)cores;
+    pool->next = 0;
+    pool->workers = ALLOCATE(PoolWorker, pool->size);
+    //Every worker is set up even once one fails, so stopPool can free them all
+    bool ready = true;
+    for(int i = 0; i < pool->size; i++){
+        PoolWorker* worker = &pool->workers[i];
+        //Each worker's heap is charged to it from the start
+        VM* previous = useHeap(&worker->vm);
+        ready = initVM(&worker->vm) && ready;
+        worker->vm.jit = vm->jit;
+        worker->vm.heapLimit = vm->heapLimit;
+        worker->vm.pool = pool;
+        worker->vm.poolIndex = i;
+        copyGlobals(&worker->vm, vm);
+        useHeap(previous);
+        pthread_mutex_init(&worker->deque.lock, NULL);
+        worker->deque.head = 0;
+        worker->deque.count = 0;
+        worker->deque.capacity = 0;
+        worker->deque.jobs = NULL;
+        worker->pool = pool;
+    }
+    if(!ready) {
+        stopPool(pool, 0);
+        return NULL;
+    }
+    //Thieves look at every deque, so all of them are set up first
+    for(int i = 0; i < pool->size; i++){
+        if(pthread_create(&pool->workers[i].thread, NULL, runPoolWorker, &pool->workers[i]) != 0) {
+            stopPool(pool, i);
+            return NULL;
+        }
+    }
+    return pool;
+}
+
+//A VM's workers may still be using channels it handed out, so it waits
+//for all of them before going away. The pool is stopped by the VM that
+//started it
+void joinWorkers(VM* vm){
+    if(vm->pool != NULL && vm->poolIndex < 0) {
+        stopPool(vm->pool, vm->pool->size);
+        vm->pool = NULL;
+    }
+    Worker* worker = vm->workers;
+    while(worker != NULL){
+        Worker* next = worker->next;
+        pthread_join(worker->thread, NULL);
+        FREE(Worker, worker);
+        worker = next;
+    }
+    vm->workers = NULL;
+}
+
+static Channel* channelArgument(VM* vm, Value value){
+    if(!IS_CHANNEL(value)) {
+        nativeError(vm, "Expect a channel.");
+        return NULL;
+    }
+    return AS_CHANNEL(value)->channel;
+}
+
+//spawn(fn, args...) runs fn(args...) on a new thread in a VM of its own.
+//The worker starts from a copy of the spawner's globals, with fn and
+//its arguments copied in as well. Returns a channel that receives fn's
+//result, or is closed without one if the worker fails
+bool spawnNative(VM* vm, int argCount, Value* args, Value* result){
+    if(argCount < 1 || !IS_CLOSURE(args[0])) {
+        nativeError(vm, "Can only spawn functions.");
+        return false;
+    }
+    ObjFunction* function = AS_CLOSURE(args[0])->function;
+    if(argCount - 1 != function->arity) {
+        nativeError(vm, "Expect %d arguments but got %d.", function->arity, argCount - 1);
+        return false;
+    }
+
+    Worker* worker = ALLOCATE(Worker, 1);
+    VM* child = &worker->vm;
+    //The child's heap is charged to the child, not to the VM spawning it
+    VM* previous = useHeap(child);
+    if(!initVM(child)) {
+        freeVM(child);
+        useHeap(previous);
+        FREE(Worker, worker);
+        nativeError(vm, "Could not start a worker, out of memory.");
+        return false;
+    }
+    child->jit = vm->jit;
+    child->heapLimit = vm->heapLimit;
+    copyGlobals(child, vm);
+    for(int i = 0; i < argCount; i++) push(child, copyValue(&child->objects, &child->strings, args[i]));
+    useHeap(previous);
+    worker->argCount = argCount - 1;
+    worker->result = allocateChannel(1);
+    ObjChannel* handle = newChannel(&vm->objects, worker->result);
+    retainChannel(worker->result);
+
+    if(pthread_create(&worker->thread, NULL, runWorker, worker) != 0) {
+        releaseChannel(worker->result);
+        previous = useHeap(child);
+        freeVM(child);
+        useHeap(previous);
+        FREE(Worker, worker);
+        nativeError(vm, "Could not start a worker thread.");
+        return false;
+    }
+    worker->next = vm->workers;
+    vm->workers = worker;
+    *result = OBJ_VAL(handle);
+    return true;
+}
+
+//submit(fn, args...) runs fn(args...) as a job on the pool, which is
+//started by the first submit. Returns a channel like spawn does
+bool submitNative(VM* vm, int argCount, Value* args, Value* result){
+    if(argCount < 1 || !IS_CLOSURE(args[0])) {
+        nativeError(vm, "Can only submit functions.");
+        return false;
+    }
+    ObjFunction* function = AS_CLOSURE(args[0])->function;
+    if(argCount - 1 != function->arity) {
+        nativeError(vm, "Expect %d arguments but got %d.", function->arity, argCount - 1);
+        return false;
+    }
+    if(vm->pool == NULL && (vm->pool = startPool(vm)) == NULL) {
+        nativeError(vm, "Could not start the worker pool.");
+        return false;
+    }
+
+    Job job;
+    job.count = argCount;
+    job.values = ALLOCATE(Message, argCount);
+    for(int i = 0; i < argCount; i++) job.values[i] = packMessage(args[i]);
+    job.result = allocateChannel(1);
+    ObjChannel* handle = newChannel(&vm->objects, job.result);
+    retainChannel(job.result);
+    submitJob(vm->pool, vm->poolIndex, job);
+    *result = OBJ_VAL(handle);
+    return true;
+}
+
+//channel() buffers one message, channel(n) up to n
+bool channelNative(VM* vm, int argCount, Value* args, Value* result){
+    int capacity = 1;
+    if(argCount > 1) {
+        nativeError(vm, "Expect 0 or 1 arguments but got %d.", argCount);
+        return false;
+    }
+    if(argCount == 1) {
+        if(!IS_NUMERIC(args[0]) || AS_DOUBLE(args[0]) < 1 || AS_DOUBLE(args[0]) > CHANNEL_MAX ||
+           AS_DOUBLE(args[0]) != (int)AS_DOUBLE(args[0])) {
+            nativeError(vm, "Capacity must be a whole number from 1 to %d.", CHANNEL_MAX);
+            return false;
+        }
+        capacity = (int)AS_DOUBLE(args[0]);
+    }
+    *result = OBJ_VAL(newChannel(&vm->objects, allocateChannel(capacity)));
+    return true;
+}
+
+//send waits for room, trySend gives up if there is none. Both return
+//false once the channel is closed. A VM with an event loop waits on it,
+//so its tasks keep running, and the thread only blocks if the channel
+//can't give it an eventfd
+bool sendNative(VM* vm, int argCount, Value* args, Value* result){
+    (void)argCount;
+    *result = NIL_VAL;
+    Channel* channel = channelArgument(vm, args[0]);
+    if(channel == NULL) return false;
+    resumedCall(vm, NULL);
+    while(vm->loop != NULL){
+        if(channelSend(channel, args[1], false)) {
+            *result = BOOL_VAL(true);
+            return true;
+        }
+        int fd = channelWaitFd(channel, true);
+        if(fd < 0) break;
+        WaitResult wait = waitFor(vm, fd, EPOLLIN);
+        if(wait != WAIT_READY) return wait == WAIT_SUSPENDED;
+    }
+    *result = BOOL_VAL(channelSend(channel, args[1], true));
+    return true;
+}
+
+bool trySendNative(VM* vm, int argCount, Value* args, Value* result){
+    (void)argCount;
+    Channel* channel = channelArgument(vm, args[0]);
+    if(channel == NULL) return false;
+    *result = BOOL_VAL(channelSend(channel, args[1], false));
+    return true;
+}
+
+//receive waits for a message, tryReceive doesn't. Both return nil when
+//there is none to take. receive waits like send does
+bool receiveNative(VM* vm, int argCount, Value* args, Value* result){
+    (void)argCount;
+    *result = NIL_VAL;
+    Channel* channel = channelArgument(vm, args[0]);
+    if(channel == NULL) return false;
+    resumedCall(vm, NULL);
+    Message message;
+    while(vm->loop != NULL){
+        if(channelReceive(channel, &message, false)) {
+            *result = unpackMessage(vm, &message);
+            return true;
+        }
+        int fd = channelWaitFd(channel, false);
+        if(fd < 0) break;
+        WaitResult wait = waitFor(vm, fd, EPOLLIN);
+        if(wait != WAIT_READY) return wait == WAIT_SUSPENDED;
+    }
+    *result = channelReceive(channel, &message, true) ? unpackMessage(vm, &message) : NIL_VAL;
+    return true;
+}
+
+bool tryReceiveNative(VM* vm, int argCount, Value* args, Value* result){
+    (void)argCount;
+    Channel* channel = channelArgument(vm, args[0]);
+    if(channel == NULL) return false;
+    Message message;
+    *result = channelReceive(channel, &message, false) ? unpackMessage(vm, &message) : NIL_VAL;
+    return true;
+}
+
+bool closeNative(VM* vm, int argCount, Value* args, Value* result){
+    (void)argCount;
+    Channel* channel = channelArgument(vm, args[0]);
+    if(channel == NULL) return false;
+    closeChannel(channel);
+    *result = NIL_VAL;
+    return true;
+}
@@ -0,0 +1,29 @@
+#ifndef cInterp_worker_h
+#define cInterp_worker_h
+
+#include "common.h"
+#include "object.h"
+
+//Most messages a channel will buffer, channel() alone buffers one
+#define CHANNEL_MAX (1 << 20)
+//Most threads submit()'s pool gets, it has one per core up to this
+#define POOL_MAX 64
+//Longest a pool worker with tasks waiting on the event loop goes without
+//looking for new jobs, in milliseconds
+#define POOL_POLL_MS 10
+
+void retainChannel(Channel* channel);
+void releaseChannel(Channel* channel);
+void finishJob(Channel* channel, Value* value);
+void joinWorkers(VM* vm);
+
+bool spawnNative(VM* vm, int argCount, Value* args, Value* result);
+bool submitNative(VM* vm, int argCount, Value* args, Value* result);
+bool channelNative(VM* vm, int argCount, Value* args, Value* result);
+bool sendNative(VM* vm, int argCount, Value* args, Value* result);
+bool trySendNative(VM* vm, int argCount, Value* args, Value* result);
+bool receiveNative(VM* vm, int argCount, Value* args, Value* result);
+bool tryReceiveNative(VM* vm, int argCount, Value* args, Value* result);
+bool closeNative(VM* vm, int argCount, Value* args, Value* result);
+
+#endif